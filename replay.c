@@ -0,0 +1,384 @@
+/* Replay a trace written by a -DRADIX_TRACE build against the library and report
+ * throughput, latency percentiles and memory.
+ *
+ * usage: rradix-replay [-f flags] [-k] trace
+ *   -f flags  tree flags added to every tree of the trace, e.g. -f 128 for RADIX_FILTER
+ *   -k        instead of the report, print the keys of each tree as it is freed, then
+ *             those of the trees left at the end: "tree <id>: <n> keys", then one key
+ *             per line in hex, in key order
+ * */
+
+#define _DEFAULT_SOURCE
+
+#include <rradix.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define NUM_OPS 8
+
+static const char *op_names[NUM_OPS] = { "new", "free", "insert", "del", "find", "budget", "expire", "insert_ttl" };
+
+typedef struct record {
+	uint8_t op;
+	uint32_t tree;
+	uint64_t duration; /* of the traced call */
+	uint64_t a; /* key offset in the trace, flags, budget or now */
+	uint64_t b; /* key length, value_size, whether evict is set or budget */
+	uint64_t expire; /* RADIX_TRACE_INSERT_TTL only */
+	bool null; /* inserts of a NULL value */
+} record;
+
+typedef struct trace {
+	uint8_t *data;
+	size_t size;
+	size_t pos;
+	record *records;
+	size_t num_records;
+	uint64_t span; /* nanoseconds between the first and the last call */
+	uint32_t num_trees;
+} trace;
+
+static bool
+read_varint(trace *tr, uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64 && tr->pos < tr->size; shift += 7)
+	{
+		uint8_t byte = tr->data[tr->pos++];
+		*v |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+static int
+load_trace(trace *tr, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		perror(path);
+		return 0;
+	}
+
+	fseek(f, 0, SEEK_END);
+	tr->size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	tr->data = malloc(tr->size ? tr->size : 1);
+	if (tr->data == NULL || fread(tr->data, 1, tr->size, f) != tr->size)
+	{
+		fprintf(stderr, "%s: cannot read the trace\n", path);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	if (tr->size < 8 || memcmp(tr->data, RADIX_TRACE_MAGIC, 8))
+	{
+		fprintf(stderr, "%s: not a rradix trace\n", path);
+		return 0;
+	}
+
+	size_t capacity = 0;
+	tr->pos = 8;
+	while (tr->pos < tr->size)
+	{
+		if (tr->num_records == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 1024;
+			record *records = realloc(tr->records, capacity * sizeof(*records));
+			if (records == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				return 0;
+			}
+			tr->records = records;
+		}
+
+		record *r = &tr->records[tr->num_records];
+		uint64_t tree, gap;
+		r->op = tr->data[tr->pos] & ~RADIX_TRACE_NULL;
+		r->null = tr->data[tr->pos++] & RADIX_TRACE_NULL;
+		if (r->op >= NUM_OPS || !read_varint(tr, &tree) || !read_varint(tr, &gap) || !read_varint(tr, &r->duration))
+			break;
+
+		r->tree = tree;
+		r->a = r->b = r->expire = 0;
+		if (r->op == RADIX_TRACE_NEW || r->op == RADIX_TRACE_BUDGET || r->op == RADIX_TRACE_EXPIRE)
+		{
+			if (!read_varint(tr, &r->a) || !read_varint(tr, &r->b))
+				break;
+		}
+		else if (r->op != RADIX_TRACE_FREE)
+		{
+			if (!read_varint(tr, &r->b) || r->b > tr->size - tr->pos)
+				break;
+			r->a = tr->pos;
+			tr->pos += r->b;
+			if (r->op == RADIX_TRACE_INSERT_TTL && !read_varint(tr, &r->expire))
+				break;
+		}
+
+		if (tr->num_records)
+			tr->span += gap;
+		if (r->tree > tr->num_trees)
+			tr->num_trees = r->tree;
+		++tr->num_records;
+	}
+
+	/* a trace cut short by a crash still replays up to the last whole record */
+	if (tr->pos < tr->size)
+		fprintf(stderr, "warning: trace truncated after %zu calls\n", tr->num_records);
+
+	return 1;
+}
+
+static uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t
+percentile(uint64_t *sorted, size_t n, double p)
+{
+	size_t i = (size_t)(p * (n - 1) + 0.5);
+	return sorted[i];
+}
+
+static void
+dump_keys(uint32_t id, radix_tree *t)
+{
+	radix_iter it;
+	size_t n = 0;
+
+	radix_iter_init(&it, t);
+	while (radix_iter_next(&it))
+		++n;
+	radix_iter_free(&it);
+
+	printf("tree %u: %zu keys\n", id, n);
+	radix_iter_init(&it, t);
+	while (radix_iter_next(&it))
+	{
+		for (size_t i = 0; i < it.key_len; ++i)
+			printf("%02x", it.key[i]);
+		putchar('\n');
+	}
+	radix_iter_free(&it);
+}
+
+static void
+report_latencies(const char *label, uint64_t *lat, size_t n)
+{
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	printf("  %-9s p50 %7llu  p90 %7llu  p99 %7llu  p99.9 %7llu  max %9llu ns\n", label,
+		(unsigned long long)percentile(lat, n, 0.5), (unsigned long long)percentile(lat, n, 0.9),
+		(unsigned long long)percentile(lat, n, 0.99), (unsigned long long)percentile(lat, n, 0.999),
+		(unsigned long long)lat[n - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t extra_flags = 0;
+	bool keys = false;
+	const char *path = NULL;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "-f") && i + 1 < argc)
+			extra_flags = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-k"))
+			keys = true;
+		else
+			path = argv[i];
+	}
+
+	if (path == NULL)
+	{
+		fprintf(stderr, "usage: %s [-f flags] [-k] trace\n", argv[0]);
+		return 2;
+	}
+
+	trace tr = { 0 };
+	if (!load_trace(&tr, path))
+		return 1;
+
+	radix_tree **trees = calloc(tr.num_trees + 1, sizeof(*trees));
+	uint64_t *latencies[NUM_OPS];
+	uint64_t *recorded[NUM_OPS];
+	size_t counts[NUM_OPS] = { 0 };
+	for (int op = 0; op < NUM_OPS; ++op)
+	{
+		latencies[op] = malloc((tr.num_records + 1) * sizeof(uint64_t));
+		recorded[op] = malloc((tr.num_records + 1) * sizeof(uint64_t));
+		if (latencies[op] == NULL || recorded[op] == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+
+	/* values are not traced, only whether they are NULL: pointer trees get a dummy
+	 * pointer, inline trees zeroes */
+	uint8_t *value = NULL;
+	size_t value_size = 0;
+	size_t memory = 0, peak_memory = 0;
+	size_t skipped = 0;
+
+	uint64_t start = clock_ns();
+	for (size_t i = 0; i < tr.num_records; ++i)
+	{
+		record *r = &tr.records[i];
+		if (r->tree == 0 || (r->op != RADIX_TRACE_NEW && trees[r->tree] == NULL))
+		{
+			++skipped;
+			continue;
+		}
+
+		radix_tree *t = trees[r->tree];
+		uint8_t *key = tr.data + r->a;
+		size_t before = t ? t->memory : 0;
+		uint64_t op_start = clock_ns();
+
+		switch (r->op)
+		{
+		case RADIX_TRACE_NEW:
+			if (r->a & RADIX_INLINE_VALUES)
+				t = radix_new_inline((r->a & ~RADIX_INLINE_VALUES) | extra_flags, r->b);
+			else
+				t = radix_new_flags(r->a | extra_flags);
+			trees[r->tree] = t;
+			break;
+		case RADIX_TRACE_FREE:
+			if (keys)
+				dump_keys(r->tree, t);
+			radix_free(t);
+			trees[r->tree] = NULL;
+			break;
+		case RADIX_TRACE_INSERT:
+			if (t->flags & RADIX_INLINE_VALUES)
+				radix_insert_inline(t, key, r->b, r->null ? NULL : value, NULL);
+			else
+				radix_insert(t, key, r->b, r->null ? NULL : (void *)1, NULL);
+			break;
+		case RADIX_TRACE_DEL:
+			if (t->flags & RADIX_INLINE_VALUES)
+				radix_del_inline(t, key, r->b, NULL);
+			else
+				radix_del(t, key, r->b, NULL);
+			break;
+		case RADIX_TRACE_FIND:
+			radix_find(t, key, r->b);
+			break;
+		/* checked like the library asserts them, in case the trace does not match its tree */
+		case RADIX_TRACE_BUDGET:
+			if ((t->flags & RADIX_CACHE) || r->a == 0)
+				radix_set_memory_budget(t, r->a, NULL, NULL);
+			break;
+		case RADIX_TRACE_EXPIRE:
+			if (t->flags & RADIX_TTL)
+				radix_expire(t, r->a, r->b);
+			break;
+		case RADIX_TRACE_INSERT_TTL:
+			if (t->flags & RADIX_TTL)
+			{
+				void *data = (t->flags & RADIX_INLINE_VALUES) ? (void *)value : (void *)1;
+				radix_insert_ttl(t, key, r->b, r->null ? NULL : data, r->expire, NULL);
+			}
+			break;
+		}
+
+		uint64_t op_end = clock_ns();
+		latencies[r->op][counts[r->op]] = op_end - op_start;
+		recorded[r->op][counts[r->op]] = r->duration;
+		++counts[r->op];
+
+		if (r->op == RADIX_TRACE_NEW)
+		{
+			if (t == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+
+			if (r->b > value_size && (t->flags & RADIX_INLINE_VALUES))
+			{
+				value = realloc(value, r->b);
+				memset(value, 0, r->b);
+				value_size = r->b;
+			}
+		}
+
+		/* freed trees give all of their memory back */
+		memory = memory - before + (trees[r->tree] ? trees[r->tree]->memory : 0);
+		if (memory > peak_memory)
+			peak_memory = memory;
+	}
+	uint64_t elapsed = clock_ns() - start;
+
+	size_t calls = tr.num_records - skipped;
+	if (keys)
+	{
+		for (uint32_t id = 1; id <= tr.num_trees; ++id)
+		{
+			if (trees[id])
+				dump_keys(id, trees[id]);
+		}
+	}
+	else
+	{
+		printf("%s: %zu calls on %u trees, traced over %.3f s\n", path, calls, tr.num_trees, tr.span / 1e9);
+		printf("replayed in %.3f s, %.0f calls/s\n", elapsed / 1e9, calls / (elapsed / 1e9));
+
+		for (int op = RADIX_TRACE_INSERT; op < NUM_OPS; ++op)
+		{
+			if (counts[op] == 0)
+				continue;
+
+			printf("%s: %zu calls\n", op_names[op], counts[op]);
+			report_latencies("replayed", latencies[op], counts[op]);
+			report_latencies("traced", recorded[op], counts[op]);
+		}
+
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		printf("vertex memory: peak %zu bytes, at the end %zu bytes\n", peak_memory, memory);
+		printf("max resident set: %ld KiB (trace included)\n", ru.ru_maxrss);
+	}
+
+	for (uint32_t id = 1; id <= tr.num_trees; ++id)
+	{
+		if (trees[id])
+			radix_free(trees[id]);
+	}
+	for (int op = 0; op < NUM_OPS; ++op)
+	{
+		free(latencies[op]);
+		free(recorded[op]);
+	}
+	free(trees);
+	free(value);
+	free(tr.records);
+	free(tr.data);
+	return 0;
+}
@@ -1,3 +1,6 @@
+/* MAP_ANONYMOUS and MAP_NORESERVE are not part of -std=c2x */
+#define _DEFAULT_SOURCE
+
 #include <rradix.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -6,35 +9,73 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 /* Return the padding needed by vertex
  * The padding is needed to store the child pointers to aligned addresses
  * Add 4 to the vertex_size because a vertex has a 4-byte header */
 #define radix_padding(vertex_size) ((sizeof(void*)-((vertex_size+4) % sizeof(void*))) & (sizeof(void*)-1))
 
-/* Return the current total size of the vertex. 
- * The second line calculates the padding after the string, needed to save ptrs to aligned addresses */
-#define radix_vertex_current_size(v) ( \
-    sizeof(radix_vertex)+(v)->size+ \
-    radix_padding((v)->size)+ \
-    ((v)->is_compressed ? sizeof(radix_vertex *) : sizeof(radix_vertex *)*(v)->size)+ \
-    (((v)->is_key && !(v)->is_null)*sizeof(void*)) \
+/* Return the size of a child reference: a pointer, or a 32-bit arena offset in
+ * RADIX_COMPACT_REFS trees. Compact references are read unaligned and need no padding */
+#define radix_ref_size(t) (((t)->flags & RADIX_COMPACT_REFS) ? sizeof(uint32_t) : sizeof(radix_vertex *))
+#define radix_vertex_padding(t, vertex_size) (((t)->flags & RADIX_COMPACT_REFS) ? 0 : radix_padding(vertex_size))
+
+/* Return the size of the value slot of a key vertex: a pointer, or the value itself in
+ * RADIX_INLINE_VALUES trees */
+#define radix_value_size(t) ((t)->value_size)
+
+#define radix_vertex_num_children(v) ((v)->is_compressed ? 1 : (v)->size)
+#define radix_vertex_has_value(v) ((v)->is_key && !(v)->is_null)
+
+/* Return the size of a vertex with vertex_size bytes of data, the given number of
+ * children and possibly a value */
+#define radix_vertex_size(t, vertex_size, children, has_value) ( \
+    sizeof(radix_vertex)+(vertex_size)+ \
+    radix_vertex_padding(t, vertex_size)+ \
+    radix_ref_size(t)*(children)+ \
+    ((has_value) ? radix_value_size(t) : 0)+ \
+    (t)->meta_size \
 )
 
-/* Return the pointer to the last child pointer in a vertex
- * For a compressed vertex this is the only child pointer  */
-#define radix_vertex_last_child_ptr(v) ((radix_vertex **) ( \
-    ((uint8_t *)(v)) + \
-    radix_vertex_current_size(v) - \
-    sizeof(radix_vertex *) - \
-    (((v)->is_key && !(v)->is_null) ? sizeof(void*) : 0) \
-))
-
-/* Return the pointer to the first child pointer in a vertex */
-#define radix_vertex_first_child_ptr(v) ((radix_vertex **) ( \
+/* Return the current total size of the vertex. 
+ * The padding after the string is needed to save ptrs to aligned addresses */
+#define radix_vertex_current_size(t, v) \
+    radix_vertex_size(t, (v)->size, radix_vertex_num_children(v), radix_vertex_has_value(v))
+
+/* Return the size of what follows the child references: the value slot, if any, and
+ * the per-vertex metadata */
+#define radix_vertex_tail_size(t, v) ((radix_vertex_has_value(v) ? radix_value_size(t) : 0) + (t)->meta_size)
+
+/* Return the address of the per-vertex metadata, the last meta_size bytes of a vertex */
+#define radix_vertex_meta(t, v) ((uint8_t *)(v) + radix_vertex_current_size(t, v) - (t)->meta_size)
+
+/* Return the address of the first child reference in a vertex */
+#define radix_vertex_first_child_ptr(t, v) ( \
     (v)->data + \
     (v)->size + \
-    radix_padding((v)->size)))
+    radix_vertex_padding(t, (v)->size))
+
+/* Return the address of the i-th child reference in a vertex */
+#define radix_vertex_child_ptr(t, v, i) (radix_vertex_first_child_ptr(t, v) + radix_ref_size(t)*(i))
+
+/* Return the address of the last child reference in a vertex
+ * For a compressed vertex this is the only child reference */
+#define radix_vertex_last_child_ptr(t, v) radix_vertex_child_ptr(t, v, radix_vertex_num_children(v) - 1)
 
 #ifdef DEBUG
 bool debug = true;
@@ -49,26 +90,32 @@ bool debug = false;
 	fflush(stdout);                                           \
 	}																													\
 
+static inline radix_vertex *_radix_child(radix_tree *t, uint8_t *cp);
+static void _radix_evict(radix_tree *t);
+static int _radix_del(radix_tree *t, uint8_t *s, size_t len, void *old);
+static void *_radix_find(radix_tree *t, uint8_t *s, size_t len);
+static int _radix_insert_scored(radix_tree *t, uint8_t *s, size_t len, void *data, void *old, bool set_score, uint64_t score, uint64_t expire);
+static size_t _radix_walk_batch(radix_tree *t, radix_finger *f, uint8_t *s, size_t len, radix_vertex **_stop_vertex, uint8_t **_parent_link, int *_split_pos, radix_stack *stack);
+
 /* Used by debug_vertex() macro */
 void 
-debug_show_vertex(const char *msg, radix_vertex *v) 
+debug_show_vertex(radix_tree *t, const char *msg, radix_vertex *v) 
 {
     if (!debug) return;
     printf("%s: %p [%.*s] key:%d size:%d children:",
         msg, (void*)v, (int)v->size, (char*)v->data, v->is_key, v->size);
-    int num_children = v->is_compressed ? 1 : v->size;
-    radix_vertex **cp = radix_vertex_last_child_ptr(v) - (num_children - 1);
+    int num_children = radix_vertex_num_children(v);
+    uint8_t *cp = radix_vertex_first_child_ptr(t, v);
     while (num_children--) {
-        radix_vertex *child;
-        memcpy(&child, cp, sizeof(child));
-        ++cp;
+        radix_vertex *child = _radix_child(t, cp);
+        cp += radix_ref_size(t);
         printf("%p ", (void*)child);
     }
     printf("\n");
     fflush(stdout);
 }
 
-#define debug_vertex(msg,v) debug_show_vertex(msg,v)
+#define debug_vertex(msg,v) debug_show_vertex(t,msg,v)
 
 static inline void
 _stack_init(radix_stack *stack)
@@ -135,842 +182,5496 @@ _stack_free(radix_stack *stack)
 		free(stack->stack);
 }
 
-static radix_vertex *
-_new_vertex(size_t children, bool datafield)
+/* Arena of RADIX_COMPACT_REFS trees.
+ * A chunk is a uint32_t holding its length in units, followed by the vertex. Chunks are
+ * carved from a reserved address range that is committed as it fills, so vertices
+ * never move and can be referenced by their offset in units. Free chunks are kept
+ * in exact-size lists linked through their first unit; the larger ones in a
+ * single first-fit list */
+static inline radix_vertex *
+_arena_ptr(radix_arena *a, uint32_t ref)
 {
-	size_t size = sizeof(radix_vertex) + children + radix_padding(children) + sizeof(radix_vertex*) * children;
-	if (datafield)
-		size += sizeof(void *);
-
-	radix_vertex *v = malloc(size);
-	if (v == NULL) return NULL;
-
-	v->is_key = false;
-	v->is_null = false;
-	v->is_compressed = 0;
-	v->size = children;
-	return v;
+	return (radix_vertex *)(a->base + (size_t)ref * RADIX_ARENA_UNIT);
 }
 
-radix_tree *
-radix_new(void)
+static inline uint32_t
+_arena_ref(radix_arena *a, void *p)
 {
-	radix_tree *t = malloc(sizeof(*t));
-	if (t == NULL) return NULL;
+	return ((uint8_t *)p - a->base) / RADIX_ARENA_UNIT;
+}
 
-	t->num_elements = 0;
-	t->num_vertices = 1;
-	t->head = _new_vertex(0, false);
-	
-	if (t->head == NULL)
-	{
-		radix_free(t);
-		return NULL;
-	}
+static inline uint32_t
+_arena_units(void *p)
+{
+	uint32_t units;
+	memcpy(&units, (uint8_t *)p - RADIX_ARENA_UNIT, sizeof(units));
+	return units;
+}
 
-	return t;
+static inline void
+_arena_set_units(void *p, uint32_t units)
+{
+	memcpy((uint8_t *)p - RADIX_ARENA_UNIT, &units, sizeof(units));
 }
 
-static void *
-radix_get_data(radix_vertex *v)
+/* units of a chunk holding size bytes; a free chunk needs one unit for its list link */
+static inline uint32_t
+_arena_units_for(size_t size)
 {
-	if (v->is_null) return NULL;
+	size_t units = 1 + (size + RADIX_ARENA_UNIT - 1) / RADIX_ARENA_UNIT;
+	return units < 2 ? 2 : units;
+}
 
-	void **vdata = (void **)((uint8_t *)v + radix_vertex_current_size(v) - sizeof(void *));
-	void *data;
-	memcpy(&data, vdata, sizeof(data));
-	return data;
+static inline bool
+_arena_at_top(radix_arena *a, void *p, uint32_t units)
+{
+	return (uint8_t *)p + (size_t)(units - 1) * RADIX_ARENA_UNIT == a->base + a->used;
 }
 
-static void
-radix_set_data(radix_vertex *v, void *data)
+static radix_arena *
+_arena_new(void)
 {
-	v->is_key = true;
-	if (data != NULL)
-	{
-		v->is_null = false;
-		void **vdata = (void **)((uint8_t *)v + radix_vertex_current_size(v) - sizeof(void *));
-		memcpy(vdata, &data, sizeof(void *));
-	}
-	else
+	radix_arena *a = malloc(sizeof(*a));
+	if (a == NULL)
+		return NULL;
+
+	a->reserved = RADIX_ARENA_RESERVE;
+	a->base = mmap(NULL, a->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (a->base == MAP_FAILED)
 	{
-		v->is_null = 1;
+		free(a);
+		return NULL;
 	}
+
+	a->used = 0;
+	a->committed = 0;
+	a->large_free = 0;
+	memset(a->free_lists, 0, sizeof(a->free_lists));
+	return a;
 }
 
-static radix_vertex *
-_radix_realloc_data(radix_vertex *v, void *data)
+static void
+_arena_destroy(radix_arena *a)
 {
-	if (data == NULL) // realloc unnecessary
-		return v;
-
-	size_t curr_size = radix_vertex_current_size(v);
-	return realloc(v, curr_size + sizeof(void *));
+	munmap(a->base, a->reserved);
+	free(a);
 }
 
-static void
-_radix_free(radix_tree *t, radix_vertex *v, void (*free_callback)(void *))
+static void *
+_arena_bump(radix_arena *a, uint32_t units)
 {
-	debug_vertex("free traversing", v);
-	int num_children = v->is_compressed ? 1 : v->size;	
-	radix_vertex **cp = radix_vertex_last_child_ptr(v);
+	size_t bytes = (size_t)units * RADIX_ARENA_UNIT;
+	if (bytes > a->reserved - a->used)
+		return NULL;
 
-	while (num_children--)
+	if (a->used + bytes > a->committed)
 	{
-		radix_vertex *c;
-		memcpy(&c, cp, sizeof(c));
-		_radix_free(t, c, free_callback);
-		--cp;
-	}
+		size_t commit = a->used + bytes - a->committed;
+		commit = (commit + RADIX_ARENA_COMMIT - 1) / RADIX_ARENA_COMMIT * RADIX_ARENA_COMMIT;
+		if (commit > a->reserved - a->committed)
+			commit = a->reserved - a->committed;
 
-	debug_vertex("free depth-first", v);
-	
-	if (free_callback && !v->is_null && v->is_key)
-		free_callback(radix_get_data(v));
+		if (mprotect(a->base + a->committed, commit, PROT_READ | PROT_WRITE) != 0)
+			return NULL;
 
-	free(v);
-	--t->num_vertices;
+		a->committed += commit;
+	}
+
+	uint8_t *p = a->base + a->used + RADIX_ARENA_UNIT;
+	a->used += bytes;
+	_arena_set_units(p, units);
+	return p;
 }
 
-void 
-radix_free_callback(radix_tree *t, void (*free_callback)(void *))
+static void
+_arena_free(radix_arena *a, void *p)
 {
-	_radix_free(t, t->head, free_callback);
-	assert(t->num_vertices == 0);
-	free(t);
+	uint32_t units = _arena_units(p);
+
+	/* give the last chunk back to the bump pointer */
+	if (_arena_at_top(a, p, units))
+	{
+		a->used -= (size_t)units * RADIX_ARENA_UNIT;
+		return;
+	}
+
+	uint32_t *list = units < RADIX_ARENA_CLASSES ? &a->free_lists[units] : &a->large_free;
+	memcpy(p, list, sizeof(*list));
+	*list = _arena_ref(a, p);
 }
 
-void 
-radix_free(radix_tree *t)
+/* Split the chunk p to units, freeing the rest if it can hold a chunk of its own */
+static void
+_arena_trim(radix_arena *a, void *p, uint32_t units)
 {
-	radix_free_callback(t, NULL);
+	uint32_t old_units = _arena_units(p);
+	if (old_units - units < 2)
+		return;
+
+	uint8_t *rest = (uint8_t *)p + (size_t)units * RADIX_ARENA_UNIT;
+	_arena_set_units(p, units);
+	_arena_set_units(rest, old_units - units);
+	_arena_free(a, rest);
 }
 
-static inline size_t 
-_radix_walk(radix_tree *t, uint8_t *s, size_t len, radix_vertex **_stop_vertex, radix_vertex ***_parent_link, int *_split_pos, radix_stack *stack)
+static void *
+_arena_alloc(radix_arena *a, size_t size)
 {
-	radix_vertex *h = t->head;
-	radix_vertex **parent_link = &t->head;
+	uint32_t units = _arena_units_for(size);
 
-	size_t i = 0; /* pos in the string */
-	size_t j = 0; /* position in the vertex children */
-
-	while (h->size && i < len)
+	if (units < RADIX_ARENA_CLASSES)
 	{
-		uint8_t *data = h->data;
-
-		if (h->is_compressed)
+		uint32_t ref = a->free_lists[units];
+		if (ref)
 		{
-			for (j = 0; j < h->size && i < len; ++j, ++i)
-			{
-				if (data[j] != s[i]) 
-					break;
-			}
-			if (j != h->size) 
-				break;
-		} 
-		else
+			void *p = _arena_ptr(a, ref);
+			memcpy(&a->free_lists[units], p, sizeof(ref));
+			return p;
+		}
+	}
+	else
+	{
+		uint32_t *prev = &a->large_free;
+		while (*prev)
 		{
-			/* curiously, linear search in contiguous memory is comparable to binary search */
-			for (j = 0; j < h->size; ++j)
+			void *p = _arena_ptr(a, *prev);
+			if (_arena_units(p) >= units)
 			{
-				if (data[j] == s[i])
-					break;
+				memcpy(prev, p, sizeof(*prev));
+				_arena_trim(a, p, units);
+				return p;
 			}
-			if (j == h->size)
-				break;
-			++i;
+			prev = (uint32_t *)p;
 		}
+	}
 
-		if (stack)
-		{
-			_stack_push(stack, h);
-		}
+	return _arena_bump(a, units);
+}
 
-		radix_vertex **children = radix_vertex_first_child_ptr(h);
-		if (h->is_compressed)
-			j = 0;
+static void *
+_arena_realloc(radix_arena *a, void *p, size_t size)
+{
+	uint32_t units = _arena_units(p);
+	uint32_t new_units = _arena_units_for(size);
 
-		memcpy(&h, children + j, sizeof(h));
-		parent_link = children + j;
-		j = 0;
+	if (new_units <= units)
+	{
+		_arena_trim(a, p, new_units);
+		return p;
 	}
 
-	if (_stop_vertex)
-		*_stop_vertex = h;
-
-	if (_parent_link)
-		*_parent_link = parent_link;
+	if (_arena_at_top(a, p, units) && _arena_bump(a, new_units - units))
+	{
+		_arena_set_units(p, new_units);
+		return p;
+	}
 
-	if (_split_pos && h->is_compressed)
-		*_split_pos = j;
+	void *newp = _arena_alloc(a, size);
+	if (newp == NULL)
+		return NULL;
 
-	return i;
+	memcpy(newp, p, (size_t)(units - 1) * RADIX_ARENA_UNIT);
+	_arena_free(a, p);
+	return newp;
 }
 
-static radix_vertex *
-_compress(radix_vertex *v, uint8_t *s, size_t len, radix_vertex **child)
+/* Return the child referenced at cp */
+static inline radix_vertex *
+_radix_child(radix_tree *t, uint8_t *cp)
 {
-	assert(v->size == 0 && !v->is_compressed);	
-
-	void *data = NULL;
-	size_t new_size;
-
-	debugf("Compress vertice: '%.*s'\n", (int)len, s);
-
-	*child = _new_vertex(0, 0);
-	if (*child == NULL) return NULL;
-
-	new_size = sizeof(radix_vertex) + len + radix_padding(len) + sizeof(radix_vertex *);
-	
-	if (v->is_key)
+	if (t->flags & RADIX_COMPACT_REFS)
 	{
-		data = radix_get_data(v);
-		if (!v->is_null)
-			new_size += sizeof(void *);
+		uint32_t ref;
+		memcpy(&ref, cp, sizeof(ref));
+		return _arena_ptr(t->arena, ref);
 	}
 
-	radix_vertex *newv = realloc(v, new_size);
-	if (newv == NULL)
-	{
-		free(*child);
+	radix_vertex *child;
+	memcpy(&child, cp, sizeof(child));
+	return child;
+}
+
+static radix_jump *
+_radix_jump_new(int depth)
+{
+	radix_jump *j = calloc(1, sizeof(*j));
+	if (j == NULL)
 		return NULL;
+
+	j->depth = depth;
+	j->dirty = true;
+	if (depth == 2)
+	{
+		j->next = calloc(256 * 256, sizeof(*j->next));
+		if (j->next == NULL)
+		{
+			free(j);
+			return NULL;
+		}
 	}
 
-	v = newv;
-	v->is_compressed = true;
-	v->size = len;
-	memcpy(v->data, s, len);
-	if (v->is_key)
-		radix_set_data(v, data);
+	return j;
+}
 
-	radix_vertex **childfield = radix_vertex_last_child_ptr(v);
-	memcpy(childfield, child, sizeof(*child));
+static void
+_radix_jump_free(radix_jump *j)
+{
+	if (j == NULL)
+		return;
 
-	return v;
+	free(j->next);
+	free(j);
 }
 
-static radix_vertex *
-_add_child(radix_vertex *v, uint8_t c, radix_vertex **childptr, radix_vertex ***parent_link)
+/* The table goes unused until _radix_jump_sync(), which refills what the changes to the
+ * tree touched. Inserts and deletes only change vertices on the path of their key, their
+ * children included, so the vertex hooks below only look at the entries of that path */
+static inline void
+_radix_jump_begin(radix_tree *t, uint8_t *s, size_t len)
 {
-	assert(!v->is_compressed);
+	if (t->jump)
+	{
+		t->jump->key = s;
+		t->jump->key_len = len;
+	}
+}
 
-	size_t curr_size = radix_vertex_current_size(v);
-	++v->size;
-	size_t new_size = radix_vertex_current_size(v);
-	--v->size; // restore; update on success at the end
+/* everything is refilled, for changes made without a key */
+static void
+_radix_jump_reset(radix_tree *t)
+{
+	radix_jump *j = t->jump;
+	if (j == NULL)
+		return;
+
+	j->valid = false;
+	j->dirty = true;
+	j->key_len = 0;
+	memset(j->row_valid, 0, sizeof(j->row_valid));
+}
 
-	radix_vertex *child = _new_vertex(0, 0); // allocate it
-	if (child == NULL) return NULL;
+/* v is about to be freed or moved, or loses an edge */
+static void
+_radix_jump_changed(radix_tree *t, radix_vertex *v)
+{
+	radix_jump *j = t->jump;
 
-	radix_vertex *newv = realloc(v, new_size);
-	if (newv == NULL)
+	if (v == j->head)
 	{
-		free(child);
-		return NULL;
+		j->valid = false;
+		j->dirty = true;
 	}
 
-	v = newv;
-	
-	int pos;
-	for (pos = 0; pos < v->size; ++pos)
+	if (j->key_len == 0)
+		return;
+
+	uint8_t b = j->key[0];
+	if (v == j->top[b])
 	{
-		if (v->data[pos] > c) break;
+		j->valid = false;
+		j->row_valid[b] = false;
+		j->dirty = true;
 	}
-
-	uint8_t *dst, *src;
-	if (!v->is_null && v->is_key)
+	else if (j->depth == 2 && j->key_len > 1 && v == j->next[b * 256 + j->key[1]])
 	{
-		dst = (uint8_t *)v + new_size - sizeof(void *);
-		src = (uint8_t *)v + curr_size - sizeof(void *);
-		memmove(dst, src, sizeof(void *));
+		/* lookups start one byte higher until the new address is linked or synced */
+		j->hole = b * 256 + j->key[1] + 1;
+		j->next[j->hole - 1] = NULL;
+		j->dirty = true;
 	}
+}
+
+/* the edge byte of the child reference at link, in v which has not changed since it was
+ * last read into the table */
+static inline uint8_t
+_radix_jump_edge(radix_tree *t, radix_vertex *v, uint8_t *link)
+{
+	return v->data[(link - radix_vertex_first_child_ptr(t, v)) / radix_ref_size(t)];
+}
 
-	size_t shift = new_size - curr_size - sizeof(void *);
+/* the child reference at link is about to point to child */
+static void
+_radix_jump_link(radix_tree *t, uint8_t *link, radix_vertex *child)
+{
+	radix_jump *j = t->jump;
+	uintptr_t l = (uintptr_t)link;
 
-	src = v->data + v->size + radix_padding(v->size) + sizeof(radix_vertex *) * pos;
-	memmove(src + shift + sizeof(radix_vertex *), src, sizeof(radix_vertex *) * (v->size - pos));
+	if (link == (uint8_t *)&t->head)
+	{
+		j->valid = false;
+		j->dirty = true;
+		return;
+	}
 
-	if (shift)
+	if (l >= (uintptr_t)j->head && l < (uintptr_t)j->head + j->head_size)
 	{
-		src = (uint8_t *)radix_vertex_first_child_ptr(v);
-		memmove(src + shift, src, sizeof(radix_vertex *) * pos);
+		if (j->valid && !j->head->is_compressed)
+		{
+			uint8_t b = _radix_jump_edge(t, j->head, link);
+			j->top[b] = child;
+			j->row_valid[b] = false;
+			j->dirty |= j->depth == 2;
+		}
+		return;
 	}
 
-	src = v->data + pos;
-	memmove(src + 1, src, v->size - pos);
+	if (j->depth == 2 && j->key_len && j->row_valid[j->key[0]])
+	{
+		uint8_t b = j->key[0];
+		radix_vertex *v = j->top[b];
+		uintptr_t top = (uintptr_t)v;
+		if (l >= top && l < top + j->top_size[b] && !v->is_compressed)
+			j->next[b * 256 + _radix_jump_edge(t, v, link)] = child;
+	}
+}
 
-	v->data[pos] = c;
-	++v->size;
+static void
+_radix_jump_fill_row(radix_tree *t, uint8_t b)
+{
+	radix_jump *j = t->jump;
+	radix_vertex **row = j->next + b * 256;
+	radix_vertex *v = j->top[b];
 
-	src = (uint8_t *)radix_vertex_first_child_ptr(v);
-	radix_vertex **childfield = (radix_vertex **)(src + sizeof(radix_vertex *) * pos);
-	memcpy(childfield, &child, sizeof(child));
+	memset(row, 0, 256 * sizeof(*row));
+	j->top_size[b] = v ? radix_vertex_current_size(t, v) : 0;
+	j->row_valid[b] = true;
 
-	*childptr = child;
-	*parent_link = childfield;
+	if (v == NULL || v->is_compressed)
+		return;
 
-	return v;
+	for (int k = 0; k < v->size; ++k)
+		row[v->data[k]] = _radix_child(t, radix_vertex_child_ptr(t, v, k));
 }
 
-/* returns 0 on no insert, returns 1 on insert */
-static int
-_radix_insert(radix_tree *t, uint8_t *s, size_t len, void *data, void **old, bool overwrite)
+/* refill the parts of the table a change made stale, at the end of every change */
+static void
+_radix_jump_sync(radix_tree *t)
 {
-	size_t i;
-	int j = 0; /* split position */
-	radix_vertex *h, **parent_link;
-
-	debugf("### Insert '%.*s' with value %p\n", (int)len, s, data);
+	radix_jump *j = t->jump;
+	if (j == NULL)
+		return;
 
-	i = _radix_walk(t, s, len, &h, &parent_link, &j, NULL);
+	j->key_len = 0;
+	if (!j->dirty)
+		return;
 
-	if (i == len && (!h->is_compressed || j == 0)) // key vertex exists and it's not compressed
+	if (!j->valid)
 	{
-		debugf("### Insert: vertice representing key exists\n");
-		if (!h->is_key || (h->is_null && overwrite))
+		radix_vertex *top[256] = { NULL };
+		radix_vertex *h = t->head;
+
+		if (!h->is_compressed)
 		{
-			h = _radix_realloc_data(h, data);
-			if (h)
-				memcpy(parent_link, &h, sizeof(h));
+			for (int k = 0; k < h->size; ++k)
+				top[h->data[k]] = _radix_child(t, radix_vertex_child_ptr(t, h, k));
 		}
-		if (h == NULL)
-			return 0;
 
-		// update key
-		if (h->is_key)
+		/* the rows below the vertices still there stay */
+		for (int b = 0; b < 256; ++b)
 		{
-			if (old)
-				*old = radix_get_data(h);
+			if (top[b] != j->top[b])
+			{
+				j->top[b] = top[b];
+				j->row_valid[b] = false;
+			}
+		}
 
-			if (overwrite)
-				radix_set_data(h, data);
+		j->head = h;
+		j->head_size = radix_vertex_current_size(t, h);
+		j->valid = true;
+	}
 
-			return 0;
+	if (j->depth == 2)
+	{
+		for (int b = 0; b < 256; ++b)
+		{
+			if (!j->row_valid[b])
+				_radix_jump_fill_row(t, b);
 		}
 
-		radix_set_data(h, data);
-		++t->num_elements;
-		return 1;
+		/* a vertex that changed in place is not linked again */
+		if (j->hole)
+		{
+			radix_vertex *v = j->top[(j->hole - 1) / 256];
+			uint8_t *edge = (v && !v->is_compressed) ? memchr(v->data, (j->hole - 1) % 256, v->size) : NULL;
+			j->next[j->hole - 1] = edge ? _radix_child(t, radix_vertex_child_ptr(t, v, edge - v->data)) : NULL;
+			j->hole = 0;
+		}
 	}
 
-	/* 
-	 * uncompress the compressed vertex (if this is the case) 
-	 * */
+	j->dirty = false;
+}
 
-	if (i != len && h->is_compressed)
-	{
-		debugf("Algorithm 1: Stopped at compressed node '%.*s' (%p)\n",
-				h->size, h->data, (void*)h);
-		debugf("Still to insert: '%.*s'\n", (int)(len-i), s+i);
-		debugf("Splitting at %d: '%c'\n", j, ((char*)h->data)[j]);
-		debugf("Other (key) letter is '%c'\n", s[i]);
+/* Where a lookup of s can start: the vertex below its first one or two bytes, with *i set
+ * to how many, or the head */
+static inline radix_vertex *
+_radix_jump(radix_tree *t, uint8_t *s, size_t len, size_t *i)
+{
+	radix_jump *j = t->jump;
 
-		/* Save next pointer */
-		radix_vertex **childfield = radix_vertex_last_child_ptr(h);
-		radix_vertex *next;
-		memcpy(&next, childfield, sizeof(next));
+	if (j->dirty || len == 0 || j->top[s[0]] == NULL)
+		return t->head;
 
-		debugf("Next is %p\n", (void*)next);
-		debugf("is_key %d\n", h->is_key);
-		if (h->is_key) {
-			debugf("key value is %p\n", radix_get_data(h));
+	*i = 1;
+	if (j->depth == 2 && len > 1)
+	{
+		radix_vertex *v = j->next[s[0] * 256 + s[1]];
+		if (v)
+		{
+			*i = 2;
+			return v;
 		}
+	}
 
-		size_t prefix_len = j;
+	return j->top[s[0]];
+}
+
+/* Point the reference at link, a child reference or &t->head, to child */
+static inline void
+_radix_set_child(radix_tree *t, uint8_t *link, radix_vertex *child)
+{
+	if (t->jump)
+		_radix_jump_link(t, link, child);
+
+	if ((t->flags & RADIX_COMPACT_REFS) && link != (uint8_t *)&t->head)
+	{
+		uint32_t ref = _arena_ref(t->arena, child);
+		memcpy(link, &ref, sizeof(ref));
+		return;
+	}
+
+	memcpy(link, &child, sizeof(child));
+}
+
+static inline radix_vertex *
+_radix_link_get(radix_tree *t, uint8_t *link)
+{
+	if (link == (uint8_t *)&t->head)
+		return t->head;
+
+	return _radix_child(t, link);
+}
+
+/* Return the bytes held by v, allocated with malloc() for size bytes. This is exact
+ * with glibc, elsewhere it is the size asked for */
+static inline size_t
+_malloc_usage(void *v, size_t size)
+{
+#if defined(__GLIBC__)
+	(void)size;
+	return malloc_usable_size(v);
+#else
+	(void)v;
+	return size;
+#endif
+}
+
+static inline size_t
+_arena_usage(void *v)
+{
+	return (size_t)_arena_units(v) * RADIX_ARENA_UNIT;
+}
+
+/* where _malloc_usage() is not exact, the size given back may not match the size counted in */
+static inline void
+_vertex_unaccount(radix_tree *t, size_t usage)
+{
+	t->memory -= usage < t->memory ? usage : t->memory;
+}
+
+/* Return the relayout block holding v, or NULL if v was allocated on its own */
+static radix_block *
+_radix_block_of(radix_tree *t, void *v)
+{
+	size_t lo = 0;
+	size_t hi = t->num_blocks;
+
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if ((uint8_t *)v < t->blocks[mid].base)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	if (lo == 0)
+		return NULL;
+
+	radix_block *b = &t->blocks[lo - 1];
+	return (uint8_t *)v < b->base + b->size ? b : NULL;
+}
+
+/* A vertex in a block is never freed on its own; the block goes once all its vertices are gone */
+static void
+_radix_block_release(radix_tree *t, radix_block *b)
+{
+	if (--b->live)
+		return;
+
+	t->memory -= b->size;
+	free(b->base);
+	size_t idx = b - t->blocks;
+	memmove(b, b + 1, (t->num_blocks - idx - 1) * sizeof(*b));
+	--t->num_blocks;
+}
+
+static inline void *
+_vertex_alloc(radix_tree *t, size_t size)
+{
+	if (t->arena)
+	{
+		radix_vertex *v = _arena_alloc(t->arena, size);
+		if (v)
+			t->memory += _arena_usage(v);
+		return v;
+	}
+
+	radix_vertex *v = malloc(size);
+	if (v)
+		t->memory += _malloc_usage(v, size);
+	return v;
+}
+
+static inline void
+_vertex_free(radix_tree *t, radix_vertex *v)
+{
+	if (v == NULL)
+		return;
+
+	if (t->jump)
+		_radix_jump_changed(t, v);
+
+	if (t->arena)
+	{
+		_vertex_unaccount(t, _arena_usage(v));
+		_arena_free(t->arena, v);
+		return;
+	}
+
+	radix_block *b = t->num_blocks ? _radix_block_of(t, v) : NULL;
+	if (b)
+	{
+		_radix_block_release(t, b);
+		return;
+	}
+
+	_vertex_unaccount(t, _malloc_usage(v, radix_vertex_current_size(t, v)));
+	free(v);
+}
+
+/* Like realloc(), the first min(size, current size) bytes of v are preserved.
+ * Vertices in a block shrink in place and move out of the block to grow */
+static inline void *
+_vertex_realloc(radix_tree *t, radix_vertex *v, size_t size)
+{
+	if (t->jump)
+		_radix_jump_changed(t, v);
+
+	if (t->arena)
+	{
+		size_t usage = _arena_usage(v);
+		radix_vertex *newv = _arena_realloc(t->arena, v, size);
+		if (newv == NULL)
+			return NULL;
+
+		_vertex_unaccount(t, usage);
+		t->memory += _arena_usage(newv);
+		return newv;
+	}
+
+	size_t curr_size = radix_vertex_current_size(t, v);
+	radix_block *b = t->num_blocks ? _radix_block_of(t, v) : NULL;
+	if (b == NULL)
+	{
+		size_t usage = _malloc_usage(v, curr_size);
+		radix_vertex *newv = realloc(v, size);
+		if (newv == NULL)
+			return NULL;
+
+		_vertex_unaccount(t, usage);
+		t->memory += _malloc_usage(newv, size);
+		return newv;
+	}
+
+	if (size <= curr_size)
+		return v;
+
+	radix_vertex *newv = malloc(size);
+	if (newv == NULL)
+		return NULL;
+
+	t->memory += _malloc_usage(newv, size);
+	memcpy(newv, v, curr_size);
+	_radix_block_release(t, b);
+	return newv;
+}
+
+static radix_vertex *
+_new_vertex(radix_tree *t, size_t children, bool datafield)
+{
+	size_t size = radix_vertex_size(t, children, children, datafield);
+
+	radix_vertex *v = _vertex_alloc(t, size);
+	if (v == NULL) return NULL;
+
+	v->is_key = false;
+	v->is_null = false;
+	v->is_compressed = 0;
+	v->size = children;
+	memset(radix_vertex_meta(t, v), 0, t->meta_size);
+	return v;
+}
+
+/* FNV-1a, continued from h over p[0..n): the hash of a key can be built up an edge at a time */
+#define RADIX_HASH_INIT 0xcbf29ce484222325ULL
+
+static inline uint64_t
+_radix_hash_step(uint64_t h, const uint8_t *p, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static inline uint64_t
+_radix_hash(const uint8_t *p, size_t n)
+{
+	return _radix_hash_step(RADIX_HASH_INIT, p, n);
+}
+
+/* RADIX_FILTER: a blocked counting Bloom filter of the keys. Each key sets
+ * RADIX_FILTER_PROBES 4-bit counters in one 64-byte block, so a lookup touches one
+ * cache line. Counters that reach 15 stay there, they can no longer be counted down */
+#define RADIX_FILTER_PROBES 4
+#define RADIX_FILTER_BLOCK_KEYS 12 /* keys per block of 128 counters before the filter grows */
+#define RADIX_FILTER_MIN_BLOCKS 16
+
+static radix_filter *
+_radix_filter_new(size_t num_blocks)
+{
+	radix_filter *f = malloc(sizeof(*f));
+	if (f == NULL)
+		return NULL;
+
+	f->counters = aligned_alloc(64, num_blocks * 64);
+	if (f->counters == NULL)
+	{
+		free(f);
+		return NULL;
+	}
+
+	memset(f->counters, 0, num_blocks * 64);
+	f->num_blocks = num_blocks;
+	f->capacity = num_blocks * RADIX_FILTER_BLOCK_KEYS;
+	return f;
+}
+
+static void
+_radix_filter_free(radix_filter *f)
+{
+	if (f == NULL)
+		return;
+
+	free(f->counters);
+	free(f);
+}
+
+/* the low bits of FNV-1a are poorly mixed, the block and the probes need all of them */
+static inline uint64_t *
+_radix_filter_block(radix_filter *f, uint64_t *h)
+{
+	*h ^= *h >> 33;
+	*h *= 0xff51afd7ed558ccdULL;
+	*h ^= *h >> 33;
+	*h *= 0xc4ceb9fe1a85ec53ULL;
+	*h ^= *h >> 33;
+
+	return f->counters + (((*h >> 32) * f->num_blocks) >> 32) * 8;
+}
+
+static bool
+_radix_filter_may_contain(radix_filter *f, uint64_t h)
+{
+	uint64_t *block = _radix_filter_block(f, &h);
+
+	for (int p = 0; p < RADIX_FILTER_PROBES; ++p)
+	{
+		unsigned c = (h >> (7 * p)) & 127;
+		if (((block[c >> 4] >> ((c & 15) * 4)) & 15) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+static void
+_radix_filter_count(radix_filter *f, uint64_t h, bool add)
+{
+	uint64_t *block = _radix_filter_block(f, &h);
+
+	for (int p = 0; p < RADIX_FILTER_PROBES; ++p)
+	{
+		unsigned c = (h >> (7 * p)) & 127;
+		unsigned shift = (c & 15) * 4;
+		uint64_t counter = (block[c >> 4] >> shift) & 15;
+
+		if (counter == 15 || (!add && counter == 0))
+			continue;
+
+		if (add)
+			block[c >> 4] += 1ULL << shift;
+		else
+			block[c >> 4] -= 1ULL << shift;
+	}
+}
+
+/* Count the keys of the subtree at v, whose path hashes to h, in f */
+static void
+_radix_filter_fill(radix_tree *t, radix_filter *f, radix_vertex *v, uint64_t h)
+{
+	if (v->is_key)
+		_radix_filter_count(f, h, true);
+
+	int num_children = radix_vertex_num_children(v);
+	for (int i = 0; i < num_children; ++i)
+	{
+		uint64_t child_h = _radix_hash_step(h, v->data + i, v->is_compressed ? v->size : 1);
+		_radix_filter_fill(t, f, _radix_child(t, radix_vertex_child_ptr(t, v, i)), child_h);
+	}
+}
+
+/* Count the new key s in the filter, rebuilt twice as large once it is over capacity */
+static void
+_radix_filter_add(radix_tree *t, uint8_t *s, size_t len)
+{
+	if (t->num_elements > t->filter->capacity)
+	{
+		radix_filter *f = _radix_filter_new(t->filter->num_blocks * 2);
+
+		/* on OOM the filter stays as it is, only with more false positives */
+		if (f)
+		{
+			debugf("Growing the filter to %zu blocks\n", f->num_blocks);
+
+			_radix_filter_fill(t, f, t->head, RADIX_HASH_INIT);
+			_radix_filter_free(t->filter);
+			t->filter = f;
+			return;
+		}
+	}
+
+	_radix_filter_count(t->filter, _radix_hash(s, len), true);
+}
+
+/* xorshift64, for the decisions that only need to look random */
+static inline uint64_t
+_radix_random(radix_tree *t)
+{
+	t->rng ^= t->rng << 13;
+	t->rng ^= t->rng >> 7;
+	t->rng ^= t->rng << 17;
+	return t->rng;
+}
+
+/* Space-saving sketch of the sampled accesses: a key already in the sketch is counted,
+ * a new one takes over the entry with the lowest count and starts from it, so counts
+ * overestimate by at most their error */
+static radix_sketch *
+_radix_sketch_new(size_t capacity)
+{
+	radix_sketch *sk = malloc(sizeof(*sk));
+	if (sk == NULL)
+		return NULL;
+
+	sk->entries = calloc(capacity, sizeof(*sk->entries));
+	sk->hashes = calloc(capacity, sizeof(*sk->hashes));
+	if (sk->entries == NULL || sk->hashes == NULL)
+	{
+		free(sk->entries);
+		free(sk->hashes);
+		free(sk);
+		return NULL;
+	}
+
+	sk->size = 0;
+	sk->capacity = capacity;
+	sk->depth = 0;
+	return sk;
+}
+
+static void
+_radix_sketch_free(radix_sketch *sk)
+{
+	if (sk == NULL)
+		return;
+
+	for (size_t i = 0; i < sk->size; ++i)
+		free(sk->entries[i].key);
+	free(sk->entries);
+	free(sk->hashes);
+	free(sk);
+}
+
+static void
+_radix_sketch_add(radix_sketch *sk, const uint8_t *s, size_t len)
+{
+	uint64_t h = _radix_hash(s, len);
+	size_t min = 0;
+
+	for (size_t i = 0; i < sk->size; ++i)
+	{
+		radix_hot *e = &sk->entries[i];
+		if (sk->hashes[i] == h && e->len == len && !memcmp(e->key, s, len))
+		{
+			++e->count;
+			return;
+		}
+
+		if (e->count < sk->entries[min].count)
+			min = i;
+	}
+
+	/* room left, or else the least counted entry goes */
+	size_t i = sk->size < sk->capacity ? sk->size : min;
+	radix_hot *e = &sk->entries[i];
+	uint8_t *key = malloc(len ? len : 1);
+	if (key == NULL)
+		return;
+
+	memcpy(key, s, len);
+	uint64_t error = i == sk->size ? 0 : e->count;
+	if (i == sk->size)
+		++sk->size;
+	else
+		free(e->key);
+
+	e->key = key;
+	e->len = len;
+	e->count = error + 1;
+	e->error = error;
+	sk->hashes[i] = h;
+}
+
+static void
+_radix_sampling_free(radix_tree *t)
+{
+	_radix_sketch_free(t->sketch);
+	t->sketch = NULL;
+	for (int d = 0; d < RADIX_SKETCH_DEPTHS; ++d)
+	{
+		_radix_sketch_free(t->prefix_sketches[d]);
+		t->prefix_sketches[d] = NULL;
+	}
+}
+
+/* Count the access to s[0..len), and its prefixes, if it is one of the sampled ones */
+static inline void
+_radix_sample(radix_tree *t, const uint8_t *s, size_t len)
+{
+	if (t->sketch == NULL || --t->sample_countdown)
+		return;
+
+	/* the gaps between samples are random, so periodic access patterns are not aliased */
+	t->sample_countdown = 1 + _radix_random(t) % (2 * (uint64_t)t->sample_every - 1);
+	_radix_sketch_add(t->sketch, s, len);
+
+	for (int d = 0; d < RADIX_SKETCH_DEPTHS && t->prefix_sketches[d]; ++d)
+	{
+		radix_sketch *sk = t->prefix_sketches[d];
+		_radix_sketch_add(sk, s, len < sk->depth ? len : sk->depth);
+	}
+}
+
+#ifdef RADIX_TRACE
+/* Trace of the API calls, see RADIX_TRACE_NEW in rradix.h for the format. Trees get
+ * a trace id when the application creates them; the trees used internally keep 0
+ * and are not traced */
+static pthread_mutex_t _radix_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *_radix_trace_file;
+static uint32_t _radix_trace_trees;
+static uint64_t _radix_trace_last;
+
+static uint64_t
+_radix_trace_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+_radix_trace_close(void)
+{
+	pthread_mutex_lock(&_radix_trace_lock);
+	if (_radix_trace_file)
+		fclose(_radix_trace_file);
+	_radix_trace_file = NULL;
+	pthread_mutex_unlock(&_radix_trace_lock);
+}
+
+static void
+_radix_trace_varint(uint64_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		putc_unlocked((v & 0x7f) | 0x80, _radix_trace_file);
+	putc_unlocked(v, _radix_trace_file);
+}
+
+/* Write the record header of a call to t that started at start and return with the
+ * lock held, or return false if the trace cannot be written */
+static bool
+_radix_trace_begin(radix_tree *t, uint8_t op, uint64_t start)
+{
+	uint64_t end = _radix_trace_clock();
+
+	pthread_mutex_lock(&_radix_trace_lock);
+	if (_radix_trace_file == NULL)
+	{
+		const char *path = getenv("RADIX_TRACE_FILE");
+		_radix_trace_file = fopen(path ? path : "rradix.trace", "wb");
+		if (_radix_trace_file == NULL)
+		{
+			pthread_mutex_unlock(&_radix_trace_lock);
+			return false;
+		}
+
+		fwrite(RADIX_TRACE_MAGIC, 1, 8, _radix_trace_file);
+		_radix_trace_last = start;
+		atexit(_radix_trace_close);
+	}
+
+	putc_unlocked(op, _radix_trace_file);
+	_radix_trace_varint(t->trace_id);
+	_radix_trace_varint(start > _radix_trace_last ? start - _radix_trace_last : 0);
+	_radix_trace_varint(end - start);
+	if (start > _radix_trace_last)
+		_radix_trace_last = start;
+
+	return true;
+}
+
+static void
+_radix_trace_key(radix_tree *t, uint8_t op, const uint8_t *s, size_t len, uint64_t start)
+{
+	if (t->trace_id == 0 || !_radix_trace_begin(t, op, start))
+		return;
+
+	_radix_trace_varint(len);
+	fwrite(s, 1, len, _radix_trace_file);
+	pthread_mutex_unlock(&_radix_trace_lock);
+}
+
+/* an insert with an expiry time has a record of its own, with the time after the key */
+static void
+_radix_trace_insert(radix_tree *t, const uint8_t *s, size_t len, const void *data, uint64_t expire, uint64_t start)
+{
+	uint8_t null = data ? 0 : RADIX_TRACE_NULL;
+
+	if (expire == 0)
+	{
+		_radix_trace_key(t, RADIX_TRACE_INSERT | null, s, len, start);
+		return;
+	}
+
+	if (t->trace_id == 0 || !_radix_trace_begin(t, RADIX_TRACE_INSERT_TTL | null, start))
+		return;
+
+	_radix_trace_varint(len);
+	fwrite(s, 1, len, _radix_trace_file);
+	_radix_trace_varint(expire);
+	pthread_mutex_unlock(&_radix_trace_lock);
+}
+
+static void
+_radix_trace_args(radix_tree *t, uint8_t op, uint64_t a, uint64_t b, uint64_t start)
+{
+	if (t->trace_id == 0 || !_radix_trace_begin(t, op, start))
+		return;
+
+	_radix_trace_varint(a);
+	_radix_trace_varint(b);
+	pthread_mutex_unlock(&_radix_trace_lock);
+}
+
+static void
+_radix_trace_new(radix_tree *t)
+{
+	uint64_t start = _radix_trace_clock();
+
+	pthread_mutex_lock(&_radix_trace_lock);
+	t->trace_id = ++_radix_trace_trees;
+	pthread_mutex_unlock(&_radix_trace_lock);
+
+	if (!_radix_trace_begin(t, RADIX_TRACE_NEW, start))
+		return;
+
+	_radix_trace_varint(t->flags);
+	_radix_trace_varint(t->value_size);
+	pthread_mutex_unlock(&_radix_trace_lock);
+}
+
+static void
+_radix_trace_free(radix_tree *t)
+{
+	if (t->trace_id && _radix_trace_begin(t, RADIX_TRACE_FREE, _radix_trace_clock()))
+		pthread_mutex_unlock(&_radix_trace_lock);
+}
+
+#define RADIX_TRACE_START(t) uint64_t _trace_start = (t)->trace_id ? _radix_trace_clock() : 0
+#define RADIX_TRACE_KEY(t, op, s, len) _radix_trace_key(t, op, s, len, _trace_start)
+#define RADIX_TRACE_INSERT_KEY(t, s, len, data, expire) _radix_trace_insert(t, s, len, data, expire, _trace_start)
+#define RADIX_TRACE_ARGS(t, op, a, b) _radix_trace_args(t, op, a, b, _trace_start)
+#else
+#define _radix_trace_new(t) ((void)0)
+#define _radix_trace_free(t) ((void)0)
+#define RADIX_TRACE_START(t) ((void)0)
+#define RADIX_TRACE_KEY(t, op, s, len) ((void)0)
+#define RADIX_TRACE_INSERT_KEY(t, s, len, data, expire) ((void)0)
+#define RADIX_TRACE_ARGS(t, op, a, b) ((void)0)
+#endif
+
+static radix_tree *_radix_new(uint32_t flags);
+
+radix_tree *
+radix_new(void)
+{
+	return radix_new_flags(0);
+}
+
+radix_tree *
+radix_new_inline(uint32_t flags, size_t value_size)
+{
+	if (value_size == 0)
+		return NULL;
+
+	radix_tree *t = _radix_new(flags);
+	if (t == NULL) return NULL;
+
+	/* the head holds no value yet, so the slot size can still change */
+	t->flags |= RADIX_INLINE_VALUES;
+	t->value_size = value_size;
+	_radix_trace_new(t);
+	return t;
+}
+
+radix_tree *
+radix_new_flags(uint32_t flags)
+{
+	radix_tree *t = _radix_new(flags);
+	if (t)
+		_radix_trace_new(t);
+	return t;
+}
+
+static radix_tree *
+_radix_new(uint32_t flags)
+{
+	radix_tree *t = malloc(sizeof(*t));
+	if (t == NULL) return NULL;
+
+	t->num_elements = 0;
+	t->num_vertices = 1;
+	t->version = 0;
+	t->flags = flags & ~(RADIX_INLINE_VALUES | RADIX_FROZEN);
+	t->value_size = sizeof(void *);
+	t->meta_size = 0;
+	t->meta_scores = 0;
+	t->meta_cache = 0;
+	t->memory = 0;
+	t->memory_budget = 0;
+	t->clock = 0;
+	t->rng = 0x9e3779b97f4a7c15ULL;
+	t->evict = NULL;
+	t->evict_ctx = NULL;
+	t->meta_ttl = 0;
+	t->now = 0;
+	t->expiry = NULL;
+	t->filter = NULL;
+	t->jump = NULL;
+	t->sketch = NULL;
+	memset(t->prefix_sketches, 0, sizeof(t->prefix_sketches));
+	t->sample_every = 0;
+	t->sample_countdown = 0;
+	t->trace_id = 0;
+	t->batch = NULL;
+	t->pending = NULL;
+	t->pending_len = 0;
+	t->pending_pos = 0;
+	t->pending_capacity = 0;
+	t->pending_count = 0;
+	t->blocks = NULL;
+	t->num_blocks = 0;
+	t->blocks_capacity = 0;
+	t->arena = NULL;
+
+	if (flags & RADIX_SCORES)
+	{
+		t->meta_scores = t->meta_size;
+		t->meta_size += 2 * sizeof(uint64_t);
+	}
+
+	if (flags & RADIX_CACHE)
+	{
+		t->meta_cache = t->meta_size;
+		t->meta_size += sizeof(uint64_t);
+	}
+
+	if (flags & RADIX_TTL)
+	{
+		t->meta_ttl = t->meta_size;
+		t->meta_size += sizeof(uint64_t);
+	}
+
+	if (flags & RADIX_COMPACT_REFS)
+	{
+		t->arena = _arena_new();
+		if (t->arena == NULL)
+		{
+			free(t);
+			return NULL;
+		}
+	}
+
+	t->head = _new_vertex(t, 0, false);
+	
+	if (t->head == NULL)
+	{
+		radix_free(t);
+		return NULL;
+	}
+
+	if (flags & RADIX_TTL)
+	{
+		t->expiry = _radix_new(0);
+		if (t->expiry == NULL)
+		{
+			radix_free(t);
+			return NULL;
+		}
+	}
+
+	if (flags & RADIX_FILTER)
+	{
+		t->filter = _radix_filter_new(RADIX_FILTER_MIN_BLOCKS);
+		if (t->filter == NULL)
+		{
+			radix_free(t);
+			return NULL;
+		}
+	}
+
+	if (flags & (RADIX_JUMP_TABLE | RADIX_JUMP_TABLE2))
+	{
+		t->jump = _radix_jump_new((flags & RADIX_JUMP_TABLE2) ? 2 : 1);
+		if (t->jump == NULL)
+		{
+			radix_free(t);
+			return NULL;
+		}
+		_radix_jump_sync(t);
+	}
+
+	return t;
+}
+
+/* Return the value of a key vertex. In RADIX_INLINE_VALUES trees this is the address
+ * of the value bytes inside the vertex, valid until the tree is modified */
+static void *
+radix_get_data(radix_tree *t, radix_vertex *v)
+{
+	if (v->is_null) return NULL;
+
+	uint8_t *vdata = radix_vertex_meta(t, v) - radix_value_size(t);
+	if (t->flags & RADIX_INLINE_VALUES)
+		return vdata;
+
+	void *data;
+	memcpy(&data, vdata, sizeof(data));
+	return data;
+}
+
+/* Store data as the value of v. In RADIX_INLINE_VALUES trees data points to the value
+ * bytes, which may overlap the slot of v. The metadata moves along when the value
+ * slot appears or goes; v must already have the room for it */
+static void
+radix_set_data(radix_tree *t, radix_vertex *v, void *data)
+{
+	uint8_t *meta = radix_vertex_meta(t, v);
+
+	v->is_key = true;
+	v->is_null = data == NULL;
+	memmove(radix_vertex_meta(t, v), meta, t->meta_size);
+
+	if (data != NULL)
+	{
+		uint8_t *vdata = radix_vertex_meta(t, v) - radix_value_size(t);
+		if (t->flags & RADIX_INLINE_VALUES)
+			memmove(vdata, data, radix_value_size(t));
+		else
+			memcpy(vdata, &data, sizeof(void *));
+	}
+}
+
+/* Make dst hold the key of src: its value and its metadata */
+static void
+_radix_move_key(radix_tree *t, radix_vertex *dst, radix_vertex *src)
+{
+	if (!src->is_key)
+		return;
+
+	radix_set_data(t, dst, radix_get_data(t, src));
+	memcpy(radix_vertex_meta(t, dst), radix_vertex_meta(t, src), t->meta_size);
+}
+
+/* Hand the value of v to the caller's old: a void * in pointer trees, a buffer of
+ * value_size bytes in RADIX_INLINE_VALUES trees, zeroed for a key without value */
+static void
+_radix_get_old(radix_tree *t, radix_vertex *v, void *old)
+{
+	void *data = radix_get_data(t, v);
+
+	if (!(t->flags & RADIX_INLINE_VALUES))
+		memcpy(old, &data, sizeof(data));
+	else if (data)
+		memcpy(old, data, radix_value_size(t));
+	else
+		memset(old, 0, radix_value_size(t));
+}
+
+/* RADIX_SCORES metadata: the score of the key, then the highest score in the subtree */
+static inline uint64_t
+_radix_score(radix_tree *t, radix_vertex *v, size_t field)
+{
+	uint64_t score;
+	memcpy(&score, radix_vertex_meta(t, v) + t->meta_scores + field * sizeof(score), sizeof(score));
+	return score;
+}
+
+static inline void
+_radix_set_score(radix_tree *t, radix_vertex *v, size_t field, uint64_t score)
+{
+	memcpy(radix_vertex_meta(t, v) + t->meta_scores + field * sizeof(score), &score, sizeof(score));
+}
+
+#define RADIX_SCORE_KEY 0
+#define RADIX_SCORE_MAX 1
+
+/* RADIX_CACHE metadata: the clock at the last insert or lookup of the key */
+static inline uint64_t
+_radix_last_access(radix_tree *t, radix_vertex *v)
+{
+	uint64_t clock;
+	memcpy(&clock, radix_vertex_meta(t, v) + t->meta_cache, sizeof(clock));
+	return clock;
+}
+
+static inline void
+_radix_touch(radix_tree *t, radix_vertex *v)
+{
+	if (!(t->flags & RADIX_CACHE))
+		return;
+
+	uint64_t clock = ++t->clock;
+	memcpy(radix_vertex_meta(t, v) + t->meta_cache, &clock, sizeof(clock));
+}
+
+/* RADIX_TTL metadata: the time the key expires at, 0 if it never does */
+static inline uint64_t
+_radix_expire_time(radix_tree *t, radix_vertex *v)
+{
+	uint64_t expire;
+	memcpy(&expire, radix_vertex_meta(t, v) + t->meta_ttl, sizeof(expire));
+	return expire;
+}
+
+static inline bool
+_radix_expired(radix_tree *t, radix_vertex *v)
+{
+	if (!(t->flags & RADIX_TTL))
+		return false;
+
+	uint64_t expire = _radix_expire_time(t, v);
+	return expire && expire <= t->now;
+}
+
+/* Recompute the subtree max of v from its key and its children */
+static void
+_radix_score_update(radix_tree *t, radix_vertex *v)
+{
+	uint64_t max = v->is_key ? _radix_score(t, v, RADIX_SCORE_KEY) : 0;
+	int num_children = radix_vertex_num_children(v);
+
+	for (int i = 0; i < num_children; ++i)
+	{
+		uint64_t child_max = _radix_score(t, _radix_child(t, radix_vertex_child_ptr(t, v, i)), RADIX_SCORE_MAX);
+		if (child_max > max)
+			max = child_max;
+	}
+
+	_radix_set_score(t, v, RADIX_SCORE_MAX, max);
+}
+
+static radix_vertex *
+_radix_realloc_data(radix_tree *t, radix_vertex *v, void *data)
+{
+	if (data == NULL) // realloc unnecessary
+		return v;
+
+	size_t curr_size = radix_vertex_current_size(t, v);
+	return _vertex_realloc(t, v, curr_size + radix_value_size(t));
+}
+
+static void
+_radix_free(radix_tree *t, radix_vertex *v, void (*free_callback)(void *))
+{
+	debug_vertex("free traversing", v);
+	int num_children = radix_vertex_num_children(v);
+	uint8_t *cp = radix_vertex_last_child_ptr(t, v);
+
+	while (num_children--)
+	{
+		radix_vertex *c = _radix_child(t, cp);
+		_radix_free(t, c, free_callback);
+		cp -= radix_ref_size(t);
+	}
+
+	debug_vertex("free depth-first", v);
+	
+	if (free_callback && !v->is_null && v->is_key)
+		free_callback(radix_get_data(t, v));
+
+	_vertex_free(t, v);
+	--t->num_vertices;
+}
+
+/* Call free_callback on the values of a frozen tree and release its storage.
+ * Every vertex of a frozen tree is placed once, back to back, in its blocks or arena */
+static void
+_radix_free_frozen(radix_tree *t, void (*free_callback)(void *))
+{
+	if (t->arena)
+	{
+		size_t pos = 0;
+		while (pos < t->arena->used)
+		{
+			radix_vertex *v = (radix_vertex *)(t->arena->base + pos + RADIX_ARENA_UNIT);
+			if (free_callback && radix_vertex_has_value(v))
+				free_callback(radix_get_data(t, v));
+			pos += (size_t)_arena_units(v) * RADIX_ARENA_UNIT;
+		}
+
+		_arena_destroy(t->arena);
+	}
+
+	for (size_t b = 0; b < t->num_blocks; ++b)
+	{
+		size_t pos = 0;
+		for (size_t k = 0; k < t->blocks[b].live; ++k)
+		{
+			radix_vertex *v = (radix_vertex *)(t->blocks[b].base + pos);
+			if (free_callback && radix_vertex_has_value(v))
+				free_callback(radix_get_data(t, v));
+			pos += (radix_vertex_current_size(t, v) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+		}
+
+		free(t->blocks[b].base);
+	}
+
+	t->arena = NULL;
+	t->num_blocks = 0;
+	t->num_vertices = 0;
+}
+
+void 
+radix_free_callback(radix_tree *t, void (*free_callback)(void *))
+{
+	_radix_trace_free(t);
+
+	if (t->flags & RADIX_FROZEN)
+		_radix_free_frozen(t, free_callback);
+	else
+		_radix_free(t, t->head, free_callback);
+	assert(t->num_vertices == 0);
+	assert(t->num_blocks == 0);
+	if (t->arena)
+		_arena_destroy(t->arena);
+	if (t->expiry)
+		radix_free(t->expiry);
+	_radix_filter_free(t->filter);
+	_radix_jump_free(t->jump);
+	_radix_sampling_free(t);
+	free(t->blocks);
+	free(t->pending);
+	free(t);
+}
+
+void 
+radix_free(radix_tree *t)
+{
+	radix_free_callback(t, NULL);
+}
+
+/* Return the length of the common prefix of a and b, looking at n bytes at most.
+ * Compares 32/16 bytes at a time with SIMD where available, then a word at a time,
+ * and locates the first differing byte with ctz on the compare / xor mask.
+ * All loads are unaligned; compressed vertex data has no alignment guarantee */
+static inline size_t
+_radix_mismatch(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+
+#if defined(__SSE2__)
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		uint32_t mask = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+	for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t))
+	{
+		uint64_t wa, wb;
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		uint64_t x = wa ^ wb;
+		if (x)
+		{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return i + (__builtin_ctzll(x) >> 3);
+#else
+			return i + (__builtin_clzll(x) >> 3);
+#endif
+		}
+	}
+#endif
+
+	for (; i < n; ++i)
+	{
+		if (a[i] != b[i])
+			break;
+	}
+
+	return i;
+}
+
+/* Match the key s[*i..len) against vertex h, advancing *i past the matched bytes.
+ * Return the link to the child the walk continues into, or NULL if it stops at h.
+ * For a compressed vertex *j is left at the position of the first mismatch */
+static inline uint8_t *
+_radix_walk_step(radix_tree *t, radix_vertex *h, uint8_t *s, size_t len, size_t *i, size_t *j)
+{
+	uint8_t *data = h->data;
+
+	if (h->is_compressed)
+	{
+		size_t n = len - *i < h->size ? len - *i : h->size;
+		*j = _radix_mismatch(data, s + *i, n);
+		*i += *j;
+		if (*j != h->size) 
+			return NULL;
+
+		return radix_vertex_first_child_ptr(t, h);
+	} 
+
+	/* curiously, linear search in contiguous memory is comparable to binary search */
+	for (*j = 0; *j < h->size; ++*j)
+	{
+		if (data[*j] == s[*i])
+			break;
+	}
+	if (*j == h->size)
+		return NULL;
+	++*i;
+
+	return radix_vertex_child_ptr(t, h, *j);
+}
+
+static inline size_t 
+_radix_walk(radix_tree *t, uint8_t *s, size_t len, radix_vertex **_stop_vertex, uint8_t **_parent_link, int *_split_pos, radix_stack *stack)
+{
+	radix_vertex *h = t->head;
+	uint8_t *parent_link = (uint8_t *)&t->head;
+
+	size_t i = 0; /* pos in the string */
+	size_t j = 0; /* position in the vertex children */
+
+	/* lookups skip the top of the tree, the others need the links and vertices on the way */
+	if (t->jump && _parent_link == NULL && stack == NULL)
+		h = _radix_jump(t, s, len, &i);
+
+	while (h->size && i < len)
+	{
+		uint8_t *link = _radix_walk_step(t, h, s, len, &i, &j);
+		if (link == NULL)
+			break;
+
+		if (stack)
+		{
+			_stack_push(stack, h);
+		}
+
+		h = _radix_child(t, link);
+		parent_link = link;
+		j = 0;
+	}
+
+	if (_stop_vertex)
+		*_stop_vertex = h;
+
+	if (_parent_link)
+		*_parent_link = parent_link;
+
+	if (_split_pos && h->is_compressed)
+		*_split_pos = j;
+
+	return i;
+}
+
+static radix_vertex *
+_compress(radix_tree *t, radix_vertex *v, uint8_t *s, size_t len, radix_vertex **child)
+{
+	assert(v->size == 0 && !v->is_compressed);	
+
+	size_t curr_size, new_size;
+
+	debugf("Compress vertice: '%.*s'\n", (int)len, s);
+
+	*child = _new_vertex(t, 0, 0);
+	if (*child == NULL) return NULL;
+
+	curr_size = radix_vertex_current_size(t, v);
+	new_size = radix_vertex_size(t, len, 1, radix_vertex_has_value(v));
+
+	radix_vertex *newv = _vertex_realloc(t, v, new_size);
+	if (newv == NULL)
+	{
+		_vertex_free(t, *child);
+		return NULL;
+	}
+
+	v = newv;
+
+	/* move the value and metadata past the new data before the data overwrites them */
+	size_t tail_size = radix_vertex_tail_size(t, v);
+	memmove((uint8_t *)v + new_size - tail_size, (uint8_t *)v + curr_size - tail_size, tail_size);
+
+	v->is_compressed = true;
+	v->size = len;
+	memcpy(v->data, s, len);
+
+	_radix_set_child(t, radix_vertex_last_child_ptr(t, v), *child);
+
+	return v;
+}
+
+static radix_vertex *
+_add_child(radix_tree *t, radix_vertex *v, uint8_t c, radix_vertex **childptr, uint8_t **parent_link)
+{
+	assert(!v->is_compressed);
+
+	size_t curr_size = radix_vertex_current_size(t, v);
+	++v->size;
+	size_t new_size = radix_vertex_current_size(t, v);
+	--v->size; // restore; update on success at the end
+
+	radix_vertex *child = _new_vertex(t, 0, 0); // allocate it
+	if (child == NULL) return NULL;
+
+	radix_vertex *newv = _vertex_realloc(t, v, new_size);
+	if (newv == NULL)
+	{
+		_vertex_free(t, child);
+		return NULL;
+	}
+
+	v = newv;
+	
+	int pos;
+	for (pos = 0; pos < v->size; ++pos)
+	{
+		if (v->data[pos] > c) break;
+	}
+
+	/* the value and metadata go to the end first, the children move into their room */
+	size_t tail_size = radix_vertex_tail_size(t, v);
+	memmove((uint8_t *)v + new_size - tail_size, (uint8_t *)v + curr_size - tail_size, tail_size);
+
+	/* the children move up by the new edge byte and any change in padding */
+	size_t ref_size = radix_ref_size(t);
+	uint8_t *old_cp = radix_vertex_first_child_ptr(t, v);
+	uint8_t *new_cp = v->data + v->size + 1 + radix_vertex_padding(t, v->size + 1);
+
+	memmove(new_cp + ref_size * (pos + 1), old_cp + ref_size * pos, ref_size * (v->size - pos));
+	memmove(new_cp, old_cp, ref_size * pos);
+
+	uint8_t *src = v->data + pos;
+	memmove(src + 1, src, v->size - pos);
+
+	v->data[pos] = c;
+	++v->size;
+
+	uint8_t *childfield = radix_vertex_child_ptr(t, v, pos);
+	_radix_set_child(t, childfield, child);
+
+	*childptr = child;
+	*parent_link = childfield;
+
+	return v;
+}
+
+/* returns 0 on no insert, returns 1 on insert. Unless it ran out of memory, *key_vertex
+ * is the vertex of s, new or updated, and stack (if any) its ancestors from the head */
+static int
+_radix_insert(radix_tree *t, uint8_t *s, size_t len, void *data, void *old, bool overwrite, radix_vertex **key_vertex, radix_stack *stack)
+{
+	size_t i;
+	int j = 0; /* split position */
+	radix_vertex *h;
+	uint8_t *parent_link;
+
+	debugf("### Insert '%.*s' with value %p\n", (int)len, s, data);
+
+	*key_vertex = NULL;
+	if (t->flags & RADIX_FROZEN)
+		return 0;
+
+	++t->version;
+
+	if (t->batch)
+		i = _radix_walk_batch(t, t->batch, s, len, &h, &parent_link, &j, stack);
+	else
+		i = _radix_walk(t, s, len, &h, &parent_link, &j, stack);
+
+	if (i == len && (!h->is_compressed || j == 0)) // key vertex exists and it's not compressed
+	{
+		debugf("### Insert: vertice representing key exists\n");
+
+		/* an expired key is not found, so it is not overwritten either: s is a new key
+		 * in the same vertex, its value goes to evict as with _radix_del() */
+		bool expired = h->is_key && _radix_expired(t, h);
+
+		if (!h->is_key || (h->is_null && (overwrite || expired)))
+		{
+			h = _radix_realloc_data(t, h, data);
+			if (h)
+				_radix_set_child(t, parent_link, h);
+		}
+		if (h == NULL)
+			return 0;
+
+		*key_vertex = h;
+
+		if (expired)
+		{
+			if (t->evict)
+				t->evict(t->evict_ctx, s, len, radix_get_data(t, h));
+			radix_set_data(t, h, data);
+			return 1;
+		}
+
+		// update key
+		if (h->is_key)
+		{
+			if (old)
+				_radix_get_old(t, h, old);
+
+			if (overwrite)
+				radix_set_data(t, h, data);
+
+			return 0;
+		}
+
+		radix_set_data(t, h, data);
+		++t->num_elements;
+		return 1;
+	}
+
+	/* 
+	 * uncompress the compressed vertex (if this is the case) 
+	 * */
+
+	if (i != len && h->is_compressed)
+	{
+		debugf("Algorithm 1: Stopped at compressed node '%.*s' (%p)\n",
+				h->size, h->data, (void*)h);
+		debugf("Still to insert: '%.*s'\n", (int)(len-i), s+i);
+		debugf("Splitting at %d: '%c'\n", j, ((char*)h->data)[j]);
+		debugf("Other (key) letter is '%c'\n", s[i]);
+
+		/* Save next pointer */
+		radix_vertex *next = _radix_child(t, radix_vertex_last_child_ptr(t, h));
+
+		debugf("Next is %p\n", (void*)next);
+		debugf("is_key %d\n", h->is_key);
+		if (h->is_key) {
+			debugf("key value is %p\n", radix_get_data(t, h));
+		}
+
+		size_t prefix_len = j;
 		size_t postfix_len = h->size - j - 1;
 		bool split_vertex_is_key = !prefix_len && !h->is_null && h->is_key;
 		size_t vertex_size;
 
-		/* Create un-compressed vertex */
-		radix_vertex *split_vertex = _new_vertex(1, split_vertex_is_key); // 1 child
-		radix_vertex *prefix = NULL;
-		radix_vertex *postfix = NULL;
+		/* Create un-compressed vertex */
+		radix_vertex *split_vertex = _new_vertex(t, 1, split_vertex_is_key); // 1 child
+		radix_vertex *prefix = NULL;
+		radix_vertex *postfix = NULL;
+
+		if (prefix_len)
+		{
+			vertex_size = radix_vertex_size(t, prefix_len, 1, radix_vertex_has_value(h));
+			prefix = _vertex_alloc(t, vertex_size);
+		}
+
+		if (postfix_len)
+		{
+			vertex_size = radix_vertex_size(t, postfix_len, 1, false);
+			postfix = _vertex_alloc(t, vertex_size);
+		}
+
+		// abort on OOM
+		if (split_vertex == NULL || (prefix_len && prefix == NULL) || (postfix_len && postfix == NULL))
+		{
+			_vertex_free(t, split_vertex);
+			_vertex_free(t, prefix);
+			_vertex_free(t, postfix);
+			return 0;
+		}
+
+		split_vertex->data[0] = h->data[j];
+
+		/* Create prefix vertex */
+		if (j == 0)
+		{
+			/* Replace old vertex with split vertex */
+			_radix_move_key(t, split_vertex, h);
+			_radix_set_child(t, parent_link, split_vertex);
+		}
+		else
+		{
+			/* Trim the compressed vertex into prefix */
+			prefix->size = prefix_len;
+			memcpy(prefix->data, h->data, prefix_len);
+			prefix->is_compressed = prefix_len > 1;
+			prefix->is_key = false;
+			prefix->is_null = false;
+			_radix_move_key(t, prefix, h);
+
+			uint8_t *cp = radix_vertex_last_child_ptr(t, prefix);
+			_radix_set_child(t, cp, split_vertex);
+			_radix_set_child(t, parent_link, prefix);
+			parent_link = cp; // set parent link to split_vertex parent
+			++t->num_vertices;
+
+			if (stack)
+				_stack_push(stack, prefix);
+		}
+
+		/* Create postfix vertex */
+		if (postfix_len)
+		{
+			postfix->size = postfix_len;
+			memcpy(postfix->data, h->data + prefix_len + 1, postfix_len);
+			postfix->is_compressed = postfix_len > 1;
+			postfix->is_key = false;
+			postfix->is_null = false;
+
+			_radix_set_child(t, radix_vertex_last_child_ptr(t, postfix), next);
+			++t->num_vertices;
+
+			/* off the path of s, so no later update reaches it */
+			if (t->flags & RADIX_SCORES)
+				_radix_score_update(t, postfix);
+		}
+		else
+		{
+			postfix = next;
+		}
+
+		/* Set split_vertex's last child as the postfix node */
+		_radix_set_child(t, radix_vertex_last_child_ptr(t, split_vertex), postfix);
+		
+		/* Continue to fall-through (insertion) */
+		_vertex_free(t, h);
+		h = split_vertex;
+	}
+	else if (i == len && h->is_compressed)
+	{
+		debugf("Algorithm 2: Stopped at compressed node '%.*s' (%p) j = %d\n",
+				h->size, h->data, (void*)h, j);
+
+		/* Save next pointer */
+		radix_vertex *next = _radix_child(t, radix_vertex_last_child_ptr(t, h));
+
+		size_t postfix_len = h->size - j;
+		size_t vertex_size = radix_vertex_size(t, postfix_len, 1, data != NULL);
+
+		radix_vertex *postfix = _vertex_alloc(t, vertex_size);
+
+		vertex_size = radix_vertex_size(t, j, 1, radix_vertex_has_value(h));
+
+		radix_vertex *prefix = _vertex_alloc(t, vertex_size);
+
+		if (prefix == NULL || postfix == NULL)
+		{
+			_vertex_free(t, prefix);
+			_vertex_free(t, postfix);
+			return 0;
+		}
+
+		/* Create postfix vertex */
+		postfix->size = postfix_len;
+		memcpy(postfix->data, h->data + j, postfix_len);
+		postfix->is_compressed = postfix_len > 1;
+		postfix->is_key = false;
+		postfix->is_null = false;
+		radix_set_data(t, postfix, data);
+
+		_radix_set_child(t, radix_vertex_last_child_ptr(t, postfix), next);
+		++t->num_vertices;
+
+		/* Trim compressed vertex */
+		prefix->size = j;
+		memcpy(prefix->data, h->data, j);
+		prefix->is_compressed = j > 1;
+		prefix->is_key = false;
+		prefix->is_null = false;
+
+		_radix_set_child(t, parent_link, prefix);
+		_radix_move_key(t, prefix, h);
+
+		_radix_set_child(t, radix_vertex_last_child_ptr(t, prefix), postfix);
+
+		/* key is already inserted */
+
+		++t->num_elements;
+		_vertex_free(t, h);
+
+		if (stack)
+			_stack_push(stack, prefix);
+		*key_vertex = postfix;
+		return 1;
+	}
+
+	/* fall through, still got some chars left to go in string */
+	while (i < len)
+	{
+		radix_vertex *child;	
+
+		/* successive vertices with 1 children are compressed */
+		if (h->size == 0 && len - i > 1)
+		{
+			debugf("Inserting compressed vertice\n");
+			size_t compressed_size = len - i;
+			if (compressed_size > RADIX_VERTEX_MAX_SIZE) 
+				compressed_size = RADIX_VERTEX_MAX_SIZE;
+
+			radix_vertex *newh = _compress(t, h, s+i, compressed_size, &child);
+			if (newh == NULL)
+				goto OOM;
+
+			h = newh;
+			_radix_set_child(t, parent_link, h);
+			parent_link = radix_vertex_last_child_ptr(t, h);
+			i += compressed_size;
+		}
+		else // normal insert
+		{
+			debugf("Inserting normal vertice\n");
+			uint8_t *new_parent_link;
+			radix_vertex *newh = _add_child(t, h, s[i], &child, &new_parent_link);
+			if (newh == NULL)
+				goto OOM;
+
+			h = newh;
+			_radix_set_child(t, parent_link, h);
+			parent_link = new_parent_link;
+			++i;
+		}
+
+		++t->num_vertices;
+		if (stack)
+			_stack_push(stack, h);
+		h = child;
+	}
+
+	radix_vertex *newh = _radix_realloc_data(t, h, data);
+	if (newh == NULL)
+		goto OOM;
+	
+	h = newh;
+	if (!h->is_key)
+		++t->num_elements;
+
+	radix_set_data(t, h, data);
+	_radix_set_child(t, parent_link, h);
+	*key_vertex = h;
+	return 1;
+
+OOM: // out of memory
+	if (h->size == 0)
+	{
+		h->is_null = true;
+		h->is_key = true;
+		++t->num_elements; /* compensation for next removal */
+		assert(_radix_del(t, s, i, NULL) != 0);
+	}
+
+	return 0;
+}
+
+/* Recompute the subtree max of the vertices on the path of s, bottom-up. If set_key,
+ * the key s gets score first */
+static void
+_radix_scores_update_path(radix_tree *t, uint8_t *s, size_t len, bool set_key, uint64_t score)
+{
+	radix_vertex *h;
+	radix_stack stack;
+	int split_pos = 0;
+
+	_stack_init(&stack);
+	size_t i = _radix_walk(t, s, len, &h, NULL, &split_pos, &stack);
+
+	if (set_key && i == len && (!h->is_compressed || split_pos == 0) && h->is_key)
+		_radix_set_score(t, h, RADIX_SCORE_KEY, score);
+
+	for (; h; h = _stack_pop(&stack))
+		_radix_score_update(t, h);
+
+	_stack_free(&stack);
+}
+
+/* Return the vertex of key s, or NULL if s is not a key */
+static radix_vertex *
+_radix_key_vertex(radix_tree *t, uint8_t *s, size_t len)
+{
+	radix_vertex *h;
+	int split_pos = 0;
+
+	size_t i = _radix_walk(t, s, len, &h, NULL, &split_pos, NULL);
+	if (i != len || (h->is_compressed && split_pos != 0) || !h->is_key)
+		return NULL;
+
+	return h;
+}
+
+/* Add (or remove) the entry of key s expiring at expire to the expiry index of t.
+ * On OOM the entry is missing and the key is only hidden once expired, or the entry
+ * is left behind and radix_expire() drops it */
+static void
+_radix_expiry_index(radix_tree *t, uint8_t *s, size_t len, uint64_t expire, bool add)
+{
+	uint8_t buf[256];
+	uint8_t *entry = len + 8 <= sizeof(buf) ? buf : malloc(len + 8);
+	if (entry == NULL)
+		return;
+
+	for (int i = 0; i < 8; ++i)
+		entry[i] = expire >> (56 - 8 * i);
+	memcpy(entry + 8, s, len);
+
+	if (add)
+		_radix_insert_scored(t->expiry, entry, len + 8, NULL, NULL, false, 0, 0);
+	else
+		_radix_del(t->expiry, entry, len + 8, NULL);
+
+	if (entry != buf)
+		free(entry);
+}
+
+static int
+_radix_insert_scored(radix_tree *t, uint8_t *s, size_t len, void *data, void *old, bool set_score, uint64_t score, uint64_t expire)
+{
+	RADIX_TRACE_START(t);
+	_radix_sample(t, s, len);
+
+	/* a frozen tree refuses the insert, and its vertices are shared by other keys: no
+	 * expired key goes, no score, access or expiry time is written */
+	if (t->flags & RADIX_FROZEN)
+	{
+		RADIX_TRACE_INSERT_KEY(t, s, len, data, expire);
+		return 0;
+	}
+
+	/* the vertices on the path of s, for the scores to be updated bottom-up */
+	radix_stack stack;
+	radix_vertex *h;
+	_stack_init(&stack);
+
+	/* an expired key inserted again is counted in the filter already */
+	uint64_t num_elements = t->num_elements;
+
+	_radix_jump_begin(t, s, len);
+	int inserted = _radix_insert(t, s, len, data, old, 1, &h, (t->flags & RADIX_SCORES) ? &stack : NULL);
+	_radix_jump_sync(t);
+
+	if (t->num_elements > num_elements && t->filter)
+		_radix_filter_add(t, s, len);
+
+	/* new keys score 0 unless told otherwise. On OOM, what the insert undid has been
+	 * updated by _radix_del() */
+	if ((t->flags & RADIX_SCORES) && h)
+	{
+		if (set_score || inserted)
+			_radix_set_score(t, h, RADIX_SCORE_KEY, set_score ? score : 0);
+
+		if (stack.oom)
+			_radix_scores_update_path(t, s, len, false, 0);
+		else
+			for (radix_vertex *v = h; v; v = _stack_pop(&stack))
+				_radix_score_update(t, v);
+	}
+	_stack_free(&stack);
+
+	if ((t->flags & (RADIX_CACHE | RADIX_TTL)) && h)
+	{
+		_radix_touch(t, h);
+
+		/* the vertex of a new key holds whatever was there, an old value included: it
+		 * has no expiry time yet. Updated keys keep their entry if it stays */
+		if (t->flags & RADIX_TTL)
+		{
+			bool new_key = t->num_elements > num_elements;
+			uint64_t prev = new_key ? 0 : _radix_expire_time(t, h);
+			if (new_key || prev != expire)
+			{
+				if (prev)
+					_radix_expiry_index(t, s, len, prev, false);
+				memcpy(radix_vertex_meta(t, h) + t->meta_ttl, &expire, sizeof(expire));
+				if (expire)
+					_radix_expiry_index(t, s, len, expire, true);
+			}
+		}
+
+		_radix_evict(t);
+	}
+
+	RADIX_TRACE_INSERT_KEY(t, s, len, data, expire);
+	return inserted;
+}
+
+/* overwriting insert that updates the element if it exists */
+int 
+radix_insert(radix_tree *t, uint8_t *s, size_t len, void *data, void **old)
+{
+	/* old would only hold a pointer, inline values go through the _inline calls */
+	assert(!(t->flags & RADIX_INLINE_VALUES) || old == NULL);
+	return _radix_insert_scored(t, s, len, data, old, false, 0, 0);
+}
+
+int
+radix_insert_inline(radix_tree *t, uint8_t *s, size_t len, const void *value, void *old)
+{
+	assert(t->flags & RADIX_INLINE_VALUES);
+	return _radix_insert_scored(t, s, len, (void *)value, old, false, 0, 0);
+}
+
+int
+radix_insert_scored(radix_tree *t, uint8_t *s, size_t len, void *data, uint64_t score, void **old)
+{
+	assert(t->flags & RADIX_SCORES);
+	assert(!(t->flags & RADIX_INLINE_VALUES) || old == NULL);
+	return _radix_insert_scored(t, s, len, data, old, true, score, 0);
+}
+
+int
+radix_insert_ttl(radix_tree *t, uint8_t *s, size_t len, void *data, uint64_t expire, void **old)
+{
+	assert(t->flags & RADIX_TTL);
+	assert(!(t->flags & RADIX_INLINE_VALUES) || old == NULL);
+	return _radix_insert_scored(t, s, len, data, old, false, 0, expire);
+}
+
+int
+radix_set_score(radix_tree *t, uint8_t *s, size_t len, uint64_t score)
+{
+	radix_vertex *h;
+	int split_pos = 0;
+
+	assert(t->flags & RADIX_SCORES);
+
+	if (t->flags & RADIX_FROZEN)
+		return 0;
+
+	size_t i = _radix_walk(t, s, len, &h, NULL, &split_pos, NULL);
+	if (i != len || (h->is_compressed && split_pos != 0) || !h->is_key)
+		return 0;
+
+	_radix_scores_update_path(t, s, len, true, score);
+	return 1;
+}
+
+static uint8_t *
+_radix_find_parent_link(radix_tree *t, radix_vertex *parent, radix_vertex *child)
+{
+	uint8_t *cp = radix_vertex_first_child_ptr(t, parent);
+
+	while (_radix_child(t, cp) != child)
+		cp += radix_ref_size(t);
+
+	return cp;
+}
+
+static radix_vertex *
+_radix_del_child(radix_tree *t, radix_vertex *parent, radix_vertex *child, bool shrink)
+{
+	debug_vertex("_radix_del_child before", parent);
+
+	if (t->jump)
+		_radix_jump_changed(t, parent);
+
+	if (parent->is_compressed)
+	{
+		size_t tail_size = radix_vertex_tail_size(t, parent);
+		uint8_t *tail = (uint8_t *)parent + radix_vertex_current_size(t, parent) - tail_size;
+
+		parent->is_compressed = false;
+		parent->size = 0;
+
+		memmove((uint8_t *)parent + radix_vertex_current_size(t, parent) - tail_size, tail, tail_size);
+
+		debug_vertex("_radix_del_child after", parent);
+		return parent;
+	}
+
+	/* if not compressed, find child pointer and move */
+
+	size_t ref_size = radix_ref_size(t);
+	uint8_t *cp = radix_vertex_first_child_ptr(t, parent);
+	uint8_t *c = _radix_find_parent_link(t, parent, child);
+	size_t k = (c - cp) / ref_size;
+
+	int tail_len = parent->size - k - 1;
+	debugf("_radix_del_child tail len: %d\n", tail_len);
+	memmove(parent->data + k, parent->data + k + 1, tail_len);
+
+	/* the children move down by the removed edge byte and any change in padding */
+	uint8_t *new_cp = parent->data + parent->size - 1 + radix_vertex_padding(t, parent->size - 1);
+	memmove(new_cp, cp, k * ref_size);
+
+	memmove(new_cp + k * ref_size, c + ref_size, tail_len * ref_size + radix_vertex_tail_size(t, parent));
+
+	--parent->size;
+
+	/* lazy trees leave the vertex overallocated until radix_compact() */
+	if (!shrink)
+		return parent;
+
+	/* frees data if overallocated; if it fails the old address is returned - which is valid */
+	radix_vertex *newv = _vertex_realloc(t, parent, radix_vertex_current_size(t, parent));
+	if (newv)
+		debug_vertex("_radix_del_child after", newv);
+
+	return newv ? newv : parent;
+}
+
+/* Merge the chain of non-key single child vertices around h into one compressed vertex.
+ * The stack holds the ancestors of h; it is consumed while looking for the start of the chain */
+static void
+_radix_compress_chain(radix_tree *t, radix_stack *stack, radix_vertex *h)
+{
+	debug_vertex("Compression may be needed",h);
+	debugf("Seek start node\n");
+
+	radix_vertex *parent;
+	while (1)
+	{
+		parent = _stack_pop(stack);
+		if (!parent || parent->is_key || (!parent->is_compressed && parent->size != 1)) break;
+		h = parent;
+		debug_vertex("Going up to",h);
+	}
+
+	radix_vertex *start = h;
+	size_t compression_size = h->size;
+
+	int vertices = 1;
+	while (h->size != 0)
+	{
+		h = _radix_child(t, radix_vertex_last_child_ptr(t, h));
+		if (h->is_key || (!h->is_compressed && h->size != 1)) break;
+		if (compression_size + h->size > RADIX_VERTEX_MAX_SIZE) break;
+		++vertices;
+		compression_size += h->size;
+	}
+	if (vertices > 1)
+	{
+		size_t vertex_size = radix_vertex_size(t, compression_size, 1, false);
+		radix_vertex *new = _vertex_alloc(t, vertex_size);
+
+		// technically an OOM error here just means optimizing the node isn't possible, the tree should still be intact
+		if (new == NULL)
+			return;
+
+		new->is_null = false;
+		new->is_key = false;
+		new->is_compressed = true;
+		new->size = compression_size;
+		++t->num_vertices;
+
+		compression_size = 0;
+		h = start;
+		while (h->size != 0)
+		{
+			memcpy(new->data + compression_size, h->data, h->size);
+			compression_size += h->size;
+			radix_vertex *to_free = h;
+			h = _radix_child(t, radix_vertex_last_child_ptr(t, h));
+			_vertex_free(t, to_free);
+			--t->num_vertices;
+			if (h->is_key || (!h->is_compressed && h->size != 1)) break;
+
+		}
+		debug_vertex("New vertex", new);
+
+		// fix parent link, h should point to first vertex
+		_radix_set_child(t, radix_vertex_last_child_ptr(t, new), h);
+		if (t->flags & RADIX_SCORES)
+			_radix_score_update(t, new);
+
+		if (parent)
+		{
+			_radix_set_child(t, _radix_find_parent_link(t, parent, start), new);
+		}
+		else
+		{
+			t->head = new;
+		}
+
+		debugf("Compressed %d vertices, %d total bytes\n", vertices, (int)compression_size);
+	}
+}
+
+/* Remember a deleted key so radix_compact() can revisit its path later.
+ * Entries are stored back to back as [size_t len][len bytes] */
+static void
+_radix_pending_push(radix_tree *t, uint8_t *s, size_t len)
+{
+	size_t needed = sizeof(size_t) + len;
+
+	if (t->pending_pos && t->pending_pos >= t->pending_len / 2)
+	{
+		/* drop the entries already consumed by radix_compact() */
+		memmove(t->pending, t->pending + t->pending_pos, t->pending_len - t->pending_pos);
+		t->pending_len -= t->pending_pos;
+		t->pending_pos = 0;
+	}
+
+	if (t->pending_len + needed > t->pending_capacity)
+	{
+		size_t capacity = t->pending_capacity ? t->pending_capacity * 2 : 256;
+		while (capacity < t->pending_len + needed)
+			capacity *= 2;
+
+		uint8_t *pending = realloc(t->pending, capacity);
+		if (pending == NULL) // the path just stays uncompacted
+			return;
+
+		t->pending = pending;
+		t->pending_capacity = capacity;
+	}
+
+	memcpy(t->pending + t->pending_len, &len, sizeof(len));
+	memcpy(t->pending + t->pending_len + sizeof(len), s, len);
+	t->pending_len += needed;
+	++t->pending_count;
+}
+
+/* Shrink the vertex where the walk of s stops to its current size, then merge the
+ * single child chain it belongs to, if any */
+static void
+_radix_compact_path(radix_tree *t, uint8_t *s, size_t len)
+{
+	radix_vertex *h;
+	uint8_t *parent_link;
+	radix_stack stack;
+
+	_stack_init(&stack);
+	_radix_walk(t, s, len, &h, &parent_link, NULL, &stack);
+	_radix_jump_begin(t, s, len);
+
+	radix_vertex *newh = _vertex_realloc(t, h, radix_vertex_current_size(t, h));
+	if (newh)
+	{
+		h = newh;
+		_radix_set_child(t, parent_link, h);
+	}
+
+	if (!stack.oom && !h->is_key && (h->is_compressed || h->size == 1))
+		_radix_compress_chain(t, &stack, h);
+
+	_stack_free(&stack);
+	_radix_jump_sync(t);
+}
+
+size_t
+radix_compact(radix_tree *t, size_t budget)
+{
+	bool unlimited = budget == 0;
+
+	if (t->pending_count)
+		++t->version;
+
+	if (t->pending_count && t->batch)
+		t->batch->size = 0;
+
+	while (t->pending_count && (unlimited || budget--))
+	{
+		size_t len;
+		memcpy(&len, t->pending + t->pending_pos, sizeof(len));
+		uint8_t *s = t->pending + t->pending_pos + sizeof(len);
+
+		debugf("### Compact: %.*s\n", (int)len, s);
+		_radix_compact_path(t, s, len);
+
+		t->pending_pos += sizeof(len) + len;
+		--t->pending_count;
+	}
+
+	if (t->pending_count == 0)
+	{
+		t->pending_len = 0;
+		t->pending_pos = 0;
+	}
+
+	return t->pending_count;
+}
+
+static int
+_radix_del(radix_tree *t, uint8_t *s, size_t len, void *old)
+{
+	radix_vertex *h;
+	radix_stack stack;
+
+	debugf("### Delete: %.*s\n", (int)len, s);
+
+	if (t->flags & RADIX_FROZEN)
+		return 0;
+
+	_stack_init(&stack);
+	int split_pos = 0;
+
+	size_t i = t->batch ? _radix_walk_batch(t, t->batch, s, len, &h, NULL, &split_pos, &stack)
+		: _radix_walk(t, s, len, &h, NULL, &split_pos, &stack);
+	if (i != len || (h->is_compressed && split_pos != 0) || !h->is_key)
+	{
+		_stack_free(&stack);
+		return 0;
+	}
+
+	/* an expired key goes, but as one that was not found: whoever deletes it, its value
+	 * is handed to evict, which owns it from then on */
+	bool expired = _radix_expired(t, h);
+	if (expired && t->evict)
+		t->evict(t->evict_ctx, s, len, radix_get_data(t, h));
+	else if (old && !expired)
+		_radix_get_old(t, h, old);
+
+	uint64_t expire = (t->flags & RADIX_TTL) ? _radix_expire_time(t, h) : 0;
+
+	_radix_jump_begin(t, s, len);
+	++t->version;
+	h->is_key = false;
+	--t->num_elements;
+
+	/* if node has no children, need to compress / cleanup */
+	bool try_compress = false;
+	if (h->size == 0)
+	{
+		debugf("Key deleted in vertex without children. Cleanup needed.\n");
+		radix_vertex *child = NULL;
+
+		while (h != t->head)
+		{
+			child = h;
+			debugf("Freeing child %p [%.*s] key:%d\n", (void*)child, (int)child->size, (char*)child->data, child->is_key);
+			_vertex_free(t, child);
+			--t->num_vertices;
+			h = _stack_pop(&stack);
+			// stop if vertex holds a key, or if it has more than 1 child
+			if (h->is_key || (!h->is_compressed && h->size != 1))
+				break;
+		}
+		if (child)
+		{
+			debugf("Unlinking child %p from parent %p\n", (void*)child, (void*)h);
+
+			radix_vertex *new = _radix_del_child(t, h, child, !(t->flags & RADIX_LAZY_COMPRESS));
+			if (new != h)
+			{
+				radix_vertex *parent = _stack_peek(&stack);
+				uint8_t *parent_link;
+
+				if (parent == NULL)
+				{
+					parent_link = (uint8_t *)&t->head;
+				}
+				else
+				{
+					parent_link = _radix_find_parent_link(t, parent, h);
+				}
+				
+				_radix_set_child(t, parent_link, new);
+			}
+
+			if (new->size == 1 && !new->is_key)
+			{
+				try_compress = true;
+				h = new;
+			}
+		}
+	}
+	else if (h->size == 1)
+	{
+		try_compress = true;
+	}
+
+	/* lazy trees leave the chain (and any overallocation) for radix_compact() */
+	if (t->flags & RADIX_LAZY_COMPRESS)
+		_radix_pending_push(t, s, len);
+	else if (try_compress && !stack.oom)
+	{
+		debugf("After removing %.*s:\n", (int)len, s);
+		_radix_compress_chain(t, &stack, h);
+	}
+
+	/* what is left on the stack are the ancestors of the vertices changed, the merges
+	 * of _radix_compress_chain() included */
+	if (t->batch && t->batch->size > stack.size)
+		t->batch->size = stack.size;
+
+	_stack_free(&stack);
+	_radix_jump_sync(t);
+
+	if (t->flags & RADIX_SCORES)
+		_radix_scores_update_path(t, s, len, false, 0);
+
+	if (expire)
+		_radix_expiry_index(t, s, len, expire, false);
+
+	if (t->filter)
+		_radix_filter_count(t->filter, _radix_hash(s, len), false);
+
+	return !expired;
+}
+
+int
+radix_del(radix_tree *t, uint8_t *s, size_t len, void **old)
+{
+	assert(!(t->flags & RADIX_INLINE_VALUES) || old == NULL);
+
+	RADIX_TRACE_START(t);
+	int ret = _radix_del(t, s, len, old);
+	RADIX_TRACE_KEY(t, RADIX_TRACE_DEL, s, len);
+	return ret;
+}
+
+int
+radix_del_inline(radix_tree *t, uint8_t *s, size_t len, void *old)
+{
+	assert(t->flags & RADIX_INLINE_VALUES);
+
+	RADIX_TRACE_START(t);
+	int ret = _radix_del(t, s, len, old);
+	RADIX_TRACE_KEY(t, RADIX_TRACE_DEL, s, len);
+	return ret;
+}
+
+void *
+radix_find(radix_tree *t, uint8_t *s, size_t len)
+{
+	RADIX_TRACE_START(t);
+	void *data = _radix_find(t, s, len);
+	RADIX_TRACE_KEY(t, RADIX_TRACE_FIND, s, len);
+	return data;
+}
+
+/* the key vertex of s, NULL if s is not a (live) key */
+static radix_vertex *
+_radix_lookup(radix_tree *t, uint8_t *s, size_t len)
+{
+	radix_vertex *h;
+	int split_pos = 0;
+
+	debugf("### Lookup: '%.*s'\n", (int)len, s);
+
+	_radix_sample(t, s, len);
+
+	/* most misses stop here, before the walk */
+	if (t->filter && !_radix_filter_may_contain(t->filter, _radix_hash(s, len)))
+		return NULL;
+
+	size_t i = _radix_walk(t, s, len, &h, NULL, &split_pos, NULL);
+
+	if (i != len || (h->is_compressed && split_pos != 0) || !h->is_key || _radix_expired(t, h))
+		return NULL;
+
+	debugf("Found data: %p\n", radix_get_data(t, h));
+
+	_radix_touch(t, h);
+	return h;
+}
+
+static void *
+_radix_find(radix_tree *t, uint8_t *s, size_t len)
+{
+	radix_vertex *h = _radix_lookup(t, s, len);
+	return h ? radix_get_data(t, h) : NULL;
+}
+
+/* Like radix_find(), but tells a key without value (or with a NULL value) from a
+ * missing key: returns 1 and sets *data (if not NULL) when s is a key, 0 otherwise */
+int
+radix_lookup(radix_tree *t, uint8_t *s, size_t len, void **data)
+{
+	RADIX_TRACE_START(t);
+	radix_vertex *h = _radix_lookup(t, s, len);
+	if (h && data)
+		*data = radix_get_data(t, h);
+	RADIX_TRACE_KEY(t, RADIX_TRACE_FIND, s, len);
+	return h != NULL;
+}
+
+/* Like radix_find(), for RADIX_INLINE_VALUES trees: returns the address of the value
+ * bytes inside the key vertex, valid until the next modification of the tree */
+void *
+radix_find_inline(radix_tree *t, uint8_t *s, size_t len)
+{
+	assert(t->flags & RADIX_INLINE_VALUES);
+	return radix_find(t, s, len);
+}
+
+/* Like _radix_walk(), for the key made of the bytes of iov[0..iovcnt) in order.
+ * Segments are matched in place, a compressed vertex may span several of them */
+static size_t
+_radix_walkv(radix_tree *t, const radix_iovec *iov, int iovcnt, radix_vertex **_stop_vertex, int *_split_pos)
+{
+	radix_vertex *h = t->head;
+	size_t i = 0; /* bytes of the key matched */
+	size_t j = 0; /* position in the vertex data */
+	size_t off = 0; /* position in iov[seg] */
+	int seg = 0;
+
+	while (h->size)
+	{
+		if (h->is_compressed)
+		{
+			for (j = 0; j < h->size; )
+			{
+				while (seg < iovcnt && off == iov[seg].len)
+				{
+					++seg;
+					off = 0;
+				}
+				if (seg == iovcnt)
+					break;
+
+				const uint8_t *base = (const uint8_t *)iov[seg].base + off;
+				size_t n = iov[seg].len - off < h->size - j ? iov[seg].len - off : h->size - j;
+				size_t matched = _radix_mismatch(h->data + j, base, n);
+				j += matched;
+				off += matched;
+				i += matched;
+				if (matched != n)
+					break;
+			}
+
+			if (j != h->size)
+				break;
+
+			h = _radix_child(t, radix_vertex_first_child_ptr(t, h));
+			j = 0;
+			continue;
+		}
+
+		while (seg < iovcnt && off == iov[seg].len)
+		{
+			++seg;
+			off = 0;
+		}
+		if (seg == iovcnt)
+			break;
+
+		uint8_t c = ((const uint8_t *)iov[seg].base)[off];
+		for (j = 0; j < h->size; ++j)
+		{
+			if (h->data[j] == c)
+				break;
+		}
+		if (j == h->size)
+			break;
+
+		h = _radix_child(t, radix_vertex_child_ptr(t, h, j));
+		++off;
+		++i;
+		j = 0;
+	}
+
+	*_stop_vertex = h;
+	if (h->is_compressed)
+		*_split_pos = j;
+
+	return i;
+}
+
+static size_t
+_radix_iov_len(const radix_iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int k = 0; k < iovcnt; ++k)
+		len += iov[k].len;
+
+	return len;
+}
+
+/* Copy the segments into buf if they fit in size bytes, or else into a new allocation.
+ * Returns NULL on OOM */
+static uint8_t *
+_radix_iov_gather(const radix_iovec *iov, int iovcnt, size_t len, uint8_t *buf, size_t size)
+{
+	uint8_t *s = len <= size ? buf : malloc(len);
+	if (s == NULL)
+		return NULL;
+
+	size_t pos = 0;
+	for (int k = 0; k < iovcnt; ++k)
+	{
+		if (iov[k].len)
+			memcpy(s + pos, iov[k].base, iov[k].len);
+		pos += iov[k].len;
+	}
+
+	return s;
+}
+
+static void *
+_radix_findv(radix_tree *t, const radix_iovec *iov, int iovcnt)
+{
+	radix_vertex *h;
+	int split_pos = 0;
+
+	if (t->filter)
+	{
+		uint64_t hash = RADIX_HASH_INIT;
+		for (int k = 0; k < iovcnt; ++k)
+			hash = _radix_hash_step(hash, iov[k].base, iov[k].len);
+
+		if (!_radix_filter_may_contain(t->filter, hash))
+			return NULL;
+	}
+
+	size_t i = _radix_walkv(t, iov, iovcnt, &h, &split_pos);
+
+	if (i != _radix_iov_len(iov, iovcnt) || (h->is_compressed && split_pos != 0) || !h->is_key || _radix_expired(t, h))
+		return NULL;
+
+	_radix_touch(t, h);
+	return radix_get_data(t, h);
+}
+
+void *
+radix_findv(radix_tree *t, const radix_iovec *iov, int iovcnt)
+{
+	RADIX_TRACE_START(t);
+	void *data = _radix_findv(t, iov, iovcnt);
+
+#ifdef RADIX_TRACE
+	/* the trace has the key in one piece, traced lookups gather it */
+	if (t->trace_id)
+	{
+		uint8_t buf[256];
+		size_t len = _radix_iov_len(iov, iovcnt);
+		uint8_t *s = _radix_iov_gather(iov, iovcnt, len, buf, sizeof(buf));
+		if (s)
+			RADIX_TRACE_KEY(t, RADIX_TRACE_FIND, s, len);
+		if (s != buf)
+			free(s);
+	}
+#endif
+
+	return data;
+}
+
+/* Inserts copy the key bytes into the vertices they create and walk the key again
+ * for scores, access times and expiry, so they work on the gathered key */
+int
+radix_insertv(radix_tree *t, const radix_iovec *iov, int iovcnt, void *data, void **old)
+{
+	uint8_t buf[256];
+	size_t len = _radix_iov_len(iov, iovcnt);
+
+	assert(!(t->flags & RADIX_INLINE_VALUES) || old == NULL);
+
+	uint8_t *s = _radix_iov_gather(iov, iovcnt, len, buf, sizeof(buf));
+	if (s == NULL)
+		return 0;
+
+	int ret = _radix_insert_scored(t, s, len, data, old, false, 0, 0);
+
+	if (s != buf)
+		free(s);
+	return ret;
+}
+
+int
+radix_delv(radix_tree *t, const radix_iovec *iov, int iovcnt, void **old)
+{
+	radix_vertex *h;
+	int split_pos = 0;
+	uint8_t buf[256];
+	size_t len = _radix_iov_len(iov, iovcnt);
+
+	assert(!(t->flags & RADIX_INLINE_VALUES) || old == NULL);
+
+	/* only keys that are there are gathered, unless the delete goes into the trace */
+	size_t i = _radix_walkv(t, iov, iovcnt, &h, &split_pos);
+	if ((i != len || (h->is_compressed && split_pos != 0) || !h->is_key) && !t->trace_id)
+		return 0;
+
+	uint8_t *s = _radix_iov_gather(iov, iovcnt, len, buf, sizeof(buf));
+	if (s == NULL)
+		return 0;
+
+	int ret = radix_del(t, s, len, old);
+
+	if (s != buf)
+		free(s);
+	return ret;
+}
+
+/* Shared state of radix_build_parallel(): keys are grouped by their byte at
+ * position prefix_len, workers claim groups through next and build one subtree each */
+typedef struct radix_build {
+	uint8_t **keys;
+	size_t *lens;
+	void **values;
+	size_t prefix_len;
+	size_t *order; /* key indices grouped by partition, input order kept within a partition */
+	size_t start[257]; /* partition c is order[start[c]..start[c + 1]) */
+	uint8_t parts[256]; /* non-empty partitions, largest first */
+	int num_parts;
+	radix_tree *subtrees[256];
+	atomic_int next;
+	atomic_bool oom;
+} radix_build;
+
+static void *
+_radix_build_worker(void *arg)
+{
+	radix_build *b = arg;
+
+	while (!atomic_load(&b->oom))
+	{
+		int p = atomic_fetch_add(&b->next, 1);
+		if (p >= b->num_parts)
+			break;
+
+		uint8_t c = b->parts[p];
+		radix_tree *sub = _radix_new(0);
+		b->subtrees[c] = sub;
+		if (sub == NULL)
+		{
+			atomic_store(&b->oom, true);
+			break;
+		}
+
+		/* the partition byte becomes the edge of the stitching vertex */
+		size_t skip = b->prefix_len + 1;
+		for (size_t n = b->start[c]; n < b->start[c + 1]; ++n)
+		{
+			size_t k = b->order[n];
+			uint8_t *s = b->keys[k] + skip;
+			size_t len = b->lens[k] - skip;
+
+			/* 0 is returned both on OOM and when a duplicate key is overwritten */
+			if (!_radix_insert_scored(sub, s, len, b->values[k], NULL, false, 0, 0) && _radix_find(sub, s, len) != b->values[k])
+			{
+				atomic_store(&b->oom, true);
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Free a tree whose vertices have been moved to another tree */
+static void
+_radix_free_shell(radix_tree *t)
+{
+	assert(t->num_blocks == 0);
+	if (t->expiry)
+		radix_free(t->expiry);
+	_radix_filter_free(t->filter);
+	_radix_jump_free(t->jump);
+	_radix_sampling_free(t);
+	free(t->blocks);
+	free(t->pending);
+	free(t);
+}
+
+radix_tree *
+radix_build_parallel(uint8_t **keys, size_t *lens, void **values, size_t n, int nthreads)
+{
+	radix_build b;
+	radix_tree *t = NULL;
+	radix_vertex *branch = NULL, *head = NULL;
+
+	if (n == 0)
+		return radix_new();
+
+	/* partition on the first byte where the keys differ, not the first byte:
+	 * keys sharing a long prefix would otherwise all land in one partition */
+	size_t prefix_len = lens[0];
+	for (size_t k = 1; k < n && prefix_len; ++k)
+	{
+		size_t max = lens[k] < prefix_len ? lens[k] : prefix_len;
+		prefix_len = _radix_mismatch(keys[0], keys[k], max);
+	}
+	if (prefix_len > RADIX_VERTEX_MAX_SIZE)
+		prefix_len = RADIX_VERTEX_MAX_SIZE;
+
+	debugf("### Parallel build of %zu keys, %zu prefix bytes, %d threads\n", n, prefix_len, nthreads);
+
+	b.keys = keys;
+	b.lens = lens;
+	b.values = values;
+	b.prefix_len = prefix_len;
+	b.num_parts = 0;
+	memset(b.subtrees, 0, sizeof(b.subtrees));
+	atomic_init(&b.next, 0);
+	atomic_init(&b.oom, false);
+
+	b.order = malloc(n * sizeof(*b.order));
+	if (b.order == NULL)
+		return NULL;
+
+	/* counting sort of the key indices on the partition byte; keys that end at
+	 * prefix_len are keys of the stitching vertex itself, the last one wins */
+	size_t count[256] = { 0 };
+	bool branch_is_key = false;
+	void *branch_data = NULL;
+	for (size_t k = 0; k < n; ++k)
+	{
+		if (lens[k] == prefix_len)
+		{
+			branch_is_key = true;
+			branch_data = values[k];
+		}
+		else
+		{
+			++count[keys[k][prefix_len]];
+		}
+	}
+
+	b.start[0] = 0;
+	for (int c = 0; c < 256; ++c)
+	{
+		b.start[c + 1] = b.start[c] + count[c];
+		if (count[c])
+			b.parts[b.num_parts++] = c;
+	}
+
+	size_t fill[256];
+	memcpy(fill, b.start, sizeof(fill));
+	for (size_t k = 0; k < n; ++k)
+	{
+		if (lens[k] != prefix_len)
+			b.order[fill[keys[k][prefix_len]]++] = k;
+	}
+
+	/* hand out the largest partitions first so the last ones to finish are short */
+	for (int p = 1; p < b.num_parts; ++p)
+	{
+		uint8_t c = b.parts[p];
+		int q = p;
+		for (; q > 0 && count[b.parts[q - 1]] < count[c]; --q)
+			b.parts[q] = b.parts[q - 1];
+		b.parts[q] = c;
+	}
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > b.num_parts)
+		nthreads = b.num_parts ? b.num_parts : 1;
+
+	pthread_t threads[256];
+	int started = 0;
+	for (; started < nthreads - 1; ++started)
+	{
+		if (pthread_create(&threads[started], NULL, _radix_build_worker, &b) != 0)
+			break;
+	}
+
+	_radix_build_worker(&b);
+
+	for (int w = 0; w < started; ++w)
+		pthread_join(threads[w], NULL);
+
+	if (atomic_load(&b.oom))
+		goto cleanup;
+
+	t = _radix_new(0);
+	if (t == NULL)
+		goto cleanup;
+
+	/* stitch: [prefix] -> branch vertex with one edge per partition */
+	branch = _new_vertex(t, b.num_parts, branch_is_key && branch_data != NULL);
+	if (branch == NULL)
+		goto cleanup;
+
+	if (prefix_len)
+	{
+		head = _vertex_alloc(t, radix_vertex_size(t, prefix_len, 1, false));
+		if (head == NULL)
+			goto cleanup;
+
+		head->is_key = false;
+		head->is_null = false;
+		head->is_compressed = prefix_len > 1;
+		head->size = prefix_len;
+		memcpy(head->data, keys[0], prefix_len);
+		_radix_set_child(t, radix_vertex_last_child_ptr(t, head), branch);
+	}
+
+	if (branch_is_key)
+		radix_set_data(t, branch, branch_data);
+
+	uint64_t vertices = prefix_len ? 2 : 1;
+	uint64_t elements = branch_is_key;
+	int edge = 0;
+	for (int c = 0; c < 256; ++c)
+	{
+		radix_tree *sub = b.subtrees[c];
+		if (sub == NULL)
+			continue;
+
+		branch->data[edge] = c;
+		_radix_set_child(t, radix_vertex_child_ptr(t, branch, edge), sub->head);
+		vertices += sub->num_vertices;
+		elements += sub->num_elements;
+		t->memory += sub->memory;
+		++edge;
+
+		/* the vertices now belong to t, only the tree itself goes */
+		_radix_free_shell(sub);
+		b.subtrees[c] = NULL;
+	}
+
+	_vertex_free(t, t->head);
+	t->head = prefix_len ? head : branch;
+	t->num_vertices = vertices;
+	t->num_elements = elements;
+
+#ifdef RADIX_TRACE
+	/* replays build the tree up key by key */
+	_radix_trace_new(t);
+	for (size_t k = 0; k < n; ++k)
+		_radix_trace_key(t, RADIX_TRACE_INSERT, keys[k], lens[k], _radix_trace_clock());
+#endif
+
+	free(b.order);
+	return t;
+
+cleanup:
+	for (int c = 0; c < 256; ++c)
+	{
+		if (b.subtrees[c])
+			radix_free(b.subtrees[c]);
+	}
+
+	if (t)
+	{
+		_vertex_free(t, branch);
+		_vertex_free(t, head);
+		radix_free(t);
+	}
+
+	free(b.order);
+	return NULL;
+}
+
+/* Bump allocator over the blocks created by one relayout pass */
+typedef struct radix_layout {
+	uint8_t *base; /* block being filled, NULL until the first vertex is placed */
+	size_t size;
+	size_t used;
+} radix_layout;
+
+static bool
+_radix_layout_new_block(radix_tree *t, radix_layout *l, size_t size)
+{
+	if (t->num_blocks == t->blocks_capacity)
+	{
+		size_t capacity = t->blocks_capacity ? t->blocks_capacity * 2 : 16;
+		radix_block *blocks = realloc(t->blocks, capacity * sizeof(*blocks));
+		if (blocks == NULL)
+			return false;
+
+		t->blocks = blocks;
+		t->blocks_capacity = capacity;
+	}
+
+	if (size < RADIX_BLOCK_SIZE)
+		size = RADIX_BLOCK_SIZE;
+
+	uint8_t *base = malloc(size);
+	if (base == NULL)
+		return false;
+
+	t->memory += size;
+
+	/* keep the blocks sorted by address for _radix_block_of() */
+	size_t pos = t->num_blocks;
+	while (pos && t->blocks[pos - 1].base > base)
+		--pos;
+
+	memmove(t->blocks + pos + 1, t->blocks + pos, (t->num_blocks - pos) * sizeof(*t->blocks));
+	t->blocks[pos].base = base;
+	t->blocks[pos].size = size;
+	t->blocks[pos].live = 0;
+	++t->num_blocks;
+
+	l->base = base;
+	l->size = size;
+	l->used = 0;
+	return true;
+}
+
+/* Place size bytes right after the previous vertex placed through l */
+static radix_vertex *
+_radix_layout_alloc(radix_tree *t, radix_layout *l, size_t size)
+{
+	/* arena chunks are bump allocated back to back already */
+	if (t->arena)
+	{
+		radix_vertex *v = _arena_bump(t->arena, _arena_units_for(size));
+		if (v)
+			t->memory += _arena_usage(v);
+		return v;
+	}
+
+	size_t aligned = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (l->base == NULL || l->used + aligned > l->size)
+	{
+		if (!_radix_layout_new_block(t, l, aligned))
+			return NULL;
+	}
+
+	/* t->blocks moves as blocks come and go, so look the block up again */
+	radix_vertex *v = (radix_vertex *)(l->base + l->used);
+	l->used += aligned;
+	++_radix_block_of(t, v)->live;
+	return v;
+}
+
+/* Copy the subtree at *link depth-first into the layout blocks, so that a vertex is
+ * followed in memory by its first child. Children are rewritten before the old copy
+ * of their parent is released. Returns false on OOM, the tree is intact either way */
+static bool
+_radix_relayout(radix_tree *t, radix_layout *l, uint8_t *link)
+{
+	radix_vertex *v = _radix_link_get(t, link);
+
+	size_t size = radix_vertex_current_size(t, v);
+	radix_vertex *newv = _radix_layout_alloc(t, l, size);
+	if (newv == NULL)
+		return false;
+
+	memcpy(newv, v, size);
+	_vertex_free(t, v);
+	_radix_set_child(t, link, newv);
+
+	int num_children = radix_vertex_num_children(newv);
+
+	for (int i = 0; i < num_children; ++i)
+	{
+		if (!_radix_relayout(t, l, radix_vertex_child_ptr(t, newv, i)))
+			return false;
+	}
+
+	return true;
+}
+
+/* Copy the subtree at v depth-first into the arena to, leaving the tree untouched.
+ * Returns the copy of v, or NULL on OOM */
+static radix_vertex *
+_radix_relayout_arena(radix_tree *t, radix_arena *to, radix_vertex *v)
+{
+	size_t size = radix_vertex_current_size(t, v);
+
+	radix_vertex *newv = _arena_bump(to, _arena_units_for(size));
+	if (newv == NULL)
+		return NULL;
+
+	memcpy(newv, v, size);
+	t->memory += _arena_usage(newv);
+
+	int num_children = radix_vertex_num_children(v);
+	for (int i = 0; i < num_children; ++i)
+	{
+		radix_vertex *child = _radix_relayout_arena(t, to, _radix_child(t, radix_vertex_child_ptr(t, v, i)));
+		if (child == NULL)
+			return NULL;
+
+		uint32_t ref = _arena_ref(to, child);
+		memcpy(radix_vertex_child_ptr(t, newv, i), &ref, sizeof(ref));
+	}
+
+	return newv;
+}
+
+static int
+_radix_relayout_link(radix_tree *t, uint8_t *link)
+{
+	radix_layout l = { NULL, 0, 0 };
+
+	++t->version;
+	return _radix_relayout(t, &l, link);
+}
+
+int
+radix_relayout(radix_tree *t)
+{
+	debugf("### Relayout\n");
+
+	/* shared vertices would be copied once per parent */
+	if (t->flags & RADIX_FROZEN)
+		return 0;
+
+	if (t->arena)
+	{
+		/* a fresh arena also returns the holes of the old one to the OS */
+		radix_arena *to = _arena_new();
+		if (to == NULL)
+			return 0;
+
+		size_t memory = t->memory;
+		t->memory = 0;
+		radix_vertex *head = _radix_relayout_arena(t, to, t->head);
+		if (head == NULL)
+		{
+			t->memory = memory;
+			_arena_destroy(to);
+			return 0;
+		}
+
+		++t->version;
+		_arena_destroy(t->arena);
+		t->arena = to;
+		t->head = head;
+		_radix_jump_reset(t);
+		_radix_jump_sync(t);
+		return 1;
+	}
+
+	int ret = _radix_relayout_link(t, (uint8_t *)&t->head);
+	_radix_jump_reset(t);
+	_radix_jump_sync(t);
+
+#if defined(__GLIBC__)
+	/* hand the pages of the scattered vertices back to the OS. It walks every arena:
+	 * the whole tree is worth it, a prefix is not */
+	malloc_trim(0);
+#endif
+
+	return ret;
+}
+
+int
+radix_relayout_prefix(radix_tree *t, uint8_t *s, size_t len)
+{
+	radix_vertex *h;
+	uint8_t *parent_link;
+
+	debugf("### Relayout prefix: '%.*s'\n", (int)len, s);
+
+	if (t->flags & RADIX_FROZEN)
+		return 0;
+
+	/* a missing prefix has no subtree to relayout, not the one the walk stopped in */
+	size_t i = _radix_walk(t, s, len, &h, &parent_link, NULL, NULL);
+	if (i != len)
+		return 1;
+
+	int ret = _radix_relayout_link(t, parent_link);
+	_radix_jump_reset(t);
+	_radix_jump_sync(t);
+	return ret;
+}
+
+/* radix_freeze_minimized() state: the vertices placed in to so far, hashed by content */
+typedef struct radix_freeze {
+	radix_tree *to;
+	radix_layout l;
+	radix_vertex **table;
+	uint64_t *hashes;
+	size_t mask;
+	radix_stack children; /* placed children of the vertices being frozen */
+	uint8_t *scratch;
+	size_t scratch_size;
+} radix_freeze;
+
+/* Place the minimized copy of the subtree at v in fz->to, bottom-up: once its children
+ * are placed, a vertex is fully described by its bytes, so equal bytes are an equal
+ * subtree and the copy already placed is reused. Returns NULL on OOM */
+static radix_vertex *
+_radix_freeze(radix_tree *t, radix_freeze *fz, radix_vertex *v)
+{
+	int num_children = radix_vertex_num_children(v);
+
+	for (int i = 0; i < num_children; ++i)
+	{
+		radix_vertex *c = _radix_freeze(t, fz, _radix_child(t, radix_vertex_child_ptr(t, v, i)));
+		if (c == NULL || !_stack_push(&fz->children, c))
+			return NULL;
+	}
+
+	size_t size = radix_vertex_current_size(t, v);
+	if (size > fz->scratch_size)
+	{
+		uint8_t *scratch = realloc(fz->scratch, size);
+		if (scratch == NULL)
+			return NULL;
+		fz->scratch = scratch;
+		fz->scratch_size = size;
+	}
+
+	/* the bytes as placed in to: zeroed padding, references to the placed children */
+	radix_vertex *w = (radix_vertex *)fz->scratch;
+	memcpy(w, v, sizeof(radix_vertex) + v->size);
+	memset(w->data + w->size, 0, radix_vertex_padding(t, w->size));
+
+	void **children = fz->children.stack + fz->children.size - num_children;
+	for (int i = 0; i < num_children; ++i)
+		_radix_set_child(fz->to, radix_vertex_child_ptr(t, w, i), children[i]);
+	fz->children.size -= num_children;
+
+	size_t tail_size = radix_vertex_tail_size(t, v);
+	memcpy(fz->scratch + size - tail_size, (uint8_t *)v + size - tail_size, tail_size);
+
+	uint64_t h = _radix_hash(fz->scratch, size);
+	size_t pos = h & fz->mask;
+	for (; fz->table[pos]; pos = (pos + 1) & fz->mask)
+	{
+		radix_vertex *u = fz->table[pos];
+		if (fz->hashes[pos] == h && radix_vertex_current_size(t, u) == size && !memcmp(u, w, size))
+			return u;
+	}
+
+	radix_vertex *newv = _radix_layout_alloc(fz->to, &fz->l, size);
+	if (newv == NULL)
+		return NULL;
+
+	memcpy(newv, w, size);
+	fz->table[pos] = newv;
+	fz->hashes[pos] = h;
+	++fz->to->num_vertices;
+	return newv;
+}
+
+int
+radix_freeze_minimized(radix_tree *t)
+{
+	radix_freeze fz;
+
+	debugf("### Freeze\n");
+
+	if (t->flags & RADIX_FROZEN)
+		return 1;
+
+	/* merge the chains a lazy tree still has, they would not be shared otherwise */
+	radix_compact(t, 0);
+
+	/* an empty tree of the same layout receives the placed vertices */
+	fz.to = _radix_new(t->flags & ~(RADIX_JUMP_TABLE | RADIX_JUMP_TABLE2));
+	if (fz.to == NULL)
+		return 0;
+
+	fz.to->flags = t->flags;
+	fz.to->value_size = t->value_size;
+	_vertex_free(fz.to, fz.to->head);
+	fz.to->head = NULL;
+	fz.to->num_vertices = 0;
+
+	size_t capacity = 16;
+	while (capacity < 2 * t->num_vertices)
+		capacity *= 2;
+
+	fz.l = (radix_layout){ NULL, 0, 0 };
+	fz.table = calloc(capacity, sizeof(*fz.table));
+	fz.hashes = malloc(capacity * sizeof(*fz.hashes));
+	fz.mask = capacity - 1;
+	fz.scratch = NULL;
+	fz.scratch_size = 0;
+	_stack_init(&fz.children);
+
+	radix_vertex *head = NULL;
+	if (fz.table && fz.hashes)
+		head = _radix_freeze(t, &fz, t->head);
+
+	free(fz.table);
+	free(fz.hashes);
+	free(fz.scratch);
+	_stack_free(&fz.children);
+
+	if (head == NULL)
+	{
+		_radix_free_frozen(fz.to, NULL);
+		_radix_free_shell(fz.to);
+		return 0;
+	}
+
+	debugf("Minimized %lu vertices to %lu\n", (unsigned long)t->num_vertices, (unsigned long)fz.to->num_vertices);
+
+	/* the old tree goes, the storage of to moves in */
+	_radix_free(t, t->head, NULL);
+	assert(t->num_blocks == 0);
+	if (t->arena)
+		_arena_destroy(t->arena);
+	free(t->blocks);
+
+	t->head = head;
+	t->num_vertices = fz.to->num_vertices;
+	t->memory = fz.to->memory;
+	t->blocks = fz.to->blocks;
+	t->num_blocks = fz.to->num_blocks;
+	t->blocks_capacity = fz.to->blocks_capacity;
+	t->arena = fz.to->arena;
+	t->flags |= RADIX_FROZEN;
+	++t->version;
+	_radix_jump_reset(t);
+	_radix_jump_sync(t);
+
+	fz.to->blocks = NULL;
+	fz.to->num_blocks = 0;
+	_radix_free_shell(fz.to);
+	return 1;
+}
+
+void
+radix_finger_init(radix_finger *f)
+{
+	f->tree = NULL;
+	f->version = 0;
+	f->path = NULL;
+	f->depth = NULL;
+	f->size = 0;
+	f->capacity = 0;
+	f->key = NULL;
+	f->key_len = 0;
+	f->key_capacity = 0;
+}
+
+void
+radix_finger_free(radix_finger *f)
+{
+	free(f->path);
+	free(f->depth);
+	free(f->key);
+	radix_finger_init(f);
+}
+
+static inline bool
+_finger_push(radix_finger *f, radix_vertex *v, size_t depth)
+{
+	if (f->size == f->capacity)
+	{
+		size_t capacity = f->capacity ? f->capacity * 2 : 32;
+		radix_vertex **path = realloc(f->path, sizeof(*path) * capacity);
+		if (path == NULL)
+			return false;
+		f->path = path;
+
+		size_t *depths = realloc(f->depth, sizeof(*depths) * capacity);
+		if (depths == NULL)
+			return false;
+		f->depth = depths;
+
+		f->capacity = capacity;
+	}
+
+	f->path[f->size] = v;
+	f->depth[f->size] = depth;
+	++f->size;
+	return true;
+}
+
+static bool
+_finger_save_key(radix_finger *f, uint8_t *s, size_t len)
+{
+	if (len > f->key_capacity)
+	{
+		uint8_t *key = realloc(f->key, len);
+		if (key == NULL)
+			return false;
+		f->key = key;
+		f->key_capacity = len;
+	}
+
+	if (len)
+		memcpy(f->key, s, len);
+	f->key_len = len;
+	return true;
+}
+
+/* Like _radix_walk(), resuming from the deepest vertex of f->path shared with the
+ * previous key, for the modifications of radix_insert_batch() and radix_del_batch().
+ * The stop vertex is left out of f->path: the modification may move it, but not its
+ * ancestors, which stay valid for the next key. They are also pushed on stack */
+static size_t
+_radix_walk_batch(radix_tree *t, radix_finger *f, uint8_t *s, size_t len, radix_vertex **_stop_vertex, uint8_t **_parent_link, int *_split_pos, radix_stack *stack)
+{
+	radix_vertex *h = t->head;
+	uint8_t *parent_link = (uint8_t *)&t->head;
+	size_t i = 0;
+	size_t j = 0;
+
+	if (f->size)
+	{
+		size_t common = _radix_mismatch(f->key, s, f->key_len < len ? f->key_len : len);
+
+		while (f->size > 1 && f->depth[f->size - 1] > common)
+			--f->size;
+
+		--f->size;
+		h = f->path[f->size];
+		i = f->depth[f->size];
+		if (f->size)
+			parent_link = _radix_find_parent_link(t, f->path[f->size - 1], h);
+	}
+
+	bool record = true;
+	while (1)
+	{
+		if (record && !_finger_push(f, h, i))
+			record = false;
+
+		if (!h->size || i >= len)
+			break;
+
+		j = 0;
+		uint8_t *link = _radix_walk_step(t, h, s, len, &i, &j);
+		if (link == NULL)
+			break;
+
+		h = _radix_child(t, link);
+		parent_link = link;
+		j = 0;
+	}
+
+	/* without the path, the walk is done again the usual way */
+	if (!record || !_finger_save_key(f, s, len))
+	{
+		f->size = 0;
+		return _radix_walk(t, s, len, _stop_vertex, _parent_link, _split_pos, stack);
+	}
+
+	--f->size;
+	if (stack)
+	{
+		for (size_t k = 0; k < f->size; ++k)
+			_stack_push(stack, f->path[k]);
+	}
+
+	*_stop_vertex = h;
+	if (_parent_link)
+		*_parent_link = parent_link;
+	if (_split_pos && h->is_compressed)
+		*_split_pos = j;
+
+	return i;
+}
+
+int
+radix_insert_batch(radix_tree *t, uint8_t **keys, size_t *lens, void **values, size_t n)
+{
+	radix_finger f;
+	int inserted = 0;
+
+	radix_finger_init(&f);
+	t->batch = &f;
+
+	for (size_t k = 0; k < n; ++k)
+	{
+		uint64_t version = t->version;
+		inserted += _radix_insert_scored(t, keys[k], lens[k], values ? values[k] : NULL, NULL, false, 0, 0);
+
+		/* evictions and expired keys deleted on the way may have changed the path */
+		if (t->version != version + 1)
+			f.size = 0;
+	}
+
+	t->batch = NULL;
+	radix_finger_free(&f);
+	return inserted;
+}
+
+int
+radix_del_batch(radix_tree *t, uint8_t **keys, size_t *lens, size_t n)
+{
+	radix_finger f;
+	int deleted = 0;
+
+	radix_finger_init(&f);
+	t->batch = &f;
+
+	for (size_t k = 0; k < n; ++k)
+	{
+		RADIX_TRACE_START(t);
+		deleted += _radix_del(t, keys[k], lens[k], NULL);
+		RADIX_TRACE_KEY(t, RADIX_TRACE_DEL, keys[k], lens[k]);
+	}
+
+	t->batch = NULL;
+	radix_finger_free(&f);
+	return deleted;
+}
+
+/* Like radix_find(), but resumes the walk from the deepest vertex of the previous
+ * lookup through f whose path is shared with s, instead of starting at t->head */
+void *
+radix_find_with_finger(radix_tree *t, radix_finger *f, uint8_t *s, size_t len)
+{
+	radix_vertex *h = t->head;
+	size_t i = 0;
+	size_t j = 0;
+
+	debugf("### Finger lookup: '%.*s'\n", (int)len, s);
+
+	if (f->tree == t && f->version == t->version && f->size)
+	{
+		size_t common = _radix_mismatch(f->key, s, f->key_len < len ? f->key_len : len);
+
+		/* the walk from a vertex entered at depth d only looks at s[d..len) */
+		while (f->size > 1 && f->depth[f->size - 1] > common)
+			--f->size;
+
+		--f->size;
+		h = f->path[f->size];
+		i = f->depth[f->size];
+
+		debugf("Resuming at depth %zu of %zu common bytes\n", i, common);
+	}
+	else
+	{
+		f->tree = t;
+		f->version = t->version;
+		f->size = 0;
+	}
+
+	bool record = true;
+	while (1)
+	{
+		if (record && !_finger_push(f, h, i))
+			record = false;
+
+		if (!h->size || i >= len)
+			break;
+
+		j = 0;
+		uint8_t *link = _radix_walk_step(t, h, s, len, &i, &j);
+		if (link == NULL)
+			break;
+
+		h = _radix_child(t, link);
+		j = 0;
+	}
+
+	if (!record || !_finger_save_key(f, s, len))
+		f->tree = NULL;
+
+	if (i != len || (h->is_compressed && j != 0) || !h->is_key || _radix_expired(t, h))
+		return NULL;
+
+	_radix_touch(t, h);
+	return radix_get_data(t, h);
+}
+
+void
+radix_iter_init(radix_iter *it, radix_tree *t)
+{
+	it->tree = t;
+	it->frames = NULL;
+	it->size = 0;
+	it->capacity = 0;
+	it->key = NULL;
+	it->key_len = 0;
+	it->key_capacity = 0;
+	it->data = NULL;
+	it->oom = false;
+
+	radix_iter_seek(it, NULL, 0);
+}
+
+void
+radix_iter_free(radix_iter *it)
+{
+	free(it->frames);
+	free(it->key);
+	it->frames = NULL;
+	it->key = NULL;
+	it->size = it->capacity = it->key_capacity = 0;
+}
+
+static bool
+_iter_push(radix_iter *it, radix_vertex *v, size_t depth)
+{
+	if (it->size == it->capacity)
+	{
+		size_t capacity = it->capacity ? it->capacity * 2 : 32;
+		radix_iter_frame *frames = realloc(it->frames, capacity * sizeof(*frames));
+		if (frames == NULL)
+		{
+			it->oom = true;
+			return false;
+		}
+		it->frames = frames;
+		it->capacity = capacity;
+	}
+
+	it->frames[it->size].v = v;
+	it->frames[it->size].next = -1;
+	it->frames[it->size].depth = depth;
+	++it->size;
+	return true;
+}
+
+/* make room for a key of size bytes in it->key, which is allocated even for size 0 */
+static bool
+_iter_reserve(radix_iter *it, size_t size)
+{
+	if (it->key && size <= it->key_capacity)
+		return true;
+
+	size_t capacity = it->key_capacity ? it->key_capacity * 2 : 64;
+	while (capacity < size)
+		capacity *= 2;
+
+	uint8_t *key = realloc(it->key, capacity);
+	if (key == NULL)
+	{
+		it->oom = true;
+		return false;
+	}
+	it->key = key;
+	it->key_capacity = capacity;
+	return true;
+}
+
+/* write the n bytes of an edge at depth in it->key and enter the vertex it leads to */
+static bool
+_iter_enter(radix_iter *it, radix_vertex *child, const uint8_t *edge, size_t n, size_t depth)
+{
+	if (!_iter_reserve(it, depth + n))
+		return false;
+
+	memcpy(it->key + depth, edge, n);
+	return _iter_push(it, child, depth + n);
+}
+
+int
+radix_iter_seek(radix_iter *it, uint8_t *s, size_t len)
+{
+	radix_tree *t = it->tree;
+
+	/* the empty key is returned in a buffer like the others */
+	it->size = 0;
+	if (!_iter_reserve(it, 0) || !_iter_push(it, t->head, 0))
+		return 0;
+
+	/* go down the path of s. Each frame skips the children whose keys are all below s,
+	 * and the key of the vertex itself when it is a proper prefix of s */
+	for (;;)
+	{
+		radix_iter_frame *f = &it->frames[it->size - 1];
+		radix_vertex *v = f->v;
+		size_t d = f->depth;
+
+		if (d == len)
+			return 1;
+
+		f->next = 0;
+		if (v->size == 0)
+			return 1;
+
+		if (v->is_compressed)
+		{
+			size_t m = len - d < v->size ? len - d : v->size;
+			int cmp = memcmp(v->data, s + d, m);
+
+			if (cmp < 0)
+				f->next = 1;
+			if (cmp || m < v->size)
+				return 1;
+
+			f->next = 1;
+			if (!_iter_enter(it, _radix_child(t, radix_vertex_child_ptr(t, v, 0)), v->data, v->size, d))
+				return 0;
+		}
+		else
+		{
+			int i = 0;
+			while (i < v->size && v->data[i] < s[d])
+				++i;
+
+			f->next = i;
+			if (i == v->size || v->data[i] != s[d])
+				return 1;
+
+			f->next = i + 1;
+			if (!_iter_enter(it, _radix_child(t, radix_vertex_child_ptr(t, v, i)), v->data + i, 1, d))
+				return 0;
+		}
+	}
+}
+
+int
+radix_iter_next(radix_iter *it)
+{
+	radix_tree *t = it->tree;
+
+	while (it->size && !it->oom)
+	{
+		radix_iter_frame *f = &it->frames[it->size - 1];
+		radix_vertex *v = f->v;
+
+		/* a key comes before the keys below it */
+		if (f->next < 0)
+		{
+			f->next = 0;
+			if (v->is_key && !_radix_expired(t, v))
+			{
+				it->key_len = f->depth;
+				it->data = radix_get_data(t, v);
+				return 1;
+			}
+		}
+
+		if (f->next < radix_vertex_num_children(v))
+		{
+			int i = f->next++;
+			radix_vertex *child = _radix_child(t, radix_vertex_child_ptr(t, v, i));
+
+			if (v->is_compressed)
+				_iter_enter(it, child, v->data, v->size, f->depth);
+			else
+				_iter_enter(it, child, v->data + i, 1, f->depth);
+			continue;
+		}
+
+		--it->size;
+	}
+
+	return 0;
+}
+
+/* key built up while walking the tree */
+typedef struct radix_key {
+	uint8_t *key;
+	size_t len;
+	size_t capacity;
+	bool oom;
+} radix_key;
+
+static bool
+_key_reserve(radix_key *k, size_t n)
+{
+	if (k->len + n > k->capacity)
+	{
+		size_t capacity = k->capacity ? k->capacity * 2 : 64;
+		while (capacity < k->len + n)
+			capacity *= 2;
+
+		uint8_t *key = realloc(k->key, capacity);
+		if (key == NULL)
+		{
+			k->oom = true;
+			return false;
+		}
+		k->key = key;
+		k->capacity = capacity;
+	}
+
+	return true;
+}
+
+static bool
+_key_push(radix_key *k, const uint8_t *s, size_t n)
+{
+	if (!_key_reserve(k, n))
+		return false;
+
+	if (n)
+		memcpy(k->key + k->len, s, n);
+	k->len += n;
+	return true;
+}
+
+/* keys sampled per round of an eviction, the oldest one goes. The random walks favour
+ * keys in small subtrees, so a round whose oldest key is among the most recently used
+ * half is retried, up to RADIX_EVICT_ROUNDS times */
+#define RADIX_EVICT_SAMPLES 5
+#define RADIX_EVICT_ROUNDS 4
+
+/* Walk down from the head taking random edges and stop at a key, its bytes are left in k.
+ * Returns NULL on OOM */
+static radix_vertex *
+_radix_sample_key(radix_tree *t, radix_key *k)
+{
+	radix_vertex *v = t->head;
+
+	k->len = 0;
+	for (;;)
+	{
+		int num_children = radix_vertex_num_children(v);
+
+		/* every key on the way stops the walk as often as one of the children is taken */
+		if (v->is_key && (num_children == 0 || _radix_random(t) % (num_children + 1) == 0))
+			return v;
+
+		/* only an empty head has no children and no key */
+		assert(num_children);
+
+		int i = v->is_compressed ? 0 : (int)(_radix_random(t) % num_children);
+		if (!_key_push(k, v->is_compressed ? v->data : v->data + i, v->is_compressed ? v->size : 1))
+			return NULL;
+
+		v = _radix_child(t, radix_vertex_child_ptr(t, v, i));
+	}
+}
+
+static void
+_radix_evict(radix_tree *t)
+{
+	radix_key sample = { NULL, 0, 0, false };
+	radix_key oldest = { NULL, 0, 0, false };
+	uint8_t *value = NULL;
+
+	/* a frozen tree deletes nothing, its memory cannot go down */
+	if (t->flags & RADIX_FROZEN)
+		return;
+
+	if ((t->flags & RADIX_INLINE_VALUES) && t->memory_budget && t->memory > t->memory_budget)
+	{
+		value = malloc(radix_value_size(t));
+		if (value == NULL)
+			return;
+	}
+
+	while (t->memory_budget && t->memory > t->memory_budget && t->num_elements)
+	{
+		radix_vertex *victim = NULL;
+		uint64_t victim_access = 0;
+
+		for (int i = 0; i < RADIX_EVICT_SAMPLES * RADIX_EVICT_ROUNDS; ++i)
+		{
+			if (i && i % RADIX_EVICT_SAMPLES == 0 && t->clock - victim_access > t->num_elements / 2)
+				break;
+
+			radix_vertex *v = _radix_sample_key(t, &sample);
+			if (v == NULL)
+				goto out;
+
+			if (victim && _radix_last_access(t, v) >= victim_access)
+				continue;
+
+			oldest.len = 0;
+			if (!_key_push(&oldest, sample.key, sample.len))
+				goto out;
+
+			victim = v;
+			victim_access = _radix_last_access(t, v);
+		}
+
+		debugf("Evicting '%.*s'\n", (int)oldest.len, oldest.key);
+
+		/* the value goes with the vertex: keep a copy of an inline one for evict */
+		void *data = radix_get_data(t, victim);
+		if (value && data)
+		{
+			memcpy(value, data, radix_value_size(t));
+			data = value;
+		}
+
+		/* an expired victim is handed to evict by _radix_del() itself */
+		uint64_t num_elements = t->num_elements;
+		if (_radix_del(t, oldest.key, oldest.len, NULL))
+		{
+			if (t->evict)
+				t->evict(t->evict_ctx, oldest.key, oldest.len, data);
+		}
+		else if (t->num_elements == num_elements)
+		{
+			break;
+		}
+
+		/* the memory of a deferred path only comes back once it is merged: merge the
+		 * path of the victim, and leave the rest of the queue to radix_compact() */
+		if (t->flags & RADIX_LAZY_COMPRESS)
+		{
+			++t->version;
+			if (t->batch)
+				t->batch->size = 0;
+			_radix_compact_path(t, oldest.key, oldest.len);
+		}
+	}
+
+out:
+	free(sample.key);
+	free(oldest.key);
+	free(value);
+}
+
+void
+radix_set_memory_budget(radix_tree *t, size_t budget, void (*evict)(void *ctx, uint8_t *s, size_t len, void *data), void *ctx)
+{
+	assert((t->flags & RADIX_CACHE) || budget == 0);
+
+	RADIX_TRACE_START(t);
+	t->memory_budget = budget;
+	t->evict = evict;
+	t->evict_ctx = ctx;
+	_radix_evict(t);
+	RADIX_TRACE_ARGS(t, RADIX_TRACE_BUDGET, budget, evict != NULL);
+}
+
+/* Leave the smallest key of t in k. Returns 0 if t is empty or on OOM */
+static int
+_radix_first_key(radix_tree *t, radix_key *k)
+{
+	radix_vertex *v = t->head;
+
+	k->len = 0;
+	while (!v->is_key)
+	{
+		if (v->size == 0)
+			return 0;
+
+		if (!_key_push(k, v->data, v->is_compressed ? v->size : 1))
+			return 0;
+
+		v = _radix_child(t, radix_vertex_first_child_ptr(t, v));
+	}
+
+	return 1;
+}
+
+size_t
+radix_expire(radix_tree *t, uint64_t now, size_t budget)
+{
+	radix_key entry = { NULL, 0, 0, false };
+	size_t deleted = 0;
+
+	assert(t->flags & RADIX_TTL);
+
+	RADIX_TRACE_START(t);
+	if (now > t->now)
+		t->now = now;
+
+	/* frozen trees only move their time */
+	while (!(t->flags & RADIX_FROZEN) && (budget == 0 || deleted < budget) && _radix_first_key(t->expiry, &entry))
+	{
+		uint64_t expire = 0;
+		for (int i = 0; i < 8; ++i)
+			expire = expire << 8 | entry.key[i];
+
+		if (expire > t->now)
+			break;
+
+		uint8_t *s = entry.key + 8;
+		size_t len = entry.len - 8;
+		radix_vertex *h = _radix_key_vertex(t, s, len);
+
+		/* entries left behind by an OOM are only dropped */
+		if (h == NULL || _radix_expire_time(t, h) != expire)
+		{
+			_radix_del(t->expiry, entry.key, entry.len, NULL);
+			continue;
+		}
+
+		debugf("Expiring '%.*s'\n", (int)len, s);
+
+		_radix_del(t, s, len, NULL);
+		++deleted;
+	}
+
+	free(entry.key);
+	RADIX_TRACE_ARGS(t, RADIX_TRACE_EXPIRE, now, budget);
+	return deleted;
+}
+
+/* A node of the uncompressed trie: the start of vertex v, or the position of byte off
+ * inside the data of compressed vertex v */
+typedef struct radix_pos {
+	radix_vertex *v;
+	size_t off;
+} radix_pos;
+
+typedef struct radix_diff_state {
+	radix_tree *a;
+	radix_tree *b;
+	void (*cb)(void *ctx, int op, uint8_t *s, size_t len, void *old_data, void *new_data);
+	void *ctx;
+	radix_key k;
+} radix_diff_state;
+
+static inline int
+_pos_num_edges(radix_pos p)
+{
+	return p.v->is_compressed ? 1 : p.v->size;
+}
+
+static inline uint8_t
+_pos_edge(radix_pos p, int i)
+{
+	return p.v->is_compressed ? p.v->data[p.off] : p.v->data[i];
+}
+
+/* Follow n bytes of the compressed run at p, or edge i of an uncompressed vertex */
+static inline radix_pos
+_pos_next(radix_tree *t, radix_pos p, int i, size_t n)
+{
+	if (p.v->is_compressed)
+	{
+		p.off += n;
+		if (p.off < p.v->size)
+			return p;
+		i = 0;
+	}
+
+	p.v = _radix_child(t, radix_vertex_child_ptr(t, p.v, i));
+	p.off = 0;
+	return p;
+}
+
+static inline bool
+_pos_is_key(radix_pos p)
+{
+	return p.off == 0 && p.v->is_key;
+}
+
+/* Report every key of the subtree at p, which only one of the trees has */
+static void
+_radix_diff_emit(radix_diff_state *d, radix_tree *t, radix_pos p, int op)
+{
+	size_t len = d->k.len;
+
+	if (_pos_is_key(p))
+	{
+		void *data = radix_get_data(t, p.v);
+		if (op == RADIX_DIFF_INSERT)
+			d->cb(d->ctx, op, d->k.key, d->k.len, NULL, data);
+		else
+			d->cb(d->ctx, op, d->k.key, d->k.len, data, NULL);
+	}
+
+	if (p.v->is_compressed)
+	{
+		if (_key_push(&d->k, p.v->data + p.off, p.v->size - p.off))
+			_radix_diff_emit(d, t, _pos_next(t, p, 0, p.v->size - p.off), op);
+	}
+	else
+	{
+		for (int i = 0; i < p.v->size && !d->k.oom; ++i)
+		{
+			if (_key_push(&d->k, &p.v->data[i], 1))
+				_radix_diff_emit(d, t, _pos_next(t, p, i, 1), op);
+			d->k.len = len;
+		}
+	}
+
+	d->k.len = len;
+}
+
+static bool
+_radix_diff_values_equal(radix_diff_state *d, void *x, void *y)
+{
+	if (!(d->a->flags & RADIX_INLINE_VALUES) || x == NULL || y == NULL)
+		return x == y;
+
+	return !memcmp(x, y, radix_value_size(d->a));
+}
+
+/* Walk pa in a and pb in b in lockstep. Runs of bytes the two trees both have in
+ * compressed vertices are skipped with _radix_mismatch(); the walk only branches
+ * where the edges of a and b differ */
+static void
+_radix_diff(radix_diff_state *d, radix_pos pa, radix_pos pb)
+{
+	size_t len = d->k.len;
+
+	while (!d->k.oom)
+	{
+		/* a vertex shared by both trees holds the same subtree */
+		if (pa.v == pb.v && pa.off == pb.off)
+			break;
+
+		bool ka = _pos_is_key(pa), kb = _pos_is_key(pb);
+		void *da = ka ? radix_get_data(d->a, pa.v) : NULL;
+		void *db = kb ? radix_get_data(d->b, pb.v) : NULL;
+
+		if (ka && !kb)
+			d->cb(d->ctx, RADIX_DIFF_DELETE, d->k.key, d->k.len, da, NULL);
+		else if (!ka && kb)
+			d->cb(d->ctx, RADIX_DIFF_INSERT, d->k.key, d->k.len, NULL, db);
+		else if (ka && kb && !_radix_diff_values_equal(d, da, db))
+			d->cb(d->ctx, RADIX_DIFF_UPDATE, d->k.key, d->k.len, da, db);
+
+		if (pa.v->is_compressed && pb.v->is_compressed)
+		{
+			size_t ra = pa.v->size - pa.off, rb = pb.v->size - pb.off;
+			size_t n = _radix_mismatch(pa.v->data + pa.off, pb.v->data + pb.off, ra < rb ? ra : rb);
+			if (n)
+			{
+				if (!_key_push(&d->k, pa.v->data + pa.off, n))
+					break;
+				pa = _pos_next(d->a, pa, 0, n);
+				pb = _pos_next(d->b, pb, 0, n);
+				continue;
+			}
+		}
+
+		int na = _pos_num_edges(pa), nb = _pos_num_edges(pb);
+
+		/* a single shared edge continues the walk without recursion */
+		if (na == 1 && nb == 1 && _pos_edge(pa, 0) == _pos_edge(pb, 0))
+		{
+			uint8_t c = _pos_edge(pa, 0);
+			if (!_key_push(&d->k, &c, 1))
+				break;
+			pa = _pos_next(d->a, pa, 0, 1);
+			pb = _pos_next(d->b, pb, 0, 1);
+			continue;
+		}
+
+		/* merge the sorted edges of both */
+		size_t base = d->k.len;
+		int i = 0, j = 0;
+		while ((i < na || j < nb) && !d->k.oom)
+		{
+			int ca = i < na ? _pos_edge(pa, i) : 256;
+			int cb = j < nb ? _pos_edge(pb, j) : 256;
+			uint8_t c = ca < cb ? ca : cb;
+
+			if (!_key_push(&d->k, &c, 1))
+				break;
+
+			if (ca == cb)
+				_radix_diff(d, _pos_next(d->a, pa, i++, 1), _pos_next(d->b, pb, j++, 1));
+			else if (ca < cb)
+				_radix_diff_emit(d, d->a, _pos_next(d->a, pa, i++, 1), RADIX_DIFF_DELETE);
+			else
+				_radix_diff_emit(d, d->b, _pos_next(d->b, pb, j++, 1), RADIX_DIFF_INSERT);
+
+			d->k.len = base;
+		}
+		break;
+	}
+
+	d->k.len = len;
+}
+
+int
+radix_diff(radix_tree *a, radix_tree *b, void (*cb)(void *ctx, int op, uint8_t *s, size_t len, void *old_data, void *new_data), void *ctx)
+{
+	radix_diff_state d = { a, b, cb, ctx, { NULL, 0, 0, false } };
+
+	assert((a->flags & RADIX_INLINE_VALUES) == (b->flags & RADIX_INLINE_VALUES));
+	assert(a->value_size == b->value_size);
+
+	debugf("### Diff\n");
+
+	_radix_diff(&d, (radix_pos){ a->head, 0 }, (radix_pos){ b->head, 0 });
+
+	free(d.k.key);
+	return !d.k.oom;
+}
+
+#define RADIX_GLOB_MAX_TOKENS 63
+/* radix_dfa_glob() refuses patterns needing more states, 1 MiB of transitions per 1024 */
+#define RADIX_GLOB_MAX_STATES 4096
+#define RADIX_GLOB_TABLE_BITS 13
+
+typedef struct radix_glob_token {
+	bool star;
+	uint64_t set[4]; /* bytes matched by a non-star token */
+} radix_glob_token;
+
+static inline void
+_glob_set_add(radix_glob_token *tok, uint8_t c)
+{
+	tok->set[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+static inline bool
+_glob_set_has(radix_glob_token *tok, uint8_t c)
+{
+	return tok->set[c >> 6] & ((uint64_t)1 << (c & 63));
+}
 
-		if (prefix_len)
+/* Split a glob into the tokens of a position automaton: a token is a byte set
+ * (literal, '?' or class) or a '*'. Returns the number of tokens, -1 if the pattern
+ * is invalid or too long */
+static int
+_glob_parse(const char *pattern, radix_glob_token *toks)
+{
+	const uint8_t *p = (const uint8_t *)pattern;
+	int n = 0;
+
+	while (*p)
+	{
+		if (n == RADIX_GLOB_MAX_TOKENS)
+			return -1;
+
+		radix_glob_token *tok = &toks[n];
+		memset(tok, 0, sizeof(*tok));
+
+		if (*p == '*')
 		{
-			vertex_size = sizeof(radix_vertex) + prefix_len + radix_padding(prefix_len) + sizeof(radix_vertex *);
-			if (!h->is_null && h->is_key)
-				vertex_size += sizeof(void *);
-			prefix = malloc(vertex_size);
+			/* "**" is "*" */
+			while (*p == '*') ++p;
+			tok->star = true;
 		}
-
-		if (postfix_len)
+		else if (*p == '?')
 		{
-			vertex_size = sizeof(radix_vertex) + postfix_len + radix_padding(postfix_len) + sizeof(radix_vertex *);
-			postfix = malloc(vertex_size);
+			memset(tok->set, 0xff, sizeof(tok->set));
+			++p;
 		}
+		else if (*p == '[')
+		{
+			++p;
+			bool negate = *p == '^' || *p == '!';
+			if (negate) ++p;
 
-		// abort on OOM
-		if (split_vertex == NULL || (prefix_len && prefix == NULL) || (postfix_len && postfix == NULL))
+			/* a ']' right after the '[' is a member */
+			bool first = true;
+			while (*p && (*p != ']' || first))
+			{
+				if (*p == '\\' && p[1]) ++p;
+				uint8_t lo = *p++, hi = lo;
+				if (*p == '-' && p[1] && p[1] != ']')
+				{
+					++p;
+					if (*p == '\\' && p[1]) ++p;
+					hi = *p++;
+				}
+				for (int c = lo; c <= hi; ++c)
+					_glob_set_add(tok, c);
+				first = false;
+			}
+			if (*p != ']')
+				return -1;
+			++p;
+
+			if (negate)
+				for (int w = 0; w < 4; ++w) tok->set[w] = ~tok->set[w];
+		}
+		else
 		{
-			free(split_vertex);
-			free(prefix);
-			free(postfix);
-			return 0;
+			if (*p == '\\' && p[1]) ++p;
+			_glob_set_add(tok, *p++);
 		}
 
-		split_vertex->data[0] = h->data[j];
+		++n;
+	}
 
-		/* Create prefix vertex */
-		if (j == 0)
+	return n;
+}
+
+/* A parsed glob as masks over its positions: bit i is "before token i", bit n "past
+ * the last token" and accepts */
+typedef struct radix_glob {
+	uint64_t initial;
+	uint64_t accept;
+	uint64_t star; /* positions before a '*' */
+	uint64_t bytes[256]; /* positions before a token matching the byte */
+} radix_glob;
+
+/* Positions reachable from mask without reading a byte: a '*' may match nothing. Stars
+ * never follow each other, so one step is enough */
+static inline uint64_t
+_glob_closure(const radix_glob *g, uint64_t mask)
+{
+	return mask | ((mask & g->star) << 1);
+}
+
+static inline uint64_t
+_glob_step(const radix_glob *g, uint64_t mask, uint8_t c)
+{
+	return _glob_closure(g, ((mask & g->bytes[c]) << 1) | (mask & g->star));
+}
+
+static bool
+_glob_compile(radix_glob *g, const char *pattern)
+{
+	radix_glob_token toks[RADIX_GLOB_MAX_TOKENS];
+
+	int n = _glob_parse(pattern, toks);
+	if (n < 0)
+		return false;
+
+	memset(g, 0, sizeof(*g));
+	for (int i = 0; i < n; ++i)
+	{
+		uint64_t bit = (uint64_t)1 << i;
+		if (toks[i].star)
 		{
-			/* Replace old vertex with split vertex */
-			if (h->is_key)
-			{
-				void *vdata = radix_get_data(h);
-				radix_set_data(split_vertex, vdata);
-			}
-			memcpy(parent_link, &split_vertex, sizeof(split_vertex));
+			g->star |= bit;
+			continue;
 		}
-		else
+		for (int c = 0; c < 256; ++c)
 		{
-			/* Trim the compressed vertex into prefix */
-			prefix->size = prefix_len;
-			memcpy(prefix->data, h->data, prefix_len);
-			prefix->is_compressed = prefix_len > 1;
-			prefix->is_key = h->is_key;
-			prefix->is_null = h->is_null;
-			if (!h->is_null && h->is_key)
+			if (_glob_set_has(&toks[i], c))
+				g->bytes[c] |= bit;
+		}
+	}
+	g->accept = (uint64_t)1 << n;
+	g->initial = _glob_closure(g, 1);
+	return true;
+}
+
+static bool
+_dfa_grow(radix_dfa *dfa, uint64_t **masks, uint32_t *capacity)
+{
+	uint32_t cap = *capacity ? *capacity * 2 : 16;
+
+	uint32_t *next = realloc(dfa->next, (size_t)cap * 256 * sizeof(*next));
+	if (next == NULL) return false;
+	dfa->next = next;
+
+	uint8_t *accept = realloc(dfa->accept, cap);
+	if (accept == NULL) return false;
+	dfa->accept = accept;
+
+	uint64_t *m = realloc(*masks, cap * sizeof(*m));
+	if (m == NULL) return false;
+	*masks = m;
+
+	*capacity = cap;
+	return true;
+}
+
+/* Slot of mask in the open addressing table of radix_dfa_glob(): the state holding it,
+ * or an empty slot where it goes */
+static uint32_t *
+_dfa_slot(uint32_t *table, const uint64_t *masks, uint64_t mask)
+{
+	size_t i = (mask * 0x9e3779b97f4a7c15ull) >> (64 - RADIX_GLOB_TABLE_BITS);
+
+	while (table[i] != UINT32_MAX && masks[table[i]] != mask)
+		i = (i + 1) & ((1 << RADIX_GLOB_TABLE_BITS) - 1);
+	return &table[i];
+}
+
+int
+radix_dfa_glob(radix_dfa *dfa, const char *pattern)
+{
+	radix_glob g;
+	uint64_t *masks = NULL;
+	uint32_t *table = NULL;
+	uint32_t capacity = 0;
+
+	dfa->num_states = 0;
+	dfa->start = 0;
+	dfa->next = NULL;
+	dfa->accept = NULL;
+
+	if (!_glob_compile(&g, pattern))
+		return 0;
+
+	/* subset construction: a DFA state is the set of NFA positions, as a mask.
+	 * The empty set is state RADIX_DFA_DEAD. A '*' followed by k '?' needs 2^k states,
+	 * so there is a cap, past which the pattern is refused */
+	table = malloc(sizeof(*table) << RADIX_GLOB_TABLE_BITS);
+	if (table == NULL || !_dfa_grow(dfa, &masks, &capacity))
+		goto fail;
+	memset(table, 0xff, sizeof(*table) << RADIX_GLOB_TABLE_BITS);
+
+	masks[0] = 0;
+	masks[1] = g.initial;
+	*_dfa_slot(table, masks, 0) = 0;
+	*_dfa_slot(table, masks, g.initial) = 1;
+	dfa->num_states = 2;
+	dfa->start = 1;
+
+	for (uint32_t state = 0; state < dfa->num_states; ++state)
+	{
+		dfa->accept[state] = (masks[state] & g.accept) != 0;
+
+		for (int c = 0; c < 256; ++c)
+		{
+			uint64_t next = _glob_step(&g, masks[state], c);
+
+			uint32_t *slot = _dfa_slot(table, masks, next);
+			if (*slot == UINT32_MAX)
 			{
-				void *vdata = radix_get_data(h);
-				radix_set_data(prefix, vdata);
+				if (dfa->num_states == RADIX_GLOB_MAX_STATES)
+				{
+					debugf("Glob '%s': more than %d states\n", pattern, RADIX_GLOB_MAX_STATES);
+					goto fail;
+				}
+				if (dfa->num_states == capacity && !_dfa_grow(dfa, &masks, &capacity))
+					goto fail;
+				masks[dfa->num_states] = next;
+				*slot = dfa->num_states++;
 			}
 
-			radix_vertex **cp = radix_vertex_last_child_ptr(prefix);
-			memcpy(cp, &split_vertex, sizeof(split_vertex));
-			memcpy(parent_link, &prefix, sizeof(prefix));
-			parent_link = cp; // set parent link to split_vertex parent
-			++t->num_vertices;
+			dfa->next[(size_t)state * 256 + c] = *slot;
 		}
+	}
 
-		/* Create postfix vertex */
-		if (postfix_len)
+	debugf("Glob '%s': %u states\n", pattern, dfa->num_states);
+
+	free(masks);
+	free(table);
+	return 1;
+
+fail:
+	free(masks);
+	free(table);
+	radix_dfa_free(dfa);
+	return 0;
+}
+
+void
+radix_dfa_free(radix_dfa *dfa)
+{
+	free(dfa->next);
+	free(dfa->accept);
+	dfa->next = NULL;
+	dfa->accept = NULL;
+	dfa->num_states = 0;
+}
+
+typedef struct radix_match_state {
+	radix_tree *t;
+	const radix_dfa *dfa;
+	void (*cb)(void *ctx, uint8_t *s, size_t len, void *data);
+	void *ctx;
+	radix_key k;
+} radix_match_state;
+
+/* Run the automaton over the subtree at v, entered in state */
+static void
+_radix_match(radix_match_state *m, radix_vertex *v, uint32_t state)
+{
+	const radix_dfa *dfa = m->dfa;
+
+	if (v->is_key && dfa->accept[state])
+		m->cb(m->ctx, m->k.key, m->k.len, radix_get_data(m->t, v));
+
+	if (v->size == 0)
+		return;
+
+	size_t len = m->k.len;
+
+	if (v->is_compressed)
+	{
+		for (size_t i = 0; i < v->size; ++i)
 		{
-			postfix->size = postfix_len;
-			memcpy(postfix->data, h->data + prefix_len + 1, postfix_len);
-			postfix->is_compressed = postfix_len > 1;
-			postfix->is_key = false;
-			postfix->is_null = false;
+			state = dfa->next[(size_t)state * 256 + v->data[i]];
+			if (state == RADIX_DFA_DEAD)
+				return;
+		}
 
-			radix_vertex **cp = radix_vertex_last_child_ptr(postfix);
-			memcpy(cp, &next, sizeof(next));
-			++t->num_vertices;
+		if (_key_push(&m->k, v->data, v->size))
+			_radix_match(m, _radix_child(m->t, radix_vertex_last_child_ptr(m->t, v)), state);
+	}
+	else
+	{
+		for (int i = 0; i < v->size && !m->k.oom; ++i)
+		{
+			uint32_t next = dfa->next[(size_t)state * 256 + v->data[i]];
+			if (next == RADIX_DFA_DEAD)
+				continue;
+
+			if (_key_push(&m->k, &v->data[i], 1))
+				_radix_match(m, _radix_child(m->t, radix_vertex_child_ptr(m->t, v, i)), next);
+			m->k.len = len;
 		}
-		else
+	}
+
+	m->k.len = len;
+}
+
+int
+radix_match_dfa(radix_tree *t, const radix_dfa *dfa, void (*cb)(void *ctx, uint8_t *s, size_t len, void *data), void *ctx)
+{
+	radix_match_state m = { t, dfa, cb, ctx, { NULL, 0, 0, false } };
+
+	if (dfa->start != RADIX_DFA_DEAD)
+		_radix_match(&m, t->head, dfa->start);
+
+	free(m.k.key);
+	return !m.k.oom;
+}
+
+/* radix_match_glob() runs the position automaton itself rather than a DFA built from
+ * it, whose size can be exponential in the pattern */
+typedef struct radix_glob_state {
+	radix_tree *t;
+	void (*cb)(void *ctx, uint8_t *s, size_t len, void *data);
+	void *ctx;
+	radix_key k;
+	radix_glob g;
+} radix_glob_state;
+
+/* Run the positions over the subtree at v, entered in mask */
+static void
+_radix_match_glob(radix_glob_state *m, radix_vertex *v, uint64_t mask)
+{
+	if (v->is_key && (mask & m->g.accept))
+		m->cb(m->ctx, m->k.key, m->k.len, radix_get_data(m->t, v));
+
+	if (v->size == 0)
+		return;
+
+	size_t len = m->k.len;
+
+	if (v->is_compressed)
+	{
+		for (size_t i = 0; i < v->size; ++i)
 		{
-			postfix = next;
+			mask = _glob_step(&m->g, mask, v->data[i]);
+			if (mask == 0)
+				return;
 		}
 
-		/* Set split_vertex's last child as the postfix node */
-		radix_vertex **split_child = radix_vertex_last_child_ptr(split_vertex);
-		memcpy(split_child, &postfix, sizeof(postfix));
-		
-		/* Continue to fall-through (insertion) */
-		free(h);
-		h = split_vertex;
+		if (_key_push(&m->k, v->data, v->size))
+			_radix_match_glob(m, _radix_child(m->t, radix_vertex_last_child_ptr(m->t, v)), mask);
 	}
-	else if (i == len && h->is_compressed)
+	else
 	{
-		debugf("Algorithm 2: Stopped at compressed node '%.*s' (%p) j = %d\n",
-				h->size, h->data, (void*)h, j);
+		for (int i = 0; i < v->size && !m->k.oom; ++i)
+		{
+			uint64_t next = _glob_step(&m->g, mask, v->data[i]);
+			if (next == 0)
+				continue;
 
-		/* Save next pointer */
-		radix_vertex **childfield = radix_vertex_last_child_ptr(h);
-		radix_vertex *next;
-		memcpy(&next, childfield, sizeof(next));
+			if (_key_push(&m->k, &v->data[i], 1))
+				_radix_match_glob(m, _radix_child(m->t, radix_vertex_child_ptr(m->t, v, i)), next);
+			m->k.len = len;
+		}
+	}
 
-		size_t postfix_len = h->size - j;
-		size_t vertex_size = sizeof(radix_vertex) + postfix_len + radix_padding(postfix_len) + sizeof(radix_vertex *);
-		if (data != NULL)
-			vertex_size += sizeof(void *);
+	m->k.len = len;
+}
+
+int
+radix_match_glob(radix_tree *t, const char *pattern, void (*cb)(void *ctx, uint8_t *s, size_t len, void *data), void *ctx)
+{
+	radix_glob_state m = { t, cb, ctx, { NULL, 0, 0, false }, { 0 } };
 
-		radix_vertex *postfix = malloc(vertex_size);
+	debugf("### Glob: '%s'\n", pattern);
 
-		vertex_size = sizeof(radix_vertex) + j + radix_padding(j) + sizeof(radix_vertex *);
-		if (!h->is_null && h->is_key)
-			vertex_size += sizeof(void *);
+	if (!_glob_compile(&m.g, pattern))
+		return 0;
 
-		radix_vertex *prefix = malloc(vertex_size);
+	_radix_match_glob(&m, t->head, m.g.initial);
 
-		if (prefix == NULL || postfix == NULL)
+	free(m.k.key);
+	return !m.k.oom;
+}
+
+typedef struct radix_fuzzy_state {
+	radix_tree *t;
+	uint8_t *s;
+	size_t len;
+	size_t max_dist;
+	void (*cb)(void *ctx, uint8_t *key, size_t key_len, void *data, size_t dist);
+	void *ctx;
+	radix_key k;
+	size_t *rows; /* row d, the distances of s[0..j) to the first d key bytes, at rows + d * (len + 1) */
+	size_t num_rows;
+} radix_fuzzy_state;
+
+/* Compute row d + 1 from row d and the key byte c. Only the band |j - d| <= max_dist
+ * is computed, the cells around it hold max_dist + 1 so the next row may read them.
+ * Returns the row minimum, or SIZE_MAX on OOM */
+static size_t
+_radix_fuzzy_step(radix_fuzzy_state *f, size_t d, uint8_t c)
+{
+	size_t width = f->len + 1;
+	size_t cap = f->max_dist + 1;
+
+	if (d + 2 > f->num_rows)
+	{
+		size_t num_rows = f->num_rows * 2;
+		while (num_rows < d + 2)
+			num_rows *= 2;
+
+		size_t *rows = realloc(f->rows, num_rows * width * sizeof(*rows));
+		if (rows == NULL)
 		{
-			free(prefix);
-			free(postfix);
-			return 0;
+			f->k.oom = true;
+			return SIZE_MAX;
 		}
+		f->rows = rows;
+		f->num_rows = num_rows;
+	}
 
-		/* Create postfix vertex */
-		postfix->size = postfix_len;
-		memcpy(postfix->data, h->data + j, postfix_len);
-		postfix->is_compressed = postfix_len > 1;
-		postfix->is_key = true;
-		postfix->is_null = false;
-		radix_set_data(postfix, data);
+	size_t *prev = f->rows + d * width;
+	size_t *row = prev + width;
+	++d;
 
-		radix_vertex **cp = radix_vertex_last_child_ptr(postfix);
-		memcpy(cp, &next, sizeof(next));
-		++t->num_vertices;
+	row[0] = d < cap ? d : cap;
+	size_t min = row[0];
 
-		/* Trim compressed vertex */
-		prefix->size = j;
-		memcpy(prefix->data, h->data, j);
-		prefix->is_compressed = j > 1;
-		prefix->is_key = false;
-		prefix->is_null = false;
+	size_t lo = d > f->max_dist ? d - f->max_dist : 1;
+	size_t hi = d + f->max_dist < f->len ? d + f->max_dist : f->len;
+	if (lo > 1 && lo - 1 <= f->len)
+		row[lo - 1] = cap;
 
-		memcpy(parent_link, &prefix, sizeof(prefix));
-		if (h->is_key)
+	for (size_t j = lo; j <= hi; ++j)
+	{
+		size_t cost = prev[j - 1] + (f->s[j - 1] != c);
+		if (prev[j] + 1 < cost) cost = prev[j] + 1;
+		if (row[j - 1] + 1 < cost) cost = row[j - 1] + 1;
+		row[j] = cost < cap ? cost : cap;
+		if (row[j] < min) min = row[j];
+	}
+
+	if (hi < f->len)
+		row[hi + 1] = cap;
+
+	return min;
+}
+
+/* distance of s to the first d key bytes */
+static inline size_t
+_radix_fuzzy_dist(radix_fuzzy_state *f, size_t d)
+{
+	if (d > f->len + f->max_dist || f->len > d + f->max_dist)
+		return f->max_dist + 1;
+
+	return f->rows[d * (f->len + 1) + f->len];
+}
+
+static void
+_radix_fuzzy(radix_fuzzy_state *f, radix_vertex *v)
+{
+	size_t d = f->k.len;
+
+	if (v->is_key)
+	{
+		size_t dist = _radix_fuzzy_dist(f, d);
+		if (dist <= f->max_dist)
+			f->cb(f->ctx, f->k.key, f->k.len, radix_get_data(f->t, v), dist);
+	}
+
+	if (v->is_compressed)
+	{
+		/* every byte of the run narrows the row, stop as soon as none is in reach */
+		for (size_t i = 0; i < v->size; ++i)
+		{
+			size_t min = _radix_fuzzy_step(f, d + i, v->data[i]);
+			if (min > f->max_dist)
+				return;
+		}
+
+		if (_key_push(&f->k, v->data, v->size))
+			_radix_fuzzy(f, _radix_child(f->t, radix_vertex_last_child_ptr(f->t, v)));
+	}
+	else
+	{
+		for (int i = 0; i < v->size && !f->k.oom; ++i)
 		{
-			void *vdata = radix_get_data(h);
-			radix_set_data(prefix, vdata);
+			size_t min = _radix_fuzzy_step(f, d, v->data[i]);
+			if (min > f->max_dist)
+				continue;
+
+			if (_key_push(&f->k, &v->data[i], 1))
+				_radix_fuzzy(f, _radix_child(f->t, radix_vertex_child_ptr(f->t, v, i)));
+			f->k.len = d;
 		}
+	}
 
-		cp = radix_vertex_last_child_ptr(prefix);
-		memcpy(cp, &postfix, sizeof(postfix));
+	f->k.len = d;
+}
 
-		/* key is already inserted */
+/* Bytes of the longest key under v */
+static size_t
+_radix_height(radix_tree *t, radix_vertex *v)
+{
+	if (v->is_compressed)
+		return v->size + _radix_height(t, _radix_child(t, radix_vertex_last_child_ptr(t, v)));
 
-		++t->num_elements;
-		free(h);
-		return 1;
+	size_t height = 0;
+	for (int i = 0; i < v->size; ++i)
+	{
+		size_t h = 1 + _radix_height(t, _radix_child(t, radix_vertex_child_ptr(t, v, i)));
+		if (h > height)
+			height = h;
 	}
+	return height;
+}
 
-	/* fall through, still got some chars left to go in string */
-	while (i < len)
+int
+radix_fuzzy_find(radix_tree *t, uint8_t *s, size_t len, size_t max_dist, void (*cb)(void *ctx, uint8_t *key, size_t key_len, void *data, size_t dist), void *ctx)
+{
+	debugf("### Fuzzy lookup: '%.*s' within %zu\n", (int)len, s, max_dist);
+
+	/* no key is further than len + its own length: past len, the search visits most of
+	 * the tree anyway, and the clamp keeps max_dist + 1 and the band bounds from wrapping */
+	if (max_dist > len)
 	{
-		radix_vertex *child;	
+		size_t height = _radix_height(t, t->head);
+		if (max_dist > len + height)
+			max_dist = len + height;
+	}
 
-		/* successive vertices with 1 children are compressed */
-		if (h->size == 0 && len - i > 1)
-		{
-			debugf("Inserting compressed vertice\n");
-			size_t compressed_size = len - i;
-			if (compressed_size > RADIX_VERTEX_MAX_SIZE) 
-				compressed_size = RADIX_VERTEX_MAX_SIZE;
+	radix_fuzzy_state f = { t, s, len, max_dist, cb, ctx, { NULL, 0, 0, false }, NULL, 16 };
+
+	f.rows = malloc(f.num_rows * (len + 1) * sizeof(*f.rows));
+	if (f.rows == NULL)
+		return 0;
+
+	/* row 0: distance of s[0..j) to the empty key */
+	size_t cap = max_dist + 1;
+	for (size_t j = 0; j <= len && j <= cap; ++j)
+		f.rows[j] = j < cap ? j : cap;
+
+	_radix_fuzzy(&f, t->head);
+
+	free(f.rows);
+	free(f.k.key);
+	return !f.k.oom;
+}
+
+/* radix_topk_prefix() queue entry: a subtree ranked by its max score, or a key ranked
+ * by its own score. Keys are stored in the shared key buffer */
+typedef struct radix_topk_entry {
+	uint64_t priority;
+	radix_vertex *v;
+	size_t key_off;
+	size_t key_len;
+	bool is_key;
+} radix_topk_entry;
+
+typedef struct radix_topk_heap {
+	radix_topk_entry *entries;
+	size_t size;
+	size_t capacity;
+} radix_topk_heap;
+
+/* a before b: higher priority, and a key before the subtree it tops */
+static inline bool
+_topk_before(radix_topk_entry *a, radix_topk_entry *b)
+{
+	return a->priority > b->priority || (a->priority == b->priority && a->is_key && !b->is_key);
+}
+
+static bool
+_topk_push(radix_topk_heap *h, radix_topk_entry e)
+{
+	if (h->size == h->capacity)
+	{
+		size_t capacity = h->capacity ? h->capacity * 2 : 64;
+		radix_topk_entry *entries = realloc(h->entries, capacity * sizeof(*entries));
+		if (entries == NULL)
+			return false;
+		h->entries = entries;
+		h->capacity = capacity;
+	}
+
+	size_t i = h->size++;
+	while (i && _topk_before(&e, &h->entries[(i - 1) / 2]))
+	{
+		h->entries[i] = h->entries[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->entries[i] = e;
+	return true;
+}
+
+static radix_topk_entry
+_topk_pop(radix_topk_heap *h)
+{
+	radix_topk_entry top = h->entries[0];
+	radix_topk_entry last = h->entries[--h->size];
+
+	size_t i = 0;
+	while (2 * i + 1 < h->size)
+	{
+		size_t c = 2 * i + 1;
+		if (c + 1 < h->size && _topk_before(&h->entries[c + 1], &h->entries[c]))
+			++c;
+		if (!_topk_before(&h->entries[c], &last))
+			break;
+		h->entries[i] = h->entries[c];
+		i = c;
+	}
+	h->entries[i] = last;
+	return top;
+}
+
+/* Queue the subtree at v, whose key is the key of e followed by n more bytes */
+static bool
+_topk_push_subtree(radix_tree *t, radix_topk_heap *h, radix_key *k, radix_topk_entry *e, uint8_t *bytes, size_t n, radix_vertex *v)
+{
+	/* the key of e lives in the buffer as well, reserve before copying it */
+	if (!_key_reserve(k, e->key_len + n))
+		return false;
+
+	radix_topk_entry child = { _radix_score(t, v, RADIX_SCORE_MAX), v, k->len, e->key_len + n, false };
+	if (e->key_len)
+		memcpy(k->key + k->len, k->key + e->key_off, e->key_len);
+	if (n)
+		memcpy(k->key + k->len + e->key_len, bytes, n);
+	k->len += child.key_len;
+
+	return _topk_push(h, child);
+}
+
+int
+radix_topk_prefix(radix_tree *t, uint8_t *prefix, size_t len, int k, radix_scored *out)
+{
+	radix_topk_heap heap = { NULL, 0, 0 };
+	radix_key key = { NULL, 0, 0, false };
+	radix_vertex *h;
+	int split_pos = 0;
+	int found = 0;
+
+	assert(t->flags & RADIX_SCORES);
+
+	debugf("### Top %d of prefix '%.*s'\n", k, (int)len, prefix);
+
+	size_t i = _radix_walk(t, prefix, len, &h, NULL, &split_pos, NULL);
+	if (i != len || k <= 0)
+		return 0;
 
-			radix_vertex *newh = _compress(h, s+i, compressed_size, &child);
-			if (newh == NULL)
-				goto OOM;
+	/* the prefix may end inside a compressed vertex: its subtree is the child, reached
+	 * through the rest of the compressed bytes */
+	radix_topk_entry root = { 0, NULL, 0, 0, false };
+	if (!_key_push(&key, prefix, len))
+		goto oom;
+	root.key_len = len;
 
-			h = newh;
-			memcpy(parent_link, &h, sizeof(h));
-			parent_link = radix_vertex_last_child_ptr(h);
-			i += compressed_size;
+	bool ok;
+	if (h->is_compressed && split_pos != 0)
+		ok = _topk_push_subtree(t, &heap, &key, &root, h->data + split_pos, h->size - split_pos, _radix_child(t, radix_vertex_last_child_ptr(t, h)));
+	else
+		ok = _topk_push_subtree(t, &heap, &key, &root, NULL, 0, h);
+	if (!ok)
+		goto oom;
+
+	/* best first: a subtree is opened only once its max beats everything queued */
+	while (heap.size && found < k)
+	{
+		radix_topk_entry e = _topk_pop(&heap);
+		radix_vertex *v = e.v;
+
+		if (e.is_key)
+		{
+			out[found].key = malloc(e.key_len ? e.key_len : 1);
+			if (out[found].key == NULL)
+				goto oom;
+			memcpy(out[found].key, key.key + e.key_off, e.key_len);
+			out[found].len = e.key_len;
+			out[found].data = radix_get_data(t, v);
+			out[found].score = e.priority;
+			++found;
+			continue;
 		}
-		else // normal insert
+
+		if (v->is_key)
 		{
-			debugf("Inserting normal vertice\n");
-			radix_vertex **new_parent_link;	
-			radix_vertex *newh = _add_child(h, s[i], &child, &new_parent_link);
-			if (newh == NULL)
-				goto OOM;
+			radix_topk_entry self = { _radix_score(t, v, RADIX_SCORE_KEY), v, e.key_off, e.key_len, true };
+			if (!_topk_push(&heap, self))
+				goto oom;
+		}
 
-			h = newh;
-			memcpy(parent_link, &h, sizeof(h));
-			parent_link = new_parent_link;
-			++i;
+		if (v->is_compressed)
+		{
+			if (!_topk_push_subtree(t, &heap, &key, &e, v->data, v->size, _radix_child(t, radix_vertex_last_child_ptr(t, v))))
+				goto oom;
+		}
+		else
+		{
+			for (int c = 0; c < v->size; ++c)
+			{
+				if (!_topk_push_subtree(t, &heap, &key, &e, &v->data[c], 1, _radix_child(t, radix_vertex_child_ptr(t, v, c))))
+					goto oom;
+			}
 		}
+	}
 
-		++t->num_vertices;
-		h = child;
+	free(heap.entries);
+	free(key.key);
+	return found;
+
+oom:
+	radix_topk_free(out, found);
+	free(heap.entries);
+	free(key.key);
+	return -1;
+}
+
+void
+radix_topk_free(radix_scored *out, int n)
+{
+	for (int i = 0; i < n; ++i)
+		free(out[i].key);
+}
+
+int
+radix_set_sampling(radix_tree *t, uint32_t every, size_t capacity)
+{
+	/* the prefix depths stay, with counts started over like those of the keys */
+	size_t depths[RADIX_SKETCH_DEPTHS] = { 0 };
+	for (int d = 0; d < RADIX_SKETCH_DEPTHS && t->prefix_sketches[d]; ++d)
+		depths[d] = t->prefix_sketches[d]->depth;
+
+	_radix_sampling_free(t);
+	t->sample_every = every;
+
+	if (every == 0)
+		return 1;
+
+	capacity = capacity ? capacity : RADIX_SKETCH_CAPACITY;
+	t->sketch = _radix_sketch_new(capacity);
+	for (int d = 0; d < RADIX_SKETCH_DEPTHS && depths[d] && t->sketch; ++d)
+	{
+		t->prefix_sketches[d] = _radix_sketch_new(capacity);
+		if (t->prefix_sketches[d] == NULL)
+			_radix_sampling_free(t);
+		else
+			t->prefix_sketches[d]->depth = depths[d];
 	}
 
-	radix_vertex *newh = _radix_realloc_data(h, data);
-	if (newh == NULL)
-		goto OOM;
-	
-	h = newh;
-	if (!h->is_key)
-		++t->num_elements;
+	if (t->sketch == NULL)
+	{
+		t->sample_every = 0;
+		return 0;
+	}
 
-	radix_set_data(h, data);
-	memcpy(parent_link, &h, sizeof(h));
+	t->sample_countdown = 1 + _radix_random(t) % every;
 	return 1;
+}
 
-OOM: // out of memory
-	if (h->size == 0)
+int
+radix_sample_prefixes(radix_tree *t, size_t depth)
+{
+	assert(t->sketch && depth);
+
+	int d = 0;
+	for (; d < RADIX_SKETCH_DEPTHS && t->prefix_sketches[d]; ++d)
 	{
-		h->is_null = true;
-		h->is_key = true;
-		++t->num_elements; /* compensation for next removal */
-		assert(radix_del(t, s, i, NULL) != 0);
+		if (t->prefix_sketches[d]->depth == depth)
+			return 1;
 	}
+	assert(d < RADIX_SKETCH_DEPTHS);
 
-	return 0;
+	t->prefix_sketches[d] = _radix_sketch_new(t->sketch->capacity);
+	if (t->prefix_sketches[d] == NULL)
+		return 0;
+
+	t->prefix_sketches[d]->depth = depth;
+	return 1;
 }
 
-/* overwriting insert that updates the element if it exists */
-int 
-radix_insert(radix_tree *t, uint8_t *s, size_t len, void *data, void **old)
+static int
+_radix_hot_cmp(const void *a, const void *b)
 {
-	return _radix_insert(t, s, len, data, old, 1);
+	const radix_hot *x = a;
+	const radix_hot *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+	return memcmp(x->key, y->key, x->len);
 }
 
-static radix_vertex **
-_radix_find_parent_link(radix_vertex *parent, radix_vertex *child)
+/* Sort the n entries of hot by count and copy the first k to out, with their keys */
+static int
+_radix_hot_top(radix_hot *hot, size_t n, int k, radix_hot *out)
 {
-	radix_vertex **cp = radix_vertex_first_child_ptr(parent);
-	radix_vertex *c;
+	qsort(hot, n, sizeof(*hot), _radix_hot_cmp);
 
-	while (1)
+	int found = 0;
+	for (; found < k && (size_t)found < n; ++found)
 	{
-		memcpy(&c, cp, sizeof(c));
-		if (c == child) break;
-		++cp;
+		out[found] = hot[found];
+		out[found].key = malloc(hot[found].len ? hot[found].len : 1);
+		if (out[found].key == NULL)
+		{
+			radix_hot_free(out, found);
+			return -1;
+		}
+		memcpy(out[found].key, hot[found].key, hot[found].len);
 	}
 
-	return cp;
+	return found;
 }
 
-static radix_vertex *
-_radix_del_child(radix_vertex *parent, radix_vertex *child)
+/* The k most counted entries of sk */
+static int
+_radix_hot_sketch(radix_sketch *sk, int k, radix_hot *out)
 {
-	debug_vertex("_radix_del_child before", parent);
+	if (sk == NULL || k <= 0 || sk->size == 0)
+		return 0;
 
-	if (parent->is_compressed)
-	{
-		void *data = NULL;
-		if (parent->is_key)
-			data = radix_get_data(parent);
+	/* sort a copy, the entries stay where their hashes are */
+	radix_hot *hot = malloc(sk->size * sizeof(*hot));
+	if (hot == NULL)
+		return -1;
 
-		parent->is_null = false;
-		parent->is_compressed = false;
-		parent->size = 0;
+	memcpy(hot, sk->entries, sk->size * sizeof(*hot));
+	int found = _radix_hot_top(hot, sk->size, k, out);
 
-		if (parent->is_key)
-			radix_set_data(parent, data);
+	free(hot);
+	return found;
+}
 
-		debug_vertex("_radix_del_child after", parent);
-		return parent;
+int
+radix_hot_keys(radix_tree *t, int k, radix_hot *out)
+{
+	return _radix_hot_sketch(t->sketch, k, out);
+}
+
+int
+radix_hot_prefixes(radix_tree *t, size_t depth, int k, radix_hot *out)
+{
+	for (int d = 0; d < RADIX_SKETCH_DEPTHS && t->prefix_sketches[d]; ++d)
+	{
+		if (t->prefix_sketches[d]->depth == depth)
+			return _radix_hot_sketch(t->prefix_sketches[d], k, out);
 	}
 
-	/* if not compressed, find child pointer and move */
+	radix_sketch *sk = t->sketch;
+	if (sk == NULL || k <= 0 || sk->size == 0)
+		return 0;
 
-	radix_vertex **cp = radix_vertex_first_child_ptr(parent);
-	radix_vertex **c = cp;
-	uint8_t *edge = parent->data;
+	radix_hot *hot = malloc(sk->size * sizeof(*hot));
+	if (hot == NULL)
+		return -1;
 
-	while (1)
+	/* sum the counts of the keys sharing their first depth bytes, shorter keys are their own prefix */
+	size_t n = 0;
+	for (size_t i = 0; i < sk->size; ++i)
 	{
-		radix_vertex *v;
-		memcpy(&v, c, sizeof(v));
-		if (v == child) break;
-		++c;
-		++edge;
-	}
+		radix_hot *e = &sk->entries[i];
+		size_t len = e->len < depth ? e->len : depth;
 
-	int tail_len = parent->size - (edge - parent->data) - 1;
-	debugf("_radix_del_child tail len: %d\n", tail_len);
-	memmove(edge, edge + 1, tail_len);
-
-	size_t shift = ((parent->size + 4) % sizeof(void *)) == 1 ? sizeof(void *) : 0;
-	if (shift)
-		memmove(((uint8_t *)cp) - shift, cp, (parent->size - tail_len - 1) * sizeof(radix_vertex **));
+		size_t g = 0;
+		while (g < n && (hot[g].len != len || memcmp(hot[g].key, e->key, len)))
+			++g;
 
-	size_t value_len = (!parent->is_null && parent->is_key) ? sizeof(void *) : 0;
-	memmove(((uint8_t *)c) - shift, c + 1, tail_len * sizeof(radix_vertex **) + value_len);
+		if (g == n)
+		{
+			hot[n].key = e->key;
+			hot[n].len = len;
+			hot[n].count = 0;
+			hot[n].error = 0;
+			++n;
+		}
 
-	--parent->size;
+		hot[g].count += e->count;
+		hot[g].error += e->error;
+	}
 
-	/* frees data if overallocated; if it fails the old address is returned - which is valid */
-	radix_vertex *newv = realloc(parent, radix_vertex_current_size(parent));
-	if (newv)
-		debug_vertex("_radix_del_child after", newv);
+	int found = _radix_hot_top(hot, n, k, out);
 
-	return newv ? newv : parent;
+	free(hot);
+	return found;
 }
 
-int
-radix_del(radix_tree *t, uint8_t *s, size_t len, void **old)
+void
+radix_hot_free(radix_hot *out, int n)
 {
-	radix_vertex *h;
-	radix_stack stack;
+	for (int i = 0; i < n; ++i)
+		free(out[i].key);
+}
 
-	debugf("### Delete: %.*s\n", (int)len, s);
+/* radix_parallel_reduce() splits the subtree under the prefix into parts of about
+ * RADIX_PARALLEL_PARTS per thread, few enough to make each one worth a steal */
+#define RADIX_PARALLEL_PARTS 16
+
+/* A subtree, or only the key of its root vertex when its children are parts of their own */
+typedef struct radix_part {
+	radix_vertex *v;
+	size_t key_off; /* key of v in radix_parallel.keys */
+	size_t key_len;
+	bool key_only;
+} radix_part;
+
+/* Parts [lo, hi) left to a worker, lo in the high half: the owner takes them from hi,
+ * thieves from lo, and a CAS on the whole range claims one. Padded to a cache line */
+typedef struct radix_deque {
+	_Atomic uint64_t range;
+	uint8_t pad[64 - sizeof(uint64_t)];
+} radix_deque;
+
+/* Shared state of radix_parallel_reduce(): parts are in key order, part p folds its
+ * keys into the accumulator at accs + p * acc_size */
+typedef struct radix_parallel {
+	radix_tree *t;
+	radix_part *parts;
+	size_t num_parts;
+	radix_key keys;
+	uint8_t *accs;
+	size_t acc_size;
+	void (*map)(void *ctx, void *acc, uint8_t *s, size_t len, void *data);
+	void *ctx;
+	radix_deque *deques;
+	int nthreads;
+	atomic_bool oom;
+} radix_parallel;
+
+typedef struct radix_parallel_worker {
+	radix_parallel *p;
+	int id;
+} radix_parallel_worker;
+
+/* Append part v, whose key is the key of parent followed by n more bytes */
+static bool
+_radix_part_push(radix_parallel *p, radix_part *parts, size_t *num_parts, radix_part *parent, const uint8_t *bytes, size_t n, radix_vertex *v, bool key_only)
+{
+	radix_key *k = &p->keys;
 
-	_stack_init(&stack);
-	int split_pos = 0;
+	/* the key of parent lives in the buffer as well, reserve before copying it */
+	if (!_key_reserve(k, parent->key_len + n))
+		return false;
 
-	size_t i = _radix_walk(t, s, len, &h, NULL, &split_pos, &stack);
-	if (i != len || (h->is_compressed && split_pos != 0) || !h->is_key)
-	{
-		_stack_free(&stack);
-		return 0;
-	}
+	radix_part part = { v, k->len, parent->key_len + n, key_only };
+	if (parent->key_len)
+		memcpy(k->key + k->len, k->key + parent->key_off, parent->key_len);
+	if (n)
+		memcpy(k->key + k->len + parent->key_len, bytes, n);
+	k->len += part.key_len;
 
-	if (old)
-		*old = radix_get_data(h);
+	parts[(*num_parts)++] = part;
+	return true;
+}
 
-	h->is_key = false;
-	--t->num_elements;
+/* Cut the parts into smaller ones, breadth first and in place so that they stay in key
+ * order, until there are target of them or nothing left to cut */
+static bool
+_radix_parallel_split(radix_parallel *p, size_t target)
+{
+	radix_tree *t = p->t;
+	bool cut = true;
 
-	/* if node has no children, need to compress / cleanup */
-	bool try_compress = false;
-	if (h->size == 0)
+	while (cut && p->num_parts < target)
 	{
-		debugf("Key deleted in vertex without children. Cleanup needed.\n");
-		radix_vertex *child = NULL;
-
-		while (h != t->head)
-		{
-			child = h;
-			debugf("Freeing child %p [%.*s] key:%d\n", (void*)child, (int)child->size, (char*)child->data, child->is_key);
-			free(child);
-			--t->num_vertices;
-			h = _stack_pop(&stack);
-			// stop if vertex holds a key, or if it has more than 1 child
-			if (h->is_key || (!h->is_compressed && h->size != 1))
-				break;
-		}
-		if (child)
+		/* a vertex becomes at most a key-only part and one part per child */
+		size_t max = 0;
+		for (size_t i = 0; i < p->num_parts; ++i)
+			max += p->parts[i].key_only ? 1 : 1 + (p->parts[i].v->is_compressed ? 1 : p->parts[i].v->size);
+
+		radix_part *parts = malloc(max * sizeof(*parts));
+		if (parts == NULL)
+			return false;
+
+		size_t n = 0;
+		cut = false;
+		for (size_t i = 0; i < p->num_parts; ++i)
 		{
-			debugf("Unlinking child %p from parent %p\n", (void*)child, (void*)h);
+			radix_part *part = &p->parts[i];
+			radix_vertex *v = part->v;
+			size_t left = p->num_parts - i - 1;
 
-			radix_vertex *new = _radix_del_child(h, child);
-			if (new != h)
+			if (part->key_only || v->size == 0 || n + left >= target)
 			{
-				radix_vertex *parent = _stack_peek(&stack);
-				radix_vertex **parent_link;
+				parts[n++] = *part;
+				continue;
+			}
 
-				if (parent == NULL)
-				{
-					parent_link = &t->head;
-				}
-				else
-				{
-					parent_link = _radix_find_parent_link(parent, h);
-				}
-				
-				memcpy(parent_link, &new, sizeof(new));
+			cut = true;
+			if (v->is_key)
+			{
+				parts[n] = *part;
+				parts[n++].key_only = true;
 			}
 
-			if (new->size == 1 && !new->is_key)
+			bool ok = true;
+			if (v->is_compressed)
 			{
-				try_compress = true;
-				h = new;
+				ok = _radix_part_push(p, parts, &n, part, v->data, v->size, _radix_child(t, radix_vertex_last_child_ptr(t, v)), false);
+			}
+			else
+			{
+				for (int c = 0; c < v->size && ok; ++c)
+					ok = _radix_part_push(p, parts, &n, part, &v->data[c], 1, _radix_child(t, radix_vertex_child_ptr(t, v, c)), false);
+			}
+
+			if (!ok)
+			{
+				free(parts);
+				return false;
 			}
 		}
-	}
-	else if (h->size == 1)
-	{
-		try_compress = true;
+
+		free(p->parts);
+		p->parts = parts;
+		p->num_parts = n;
 	}
 
-	if (try_compress && stack.oom)
-		try_compress = false;
+	return true;
+}
 
-	if (try_compress)
-	{
-		debugf("After removing %.*s:\n", (int)len, s);
-		debug_vertex("Compression may be needed",h);
-		debugf("Seek start node\n");
+/* Fold the keys of the subtree at v into acc, in key order */
+static void
+_radix_parallel_walk(radix_parallel *p, radix_key *k, void *acc, radix_vertex *v)
+{
+	radix_tree *t = p->t;
+
+	if (v->is_key && !_radix_expired(t, v))
+		p->map(p->ctx, acc, k->key, k->len, radix_get_data(t, v));
 
-		radix_vertex *parent;
-		while (1)
+	size_t len = k->len;
+
+	if (v->is_compressed)
+	{
+		if (_key_push(k, v->data, v->size))
+			_radix_parallel_walk(p, k, acc, _radix_child(t, radix_vertex_last_child_ptr(t, v)));
+	}
+	else
+	{
+		for (int c = 0; c < v->size && !k->oom; ++c)
 		{
-			parent = _stack_pop(&stack);
-			if (!parent || parent->is_key || (!parent->is_compressed && parent->size != 1)) break;
-			h = parent;
-			debug_vertex("Going up to",h);
+			if (_key_push(k, &v->data[c], 1))
+				_radix_parallel_walk(p, k, acc, _radix_child(t, radix_vertex_child_ptr(t, v, c)));
+			k->len = len;
 		}
+	}
 
-		radix_vertex *start = h;
-		size_t compression_size = h->size;
+	k->len = len;
+}
 
-		int vertices = 1;
-		while (h->size != 0)
+static bool
+_radix_deque_pop(radix_deque *d, size_t *part)
+{
+	uint64_t range = atomic_load(&d->range);
+	for (;;)
+	{
+		uint32_t lo = range >> 32, hi = (uint32_t)range;
+		if (lo >= hi)
+			return false;
+		if (atomic_compare_exchange_weak(&d->range, &range, ((uint64_t)lo << 32) | (hi - 1)))
 		{
-			radix_vertex **cp = radix_vertex_last_child_ptr(h);
-			memcpy(&h, cp, sizeof(h));
-			if (h->is_key || (!h->is_compressed && h->size != 1)) break;
-			if (compression_size + h->size > RADIX_VERTEX_MAX_SIZE) break;
-			++vertices;
-			compression_size += h->size;
+			*part = hi - 1;
+			return true;
 		}
-		if (vertices > 1)
-		{
-			size_t vertex_size = sizeof(radix_vertex) + compression_size + radix_padding(compression_size) + sizeof(radix_vertex *);	
-			radix_vertex *new = malloc(vertex_size);
-
-			// technically an OOM error here just means optimizing the node isn't possible, the tree should still be intact
-			if (new == NULL)
-			{
-				_stack_free(&stack);
-				return 1;
-			}
+	}
+}
 
-			new->is_null = false;
-			new->is_key = false;
-			new->is_compressed = true;
-			new->size = compression_size;
-			++t->num_vertices;
+static bool
+_radix_deque_steal(radix_deque *d, size_t *part)
+{
+	uint64_t range = atomic_load(&d->range);
+	for (;;)
+	{
+		uint32_t lo = range >> 32, hi = (uint32_t)range;
+		if (lo >= hi)
+			return false;
+		if (atomic_compare_exchange_weak(&d->range, &range, ((uint64_t)(lo + 1) << 32) | hi))
+		{
+			*part = lo;
+			return true;
+		}
+	}
+}
 
-			compression_size = 0;
-			h = start;
-			while (h->size != 0)
-			{
-				memcpy(new->data + compression_size, h->data, h->size);
-				compression_size += h->size;
-				radix_vertex **cp = radix_vertex_last_child_ptr(h);
-				radix_vertex *to_free = h;
-				memcpy(&h, cp, sizeof(h));
-				free(to_free);
-				--t->num_vertices;
-				if (h->is_key || (!h->is_compressed && h->size != 1)) break;
+static void *
+_radix_parallel_worker(void *arg)
+{
+	radix_parallel_worker *w = arg;
+	radix_parallel *p = w->p;
+	radix_key k = { NULL, 0, 0, false };
+	size_t part;
 
-			}
-			debug_vertex("New vertex", new);
+	/* no part is ever added, so once every deque is empty the work is done */
+	while (!atomic_load(&p->oom))
+	{
+		bool found = _radix_deque_pop(&p->deques[w->id], &part);
+		for (int i = 1; i < p->nthreads && !found; ++i)
+			found = _radix_deque_steal(&p->deques[(w->id + i) % p->nthreads], &part);
+		if (!found)
+			break;
 
-			// fix parent link, h should point to first vertex
-			radix_vertex **cp = radix_vertex_last_child_ptr(new);
-			memcpy(cp, &h, sizeof(h));
+		radix_part *pt = &p->parts[part];
+		void *acc = p->accs + part * p->acc_size;
 
-			if (parent)
-			{
-				radix_vertex **parent_link = _radix_find_parent_link(parent, start);
-				memcpy(parent_link, &new, sizeof(new));
-			}
-			else
-			{
-				t->head = new;
-			}
+		k.len = 0;
+		if (!_key_push(&k, p->keys.key + pt->key_off, pt->key_len))
+		{
+			atomic_store(&p->oom, true);
+			break;
+		}
 
-			debugf("Compressed %d vertices, %d total bytes\n", vertices, (int)compression_size);
+		if (pt->key_only)
+		{
+			if (pt->v->is_key && !_radix_expired(p->t, pt->v))
+				p->map(p->ctx, acc, k.key, k.len, radix_get_data(p->t, pt->v));
+		}
+		else
+		{
+			_radix_parallel_walk(p, &k, acc, pt->v);
+			if (k.oom)
+				atomic_store(&p->oom, true);
 		}
 	}
 
-	_stack_free(&stack);
-	return 1;	
+	free(k.key);
+	return NULL;
 }
 
-void *
-radix_find(radix_tree *t, uint8_t *s, size_t len)
+int
+radix_parallel_reduce(radix_tree *t, uint8_t *prefix, size_t len, int nthreads, size_t acc_size,
+	void (*init)(void *ctx, void *acc), void (*map)(void *ctx, void *acc, uint8_t *s, size_t len, void *data),
+	void (*combine)(void *ctx, void *result, void *acc), void *ctx, void *result)
 {
+	radix_parallel p = { 0 };
 	radix_vertex *h;
 	int split_pos = 0;
+	int ret = 0;
 
-	debugf("### Lookup: '%.*s'\n", (int)len, s);
+	debugf("### Parallel reduce of prefix '%.*s', %d threads\n", (int)len, prefix, nthreads);
 
-	size_t i = _radix_walk(t, s, len, &h, NULL, &split_pos, NULL);
+	if (init)
+		init(ctx, result);
 
-	if (i != len || (h->is_compressed && split_pos != 0) || !h->is_key)
-		return NULL;
+	size_t i = _radix_walk(t, prefix, len, &h, NULL, &split_pos, NULL);
+	if (i != len)
+		return 1;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > 256)
+		nthreads = 256;
+
+	p.t = t;
+	p.acc_size = acc_size;
+	p.map = map;
+	p.ctx = ctx;
+	atomic_init(&p.oom, false);
+
+	/* the prefix may end inside a compressed vertex: its subtree is the child, reached
+	 * through the rest of the compressed bytes */
+	radix_part root = { NULL, 0, len, false };
+	p.parts = malloc(sizeof(*p.parts));
+	if (p.parts == NULL || !_key_push(&p.keys, prefix, len))
+		goto cleanup;
+
+	if (h->is_compressed && split_pos != 0)
+		_radix_part_push(&p, p.parts, &p.num_parts, &root, h->data + split_pos, h->size - split_pos, _radix_child(t, radix_vertex_last_child_ptr(t, h)), false);
+	else
+		_radix_part_push(&p, p.parts, &p.num_parts, &root, NULL, 0, h, false);
+	if (p.num_parts == 0)
+		goto cleanup;
+
+	if (nthreads > 1 && !_radix_parallel_split(&p, (size_t)nthreads * RADIX_PARALLEL_PARTS))
+		goto cleanup;
+	if ((size_t)nthreads > p.num_parts)
+		nthreads = p.num_parts;
+	p.nthreads = nthreads;
+
+	debugf("Split into %zu parts\n", p.num_parts);
+
+	p.accs = malloc(p.num_parts * acc_size + 1);
+	p.deques = malloc(nthreads * sizeof(*p.deques));
+	if (p.accs == NULL || p.deques == NULL)
+		goto cleanup;
+
+	for (size_t part = 0; part < p.num_parts && init; ++part)
+		init(ctx, p.accs + part * acc_size);
+
+	/* each worker starts with a contiguous run of parts, neighbours in key order */
+	radix_parallel_worker workers[256];
+	for (int w = 0; w < nthreads; ++w)
+	{
+		uint64_t lo = p.num_parts * w / nthreads, hi = p.num_parts * (w + 1) / nthreads;
+		atomic_init(&p.deques[w].range, (lo << 32) | hi);
+		workers[w].p = &p;
+		workers[w].id = w;
+	}
+
+	/* a worker that fails to start leaves its parts to be stolen */
+	pthread_t threads[256];
+	int started = 0;
+	for (; started < nthreads - 1; ++started)
+	{
+		if (pthread_create(&threads[started], NULL, _radix_parallel_worker, &workers[started + 1]) != 0)
+			break;
+	}
+
+	_radix_parallel_worker(&workers[0]);
+
+	for (int w = 0; w < started; ++w)
+		pthread_join(threads[w], NULL);
+
+	if (atomic_load(&p.oom) || p.keys.oom)
+		goto cleanup;
+
+	for (size_t part = 0; part < p.num_parts && combine; ++part)
+		combine(ctx, result, p.accs + part * acc_size);
+
+	ret = 1;
+
+cleanup:
+	free(p.parts);
+	free(p.keys.key);
+	free(p.accs);
+	free(p.deques);
+	return ret;
+}
 
-	debugf("Found data: %p\n", radix_get_data(h));
+/* radix_parallel_for_each() is a reduce without accumulators */
+typedef struct radix_each {
+	void (*cb)(void *ctx, uint8_t *s, size_t len, void *data);
+	void *ctx;
+} radix_each;
+
+static void
+_radix_each_map(void *ctx, void *acc, uint8_t *s, size_t len, void *data)
+{
+	radix_each *e = ctx;
+
+	(void)acc;
+	e->cb(e->ctx, s, len, data);
+}
+
+int
+radix_parallel_for_each(radix_tree *t, uint8_t *prefix, size_t len, int nthreads, void (*cb)(void *ctx, uint8_t *s, size_t len, void *data), void *ctx)
+{
+	radix_each e = { cb, ctx };
 
-	return radix_get_data(h);
+	return radix_parallel_reduce(t, prefix, len, nthreads, 0, NULL, _radix_each_map, NULL, &e, NULL);
 }
 
 void
-_radix_print(radix_vertex *v, int level, int left_pad)
+_radix_print(radix_tree *t, radix_vertex *v, int level, int left_pad)
 {
 	char s = v->is_compressed ? '"' : '[';
 	char e = v->is_compressed ? '"' : ']';
 
 	int num_chars = printf("%c%.*s%c", s, v->size, v->data, e);
 	if (v->is_key)
-		num_chars += printf("=%p", radix_get_data(v));
+		num_chars += printf("=%p", radix_get_data(t, v));
 	 
 	int num_children = v->is_compressed ? 1 : v->size;
 
@@ -981,7 +5682,6 @@ _radix_print(radix_vertex *v, int level, int left_pad)
 		if (num_children == 1) left_pad += num_chars;
 	}
 
-	radix_vertex **cp = radix_vertex_first_child_ptr(v);
 	char *subtree = " `-(%c) ";
 	for (int i = 0; i < num_children; ++i)
 	{
@@ -996,16 +5696,13 @@ _radix_print(radix_vertex *v, int level, int left_pad)
 			printf(" -> ");
 		}
 
-		radix_vertex *child;
-		memcpy(&child, cp, sizeof(child));
-		_radix_print(child, level + 1, left_pad);
-		++cp;
+		_radix_print(t, _radix_child(t, radix_vertex_child_ptr(t, v, i)), level + 1, left_pad);
 	}
 }
 
 void 
 radix_print(radix_tree *t)
 {
-	_radix_print(t->head, 0, 0);	
+	_radix_print(t, t->head, 0, 0);	
 	putchar('\n');
 }
@@ -9,8 +9,24 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define RADIX_VERTEX_MAX_SIZE ((1 << 29) - 1)
 
+/* tree flags, see radix_new_flags() */
+#define RADIX_LAZY_COMPRESS (1 << 0) /* radix_del() defers recompression to radix_compact() */
+#define RADIX_COMPACT_REFS (1 << 1) /* 32-bit child references into a per-tree arena */
+#define RADIX_INLINE_VALUES (1 << 2) /* values stored in the key vertex, see radix_new_inline() */
+#define RADIX_FROZEN (1 << 3) /* set by radix_freeze_minimized(), insert and delete refuse */
+#define RADIX_SCORES (1 << 4) /* a score per key and the max score per subtree, see radix_topk_prefix() */
+#define RADIX_CACHE (1 << 5) /* last access time per key, evicts past a memory budget, see radix_set_memory_budget() */
+#define RADIX_TTL (1 << 6) /* an expiry time per key, see radix_insert_ttl() */
+#define RADIX_FILTER (1 << 7) /* a counting Bloom filter of the keys answers most radix_find() misses */
+#define RADIX_JUMP_TABLE (1 << 8) /* lookups jump over the head through a table indexed by the first key byte */
+#define RADIX_JUMP_TABLE2 (1 << 9) /* same, over the first two key bytes (65536 entries) */
+
 typedef struct radix_vertex {
 	uint32_t is_key:1;
 	uint32_t is_null:1;
@@ -19,10 +35,116 @@ typedef struct radix_vertex {
 	uint8_t data[];
 } radix_vertex;
 
+/* contiguous memory holding vertices placed by radix_relayout() */
+typedef struct radix_block {
+	uint8_t *base;
+	size_t size;
+	size_t live; /* vertices placed in the block that are still in use */
+} radix_block;
+
+#define RADIX_BLOCK_SIZE (256 * 1024)
+
+/* address range holding the vertices of a RADIX_COMPACT_REFS tree.
+ * Child references are offsets in RADIX_ARENA_UNIT units, 0 is never a vertex */
+#define RADIX_ARENA_UNIT 4
+#define RADIX_ARENA_CLASSES 512 /* chunks of fewer units have exact-size free lists */
+#define RADIX_ARENA_COMMIT (1024 * 1024)
+#define RADIX_ARENA_RESERVE ((size_t)RADIX_ARENA_UNIT << 32)
+
+typedef struct radix_arena {
+	uint8_t *base;
+	size_t used;
+	size_t committed;
+	size_t reserved;
+	uint32_t free_lists[RADIX_ARENA_CLASSES];
+	uint32_t large_free;
+} radix_arena;
+
+/* RADIX_FILTER counters, num_blocks 64-byte blocks of 128 4-bit counters */
+typedef struct radix_filter {
+	uint64_t *counters;
+	size_t num_blocks;
+	size_t capacity; /* keys the filter is sized for */
+} radix_filter;
+
+/* RADIX_JUMP_TABLE trees: the vertices below the first one or two key bytes, when they
+ * are reached through uncompressed vertices. Kept in sync by inserts and deletes */
+typedef struct radix_jump {
+	int depth; /* key bytes covered, 1 or 2 */
+	bool valid; /* top matches the edges of head */
+	bool dirty; /* a change since the last sync, the table is not used until then */
+	radix_vertex *head; /* the head top was filled from */
+	size_t head_size;
+	radix_vertex *top[256]; /* vertex below edge b of the head */
+	size_t top_size[256]; /* depth 2: size of top[b] when its row was filled */
+	bool row_valid[256]; /* depth 2: next[b * 256 .. b * 256 + 255] matches the edges of top[b] */
+	radix_vertex **next; /* depth 2: vertex below edge c of top[b] at next[b * 256 + c] */
+	size_t hole; /* depth 2: entry of next cleared during a change, plus 1 (0: none) */
+	uint8_t *key; /* key being inserted or deleted: only vertices around its path change */
+	size_t key_len;
+} radix_jump;
+
+/* a key or prefix counted by the sampling of radix_set_sampling(), see radix_hot_keys().
+ * count is the number of sampled accesses, overestimated by at most error */
+typedef struct radix_hot {
+	uint8_t *key;
+	size_t len;
+	uint64_t count;
+	uint64_t error;
+} radix_hot;
+
+#define RADIX_SKETCH_CAPACITY 256
+#define RADIX_SKETCH_DEPTHS 4 /* prefix depths radix_sample_prefixes() can count */
+
+typedef struct radix_sketch {
+	radix_hot *entries;
+	uint64_t *hashes; /* of the entry keys, to skip most comparisons */
+	size_t size;
+	size_t capacity;
+	size_t depth; /* prefix sketches: bytes counted of each sampled key */
+} radix_sketch;
+
 typedef struct radix_tree {
 	radix_vertex *head;
 	uint64_t num_elements;
 	uint64_t num_vertices;
+	uint64_t version; /* bumped on every modification, invalidates fingers */
+	uint32_t flags;
+	size_t value_size; /* bytes of the value slot of a key vertex */
+	size_t meta_size; /* bytes of metadata at the end of every vertex, for the flags that need it */
+	size_t meta_scores; /* offset of the RADIX_SCORES fields in the metadata */
+	size_t meta_cache; /* offset of the RADIX_CACHE access time in the metadata */
+	size_t memory; /* bytes held by the vertices */
+	/* RADIX_CACHE trees: inserts evict keys while memory is above memory_budget (0: no budget) */
+	size_t memory_budget;
+	uint64_t clock; /* bumped on every access */
+	uint64_t rng; /* picks the eviction candidates */
+	void (*evict)(void *ctx, uint8_t *s, size_t len, void *data);
+	void *evict_ctx;
+	size_t meta_ttl; /* offset of the RADIX_TTL expiry time in the metadata */
+	uint64_t now; /* RADIX_TTL trees: keys expiring at or before now are not found */
+	struct radix_tree *expiry; /* RADIX_TTL trees: big-endian expiry time + key for every key that expires */
+	radix_filter *filter; /* RADIX_FILTER trees only */
+	radix_jump *jump; /* RADIX_JUMP_TABLE and RADIX_JUMP_TABLE2 trees only */
+	/* 1 in sample_every finds and inserts, on average, are counted in sketch, and their
+	 * prefixes in prefix_sketches */
+	radix_sketch *sketch;
+	radix_sketch *prefix_sketches[RADIX_SKETCH_DEPTHS];
+	uint32_t sample_every;
+	uint32_t sample_countdown;
+	uint32_t trace_id; /* RADIX_TRACE builds: id of the tree in the trace, 0 if not traced */
+	struct radix_finger *batch; /* path of the previous key during radix_insert_batch() and radix_del_batch() */
+	/* keys deleted from a RADIX_LAZY_COMPRESS tree whose path awaits radix_compact() */
+	uint8_t *pending;
+	size_t pending_len;
+	size_t pending_pos;
+	size_t pending_capacity;
+	size_t pending_count;
+	/* relayout blocks, sorted by address */
+	radix_block *blocks;
+	size_t num_blocks;
+	size_t blocks_capacity;
+	radix_arena *arena; /* RADIX_COMPACT_REFS trees only */
 } radix_tree;
 
 /* stack used to walk the tree */
@@ -34,15 +156,209 @@ typedef struct radix_stack {
 	bool oom;
 } radix_stack;
 
-/* maybe some iterator stuff? Would be cool to try */
+/* cursor remembering the path walked by the last lookup, so that the next lookup
+ * can resume from the deepest vertex shared with the previous key.
+ * A finger is owned by one thread; any modification of the tree invalidates it */
+typedef struct radix_finger {
+	radix_tree *tree;
+	uint64_t version; /* tree version the path was recorded at */
+	radix_vertex **path; /* vertices entered by the last lookup, root first */
+	size_t *depth; /* key offset at which each vertex of path was entered */
+	size_t size;
+	size_t capacity;
+	uint8_t *key; /* copy of the last key looked up */
+	size_t key_len;
+	size_t key_capacity;
+} radix_finger;
+
+/* a segment of a key, laid out like struct iovec */
+typedef struct radix_iovec {
+	void *base;
+	size_t len;
+} radix_iovec;
+
+/* a vertex on the path of a radix_iter */
+typedef struct radix_iter_frame {
+	radix_vertex *v;
+	int next; /* next child to enter, -1 until the key of v itself is reported */
+	size_t depth; /* length of the key of v */
+} radix_iter_frame;
+
+/* cursor visiting the keys of a tree in key order (bytewise, shorter keys first).
+ * Any modification of the tree invalidates it */
+typedef struct radix_iter {
+	radix_tree *tree;
+	radix_iter_frame *frames; /* path from the head to the current vertex */
+	size_t size;
+	size_t capacity;
+	uint8_t *key; /* current key, key_len bytes. Not NULL after a successful seek, even for the empty key */
+	size_t key_len;
+	size_t key_capacity;
+	void *data; /* value of the current key, as radix_find() returns it */
+	bool oom;
+} radix_iter;
+
+/* Building with -DRADIX_TRACE writes every radix_new*(), radix_free*(), insert, delete,
+ * lookup, radix_set_memory_budget() and radix_expire() call on the trees of the
+ * application to the file named by the RADIX_TRACE_FILE environment variable (default
+ * rradix.trace), for rradix-replay. The file starts with RADIX_TRACE_MAGIC, then each
+ * call is a record made of the op byte and varints (7 bits per byte, low bits first):
+ * the tree id, the nanoseconds since the previous call started and the duration of the
+ * call. Then come the flags and value_size for RADIX_TRACE_NEW, the key length and bytes
+ * for the key ops, followed by the expiry time for RADIX_TRACE_INSERT_TTL, the budget
+ * and whether evict is set for RADIX_TRACE_BUDGET, and now and the budget for
+ * RADIX_TRACE_EXPIRE. RADIX_TRACE_NULL is set in the op byte of an insert of a NULL
+ * value, whose vertex is smaller. Evictions and expiries are not recorded: the replay
+ * redoes them */
+#define RADIX_TRACE_MAGIC "RRTRACE1"
+#define RADIX_TRACE_NEW 0
+#define RADIX_TRACE_FREE 1
+#define RADIX_TRACE_INSERT 2
+#define RADIX_TRACE_DEL 3
+#define RADIX_TRACE_FIND 4
+#define RADIX_TRACE_BUDGET 5
+#define RADIX_TRACE_EXPIRE 6
+#define RADIX_TRACE_INSERT_TTL 7
+#define RADIX_TRACE_NULL 0x80
 
 /* API */
 radix_tree *radix_new(void);
+radix_tree *radix_new_flags(uint32_t flags);
+/* values are value_size bytes copied into the key vertex instead of a void *.
+ * A NULL value still means a key without value */
+radix_tree *radix_new_inline(uint32_t flags, size_t value_size);
 void radix_free_callback(radix_tree *t, void (*free_callback)(void *)); // free a tree but with a callback to free auxiliary data
 void radix_free(radix_tree *t);
+/* old holds a void *: on RADIX_INLINE_VALUES trees it must be NULL, see radix_insert_inline() */
 int radix_insert(radix_tree *t, uint8_t *s, size_t len, void *data, void **old);
 int radix_del(radix_tree *t, uint8_t *s, size_t len, void **old);
 void *radix_find(radix_tree *t, uint8_t *s, size_t len);
+int radix_lookup(radix_tree *t, uint8_t *s, size_t len, void **data); // 1 if s is a key, even with a NULL value
+int radix_insert_inline(radix_tree *t, uint8_t *s, size_t len, const void *value, void *old); // old: value_size bytes or NULL
+int radix_del_inline(radix_tree *t, uint8_t *s, size_t len, void *old);
+/* points into the tree until it changes. The value is only aligned like a pointer, and
+ * not at all in RADIX_COMPACT_REFS trees: copy it out with memcpy() rather than cast it */
+void *radix_find_inline(radix_tree *t, uint8_t *s, size_t len);
+/* same as radix_find(), radix_insert() and radix_del() for the key made of the iovcnt segments of iov */
+void *radix_findv(radix_tree *t, const radix_iovec *iov, int iovcnt);
+int radix_insertv(radix_tree *t, const radix_iovec *iov, int iovcnt, void *data, void **old);
+int radix_delv(radix_tree *t, const radix_iovec *iov, int iovcnt, void **old);
+size_t radix_compact(radix_tree *t, size_t budget); // merge up to budget (0: all) deferred paths, returns how many remain
+/* insert / delete n keys (values may be NULL), each walk resuming from the path of the
+ * previous key instead of the head: sorted keys share most of it. radix_del_batch()
+ * recompresses after each delete like radix_del(), resuming from the vertices that were
+ * not merged. Return how many keys were inserted / deleted */
+int radix_insert_batch(radix_tree *t, uint8_t **keys, size_t *lens, void **values, size_t n);
+int radix_del_batch(radix_tree *t, uint8_t **keys, size_t *lens, size_t n);
+radix_tree *radix_build_parallel(uint8_t **keys, size_t *lens, void **values, size_t n, int nthreads);
+int radix_relayout(radix_tree *t); // move all vertices into contiguous blocks in depth-first order
+int radix_relayout_prefix(radix_tree *t, uint8_t *s, size_t len); // same, for the subtree under a prefix only (if any), without trimming the heap
+/* deterministic automaton driving radix_match_dfa(). State RADIX_DFA_DEAD never
+ * accepts and only leads to itself: subtrees that reach it are skipped */
+#define RADIX_DFA_DEAD 0
+
+typedef struct radix_dfa {
+	uint32_t num_states;
+	uint32_t start;
+	uint32_t *next; /* next[state * 256 + byte] */
+	uint8_t *accept;
+} radix_dfa;
+
+/* a key found by radix_topk_prefix(), key is allocated */
+typedef struct radix_scored {
+	uint8_t *key;
+	size_t len;
+	void *data;
+	uint64_t score;
+} radix_scored;
+
+/* radix_diff() operations */
+#define RADIX_DIFF_INSERT 0
+#define RADIX_DIFF_UPDATE 1
+#define RADIX_DIFF_DELETE 2
+
+/* call cb with the inserts, updates and deletes that turn a into b, in key order.
+ * old_data is the value in a, new_data the value in b. Returns 0 on OOM */
+int radix_diff(radix_tree *a, radix_tree *b, void (*cb)(void *ctx, int op, uint8_t *s, size_t len, void *old_data, void *new_data), void *ctx);
+/* compile a glob ('*', '?', [a-z], [^...], backslash escapes, up to 63 tokens) into dfa.
+ * Returns 0 if the pattern is invalid, needs more than 4096 states (a '*' followed by
+ * 12 '?' does) or on OOM */
+int radix_dfa_glob(radix_dfa *dfa, const char *pattern);
+void radix_dfa_free(radix_dfa *dfa);
+/* call cb for every key accepted by dfa / matching pattern, in key order. Returns 0 on OOM.
+ * radix_match_glob() builds no DFA, so it takes any valid pattern */
+int radix_match_dfa(radix_tree *t, const radix_dfa *dfa, void (*cb)(void *ctx, uint8_t *s, size_t len, void *data), void *ctx);
+int radix_match_glob(radix_tree *t, const char *pattern, void (*cb)(void *ctx, uint8_t *s, size_t len, void *data), void *ctx);
+/* call cb for every key within Levenshtein distance max_dist of s, in key order.
+ * Returns 0 on OOM */
+int radix_fuzzy_find(radix_tree *t, uint8_t *s, size_t len, size_t max_dist, void (*cb)(void *ctx, uint8_t *key, size_t key_len, void *data, size_t dist), void *ctx);
+/* call cb for every key starting with prefix on nthreads threads (the caller is one of
+ * them). The subtree is cut into parts, in key order, that idle threads steal from busy
+ * ones: cb sees the keys of a part in key order but parts concurrently. Nothing may
+ * modify t meanwhile. Returns 0 on OOM, possibly after some of the keys */
+int radix_parallel_for_each(radix_tree *t, uint8_t *prefix, size_t len, int nthreads, void (*cb)(void *ctx, uint8_t *s, size_t len, void *data), void *ctx);
+/* same walk, folding the keys of each part with map into an accumulator of acc_size
+ * bytes set up by init. The accumulators are then combined into result, set up by init
+ * as well, in key order on the calling thread. Returns 0 on OOM */
+int radix_parallel_reduce(radix_tree *t, uint8_t *prefix, size_t len, int nthreads, size_t acc_size,
+	void (*init)(void *ctx, void *acc), void (*map)(void *ctx, void *acc, uint8_t *s, size_t len, void *data),
+	void (*combine)(void *ctx, void *result, void *acc), void *ctx, void *result);
+/* RADIX_SCORES trees: radix_insert() gives new keys score 0 */
+int radix_insert_scored(radix_tree *t, uint8_t *s, size_t len, void *data, uint64_t score, void **old);
+int radix_set_score(radix_tree *t, uint8_t *s, size_t len, uint64_t score); // 0 if s is not a key
+/* fill out with the (up to) k best scored keys starting with prefix, best first.
+ * Returns how many, or -1 on OOM. Release the keys with radix_topk_free() */
+int radix_topk_prefix(radix_tree *t, uint8_t *prefix, size_t len, int k, radix_scored *out);
+void radix_topk_free(radix_scored *out, int n);
+/* RADIX_CACHE trees: once an insert takes t->memory above budget, keys that were not
+ * inserted or found recently are deleted until it fits again, approximating LRU by
+ * sampling. evict (may be NULL) takes over the key and value of each of them, and of
+ * expired keys whoever deletes them: radix_expire(), an insert of the same key, or a
+ * delete, which then returns 0 and leaves old alone. Lookups write the access time, so
+ * they must not run concurrently. Other trees can only set evict, with a budget of 0 */
+void radix_set_memory_budget(radix_tree *t, size_t budget, void (*evict)(void *ctx, uint8_t *s, size_t len, void *data), void *ctx);
+/* RADIX_TTL trees: insert a key that expires at time expire (0: never). radix_insert()
+ * makes keys that never expire */
+int radix_insert_ttl(radix_tree *t, uint8_t *s, size_t len, void *data, uint64_t expire, void **old);
+/* advance the time of t to now and delete up to budget (0: all) of the keys expired by
+ * then, earliest first. Until they are deleted, expired keys are not found by lookups
+ * but still show up in walks such as radix_match_dfa() or radix_diff().
+ * Returns how many keys were deleted */
+size_t radix_expire(radix_tree *t, uint64_t now, size_t budget);
+/* count about 1 in every radix_find() and radix_insert() calls in a space-saving sketch of
+ * capacity keys (0: RADIX_SKETCH_CAPACITY), or stop sampling if every is 0.
+ * Lookups then write the sketch, so they must not run concurrently. Returns 0 on OOM */
+int radix_set_sampling(radix_tree *t, uint32_t every, size_t capacity);
+/* while sampling is on, also count the first depth bytes of the sampled keys in a sketch
+ * of their own, for up to RADIX_SKETCH_DEPTHS depths. Returns 0 on OOM */
+int radix_sample_prefixes(radix_tree *t, size_t depth);
+/* fill out with the (up to) k most accessed keys / prefixes of depth bytes among the
+ * sampled accesses, most accessed first. Prefixes come from their own sketch if
+ * radix_sample_prefixes() counts depth, or else are summed from the keys of the sketch,
+ * which only holds while the sampled keys fit in it. Returns how many, or -1 on OOM.
+ * Release the keys with radix_hot_free() */
+int radix_hot_keys(radix_tree *t, int k, radix_hot *out);
+int radix_hot_prefixes(radix_tree *t, size_t depth, int k, radix_hot *out);
+void radix_hot_free(radix_hot *out, int n);
+/* turn t into a read-only DAG in which equal subtrees (same bytes, keys and values) are
+ * stored once. Returns 0 on OOM, leaving t unfrozen with the same keys, though a
+ * RADIX_LAZY_COMPRESS tree may have been compacted already */
+int radix_freeze_minimized(radix_tree *t);
 void radix_print(radix_tree *t);
 
+/* position it before the first key of t / the first key >= s, then each radix_iter_next()
+ * moves to the next key and returns 1, or returns 0 past the last key or on OOM (it->oom) */
+void radix_iter_init(radix_iter *it, radix_tree *t);
+int radix_iter_seek(radix_iter *it, uint8_t *s, size_t len); // 0 on OOM
+int radix_iter_next(radix_iter *it);
+void radix_iter_free(radix_iter *it);
+
+void radix_finger_init(radix_finger *f);
+void radix_finger_free(radix_finger *f);
+void *radix_find_with_finger(radix_tree *t, radix_finger *f, uint8_t *s, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // !__RRADIX_H__
@@ -0,0 +1,585 @@
+#ifndef __RRADIX_HPP__
+#define __RRADIX_HPP__
+
+/* C++20 wrapper over the C tree: rradix::tree<V> owns a radix_tree, takes keys as
+ * std::string_view or std::span<const uint8_t> and iterates in key order.
+ *
+ * Where a value goes is picked at compile time, see rradix::storage_of:
+ *  - trivially copyable V that fit in a void * are stored in the value slot itself,
+ *    bit for bit, without any allocation
+ *  - larger trivially copyable V are copied into the key vertex (radix_new_inline())
+ *  - other V are boxed, allocated and constructed with Alloc, destroyed when their key
+ *    is overwritten, deleted, evicted or when the tree goes
+ *
+ * As with the C API, any modification invalidates iterators, and lookups are not
+ * thread safe on RADIX_CACHE trees or trees that sample accesses.
+ * */
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" // flexible array member of radix_vertex
+#endif
+#include <rradix.h>
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace rradix {
+
+enum class storage { slot, inline_value, boxed };
+
+template <typename V>
+inline constexpr storage storage_of =
+	!std::is_trivially_copyable_v<V> ? storage::boxed :
+	sizeof(V) <= sizeof(void *) ? storage::slot : storage::inline_value;
+
+namespace detail {
+
+inline uint8_t *
+key_ptr(std::string_view k)
+{
+	return reinterpret_cast<uint8_t *>(const_cast<char *>(k.data()));
+}
+
+inline uint8_t *
+key_ptr(std::span<const uint8_t> k)
+{
+	return const_cast<uint8_t *>(k.data());
+}
+
+} // namespace detail
+
+template <typename V, typename Alloc = std::allocator<V>>
+class tree
+{
+	static_assert(std::is_same_v<typename std::allocator_traits<Alloc>::value_type, V>, "Alloc must allocate V");
+
+	using alloc_traits = std::allocator_traits<Alloc>;
+
+public:
+	using key_type = std::string_view;
+	using mapped_type = V;
+	using allocator_type = Alloc;
+	using size_type = std::size_t;
+
+	static constexpr storage kind = storage_of<V>;
+
+	class const_iterator;
+
+	/* flags as for radix_new_flags(), RADIX_INLINE_VALUES is set by the tree itself */
+	explicit tree(uint32_t flags = 0, const Alloc &alloc = Alloc())
+		: t_(nullptr), alloc_(alloc)
+	{
+		if constexpr (kind == storage::inline_value)
+			t_ = radix_new_inline(flags & ~RADIX_INLINE_VALUES, sizeof(V));
+		else
+			t_ = radix_new_flags(flags & ~RADIX_INLINE_VALUES);
+
+		if (t_ == nullptr)
+			throw std::bad_alloc();
+		bind();
+	}
+
+	tree(const tree &) = delete;
+	tree &operator=(const tree &) = delete;
+
+	/* a moved-from tree can only be destroyed or assigned to */
+	tree(tree &&o) noexcept
+		: t_(std::exchange(o.t_, nullptr)), alloc_(std::move(o.alloc_))
+	{
+		bind();
+	}
+
+	tree &
+	operator=(tree &&o) noexcept
+	{
+		if (this != &o)
+		{
+			release();
+			t_ = std::exchange(o.t_, nullptr);
+			alloc_ = std::move(o.alloc_);
+			bind();
+		}
+		return *this;
+	}
+
+	~tree()
+	{
+		release();
+	}
+
+	/* the C tree, for the calls this wrapper does not cover. Values of boxed trees are
+	 * V *, which the wrapper destroys: do not overwrite or delete them from C */
+	radix_tree *
+	handle() const noexcept
+	{
+		return t_;
+	}
+
+	allocator_type
+	get_allocator() const
+	{
+		return alloc_;
+	}
+
+	/* keys, counting expired keys not deleted yet */
+	size_type
+	size() const noexcept
+	{
+		return t_->num_elements;
+	}
+
+	bool
+	empty() const noexcept
+	{
+		return size() == 0;
+	}
+
+	/* set or overwrite the value of k. Returns true if k is a new key */
+	bool
+	insert_or_assign(std::string_view k, const V &v)
+	{
+		return insert_(detail::key_ptr(k), k.size(), v);
+	}
+
+	bool
+	insert_or_assign(std::span<const uint8_t> k, const V &v)
+	{
+		return insert_(detail::key_ptr(k), k.size(), v);
+	}
+
+	bool
+	insert_or_assign(std::string_view k, V &&v)
+	{
+		return insert_(detail::key_ptr(k), k.size(), std::move(v));
+	}
+
+	bool
+	insert_or_assign(std::span<const uint8_t> k, V &&v)
+	{
+		return insert_(detail::key_ptr(k), k.size(), std::move(v));
+	}
+
+	/* a copy of the value of k, if k is a key */
+	std::optional<V>
+	get(std::string_view k) const
+	{
+		return get_(detail::key_ptr(k), k.size());
+	}
+
+	std::optional<V>
+	get(std::span<const uint8_t> k) const
+	{
+		return get_(detail::key_ptr(k), k.size());
+	}
+
+	/* boxed trees only: the value of k, nullptr if k is not a key */
+	V *
+	find(std::string_view k) const requires (kind == storage::boxed)
+	{
+		return find_(detail::key_ptr(k), k.size());
+	}
+
+	V *
+	find(std::span<const uint8_t> k) const requires (kind == storage::boxed)
+	{
+		return find_(detail::key_ptr(k), k.size());
+	}
+
+	bool
+	contains(std::string_view k) const
+	{
+		return radix_lookup(t_, detail::key_ptr(k), k.size(), nullptr);
+	}
+
+	bool
+	contains(std::span<const uint8_t> k) const
+	{
+		return radix_lookup(t_, detail::key_ptr(k), k.size(), nullptr);
+	}
+
+	/* delete k. Returns true if it was a key */
+	bool
+	erase(std::string_view k)
+	{
+		return erase_(detail::key_ptr(k), k.size());
+	}
+
+	bool
+	erase(std::span<const uint8_t> k)
+	{
+		return erase_(detail::key_ptr(k), k.size());
+	}
+
+	/* delete every key, the flags and the memory budget stay */
+	void
+	clear()
+	{
+		tree empty(t_->flags & ~RADIX_FROZEN, alloc_);
+		std::swap(t_, empty.t_);
+		t_->memory_budget = empty.t_->memory_budget;
+		bind();
+		empty.bind();
+	}
+
+	/* RADIX_CACHE trees, see radix_set_memory_budget(). Boxes of evicted keys are destroyed */
+	void
+	set_memory_budget(size_type budget)
+	{
+		if constexpr (kind == storage::boxed)
+			radix_set_memory_budget(t_, budget, evict_box, this);
+		else
+			radix_set_memory_budget(t_, budget, nullptr, nullptr);
+	}
+
+	const_iterator
+	begin() const
+	{
+		return const_iterator(t_, nullptr, 0);
+	}
+
+	const_iterator
+	end() const noexcept
+	{
+		return const_iterator();
+	}
+
+	/* first key >= k */
+	const_iterator
+	lower_bound(std::string_view k) const
+	{
+		return const_iterator(t_, detail::key_ptr(k), k.size());
+	}
+
+	const_iterator
+	lower_bound(std::span<const uint8_t> k) const
+	{
+		return const_iterator(t_, detail::key_ptr(k), k.size());
+	}
+
+private:
+	radix_tree *t_;
+	[[no_unique_address]] Alloc alloc_;
+
+	static void *
+	encode(const V &v) noexcept
+	{
+		void *p = nullptr;
+		std::memcpy(&p, &v, sizeof(V));
+		return p;
+	}
+
+	static V
+	decode(void *data)
+	{
+		/* a V stored in the slot, or the address of a V copied into the key vertex,
+		 * which is not necessarily aligned for V */
+		alignas(V) unsigned char bytes[sizeof(V)];
+		if constexpr (kind == storage::slot)
+			std::memcpy(bytes, &data, sizeof(V));
+		else
+			std::memcpy(bytes, data, sizeof(V));
+		return *std::launder(reinterpret_cast<V *>(bytes));
+	}
+
+	/* evicted and expired keys hand their box back */
+	static void
+	evict_box(void *ctx, uint8_t *, size_t, void *data)
+	{
+		static_cast<tree *>(ctx)->destroy_box(static_cast<V *>(data));
+	}
+
+	void
+	destroy_box(V *box)
+	{
+		if (box == nullptr)
+			return;
+		alloc_traits::destroy(alloc_, box);
+		alloc_traits::deallocate(alloc_, box, 1);
+	}
+
+	/* boxed trees point the C tree back at this object, which moves */
+	void
+	bind() noexcept
+	{
+		if constexpr (kind == storage::boxed)
+		{
+			if (t_)
+				radix_set_memory_budget(t_, t_->memory_budget, evict_box, this);
+		}
+	}
+
+	void
+	release() noexcept
+	{
+		if (t_ == nullptr)
+			return;
+
+		if constexpr (kind == storage::boxed)
+		{
+			/* iterators skip expired keys, radix_expire() hands them to evict_box() */
+			if (t_->flags & RADIX_TTL)
+				radix_expire(t_, UINT64_MAX, 0);
+
+			radix_iter it;
+			radix_iter_init(&it, t_);
+			while (radix_iter_next(&it))
+				destroy_box(static_cast<V *>(it.data));
+			radix_iter_free(&it);
+		}
+
+		radix_free(t_);
+		t_ = nullptr;
+	}
+
+	template <typename U>
+	bool
+	insert_(uint8_t *s, size_t len, U &&v)
+	{
+		if (t_->flags & RADIX_FROZEN)
+			throw std::logic_error("rradix::tree: insert into a frozen tree");
+
+		if constexpr (kind == storage::slot)
+		{
+			/* an update always writes old, OOM leaves it alone. Unless the previous
+			 * value happened to look like this, which the tree itself tells apart */
+			void *data = encode(v);
+			void *old = this;
+			if (radix_insert(t_, s, len, data, &old))
+				return true;
+			if (old == this)
+			{
+				void *now;
+				if (!radix_lookup(t_, s, len, &now) || now != data)
+					throw std::bad_alloc();
+			}
+			return false;
+		}
+		else if constexpr (kind == storage::inline_value)
+		{
+			/* only a new key can run out of memory, values are never NULL here. Ask
+			 * before inserting: on a RADIX_CACHE tree the insert may evict the very
+			 * key it updated */
+			bool exists = radix_lookup(t_, s, len, nullptr);
+			if (radix_insert_inline(t_, s, len, &v, nullptr))
+				return true;
+			if (!exists)
+				throw std::bad_alloc();
+			return false;
+		}
+		else
+		{
+			V *box = alloc_traits::allocate(alloc_, 1);
+			try
+			{
+				alloc_traits::construct(alloc_, box, std::forward<U>(v));
+			}
+			catch (...)
+			{
+				alloc_traits::deallocate(alloc_, box, 1);
+				throw;
+			}
+
+			/* no box lives at this */
+			void *old = this;
+			if (radix_insert(t_, s, len, box, &old))
+				return true;
+			if (old == this)
+			{
+				destroy_box(box);
+				throw std::bad_alloc();
+			}
+			destroy_box(static_cast<V *>(old));
+			return false;
+		}
+	}
+
+	std::optional<V>
+	get_(uint8_t *s, size_t len) const
+	{
+		void *data;
+		if (!radix_lookup(t_, s, len, &data))
+			return std::nullopt;
+
+		if constexpr (kind == storage::boxed)
+			return *static_cast<V *>(data);
+		else
+			return decode(data);
+	}
+
+	V *
+	find_(uint8_t *s, size_t len) const
+	{
+		void *data;
+		if (!radix_lookup(t_, s, len, &data))
+			return nullptr;
+		return static_cast<V *>(data);
+	}
+
+	bool
+	erase_(uint8_t *s, size_t len)
+	{
+		if (t_->flags & RADIX_FROZEN)
+			throw std::logic_error("rradix::tree: delete from a frozen tree");
+
+		if constexpr (kind == storage::inline_value)
+		{
+			return radix_del_inline(t_, s, len, nullptr);
+		}
+		else
+		{
+			void *old = nullptr;
+			if (!radix_del(t_, s, len, &old))
+				return false;
+			if constexpr (kind == storage::boxed)
+				destroy_box(static_cast<V *>(old));
+			return true;
+		}
+	}
+
+public:
+	/* forward iterator over (key, value) pairs in key order. The key is a view into the
+	 * iterator, valid until it moves. Values are copies, except for boxed trees */
+	class const_iterator
+	{
+	public:
+		using value_type = std::pair<std::string_view, V>;
+		using reference = std::conditional_t<kind == storage::boxed, std::pair<std::string_view, const V &>, value_type>;
+		using difference_type = std::ptrdiff_t;
+		using iterator_concept = std::forward_iterator_tag;
+		using iterator_category = std::input_iterator_tag;
+
+		struct pointer
+		{
+			reference r;
+
+			const reference *
+			operator->() const noexcept
+			{
+				return &r;
+			}
+		};
+
+		const_iterator() noexcept
+			: it_()
+		{
+		}
+
+		const_iterator(const const_iterator &o)
+			: const_iterator(o.it_.tree, o.it_.key, o.it_.key_len)
+		{
+		}
+
+		const_iterator(const_iterator &&o) noexcept
+			: it_(o.it_)
+		{
+			o.it_ = radix_iter();
+		}
+
+		const_iterator &
+		operator=(const_iterator o) noexcept
+		{
+			std::swap(it_, o.it_);
+			return *this;
+		}
+
+		~const_iterator()
+		{
+			radix_iter_free(&it_);
+		}
+
+		reference
+		operator*() const
+		{
+			std::string_view k(reinterpret_cast<const char *>(it_.key), it_.key_len);
+			if constexpr (kind == storage::boxed)
+				return reference(k, *static_cast<const V *>(it_.data));
+			else
+				return reference(k, decode(it_.data));
+		}
+
+		pointer
+		operator->() const
+		{
+			return pointer{ **this };
+		}
+
+		std::string_view
+		key() const noexcept
+		{
+			return std::string_view(reinterpret_cast<const char *>(it_.key), it_.key_len);
+		}
+
+		const_iterator &
+		operator++()
+		{
+			advance();
+			return *this;
+		}
+
+		const_iterator
+		operator++(int)
+		{
+			const_iterator prev(*this);
+			advance();
+			return prev;
+		}
+
+		friend bool
+		operator==(const const_iterator &a, const const_iterator &b) noexcept
+		{
+			if (a.it_.tree == nullptr || b.it_.tree == nullptr)
+				return a.it_.tree == b.it_.tree;
+			return a.it_.key_len == b.it_.key_len && !std::memcmp(a.it_.key, b.it_.key, a.it_.key_len);
+		}
+
+	private:
+		friend class tree;
+
+		radix_iter it_; /* it_.tree is NULL past the last key */
+
+		/* on the first key >= s, the end if there is none */
+		const_iterator(radix_tree *t, uint8_t *s, size_t len)
+			: it_()
+		{
+			if (t == nullptr)
+				return;
+			radix_iter_init(&it_, t);
+			if (s && !radix_iter_seek(&it_, s, len))
+			{
+				radix_iter_free(&it_);
+				throw std::bad_alloc();
+			}
+			advance();
+		}
+
+		void
+		advance()
+		{
+			if (radix_iter_next(&it_))
+				return;
+
+			bool oom = it_.oom;
+			radix_iter_free(&it_);
+			it_ = radix_iter();
+			if (oom)
+				throw std::bad_alloc();
+		}
+	};
+};
+
+} // namespace rradix
+
+#endif // !__RRADIX_HPP__
@@ -0,0 +1,324 @@
+/* Tests of the -DRADIX_TRACE build and of rradix-replay: each test runs its calls in a
+ * child process, which writes the trace of its own and exits, then checks the trace.
+ * The parent makes no call on a tree, so that it never opens a trace itself */
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <rradix.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define TRACE_FILE "rradix-test-trace.trace"
+#define KEYS_FILE "rradix-test-trace.keys"
+
+static uint8_t *
+read_file(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	assert_non_null(f);
+
+	uint8_t *data = NULL;
+	size_t capacity = 0;
+	*size = 0;
+	for (;;)
+	{
+		if (*size == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 4096;
+			data = realloc(data, capacity);
+			assert_non_null(data);
+		}
+
+		size_t n = fread(data + *size, 1, capacity - *size, f);
+		if (n == 0)
+			break;
+		*size += n;
+	}
+
+	fclose(f);
+	return data;
+}
+
+static uint64_t
+read_varint(const uint8_t *data, size_t size, size_t *pos)
+{
+	uint64_t v = 0;
+	uint8_t byte;
+	int shift = 0;
+	do
+	{
+		assert_true(*pos < size && shift < 64);
+		byte = data[(*pos)++];
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	return v;
+}
+
+/* run f in a child tracing to TRACE_FILE, and wait for it to exit */
+static void
+run_traced(void (*f)(void))
+{
+	unlink(TRACE_FILE);
+	fflush(NULL);
+
+	pid_t pid = fork();
+	assert_true(pid >= 0);
+	if (pid == 0)
+	{
+		setenv("RADIX_TRACE_FILE", TRACE_FILE, 1);
+		f();
+		exit(0); /* closes the trace */
+	}
+
+	int status;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+}
+
+static void
+traced_calls(void)
+{
+	radix_tree *t = radix_new_flags(RADIX_TTL);
+
+	radix_insert(t, (uint8_t *)"foo", 3, (void *)1, NULL);
+	radix_insert_ttl(t, (uint8_t *)"bar", 3, (void *)2, 300, NULL);
+	radix_insert(t, (uint8_t *)"baz", 3, NULL, NULL);
+	radix_find(t, (uint8_t *)"foo", 3);
+	radix_set_memory_budget(t, 0, NULL, NULL);
+	radix_expire(t, 200, 5);
+	radix_del(t, (uint8_t *)"foo", 3, NULL);
+	radix_free(t);
+}
+
+static void
+radix_trace_should_record_each_call(void **state)
+{
+	(void)state;
+
+	/* op, then flags and value_size / key / budget and evict / now and budget */
+	static const struct {
+		uint8_t op;
+		const char *key;
+		uint64_t a;
+		uint64_t b;
+	} expected[] = {
+		{ RADIX_TRACE_NEW, NULL, RADIX_TTL, sizeof(void *) },
+		{ RADIX_TRACE_INSERT, "foo", 0, 0 },
+		{ RADIX_TRACE_INSERT_TTL, "bar", 300, 0 },
+		{ RADIX_TRACE_INSERT | RADIX_TRACE_NULL, "baz", 0, 0 },
+		{ RADIX_TRACE_FIND, "foo", 0, 0 },
+		{ RADIX_TRACE_BUDGET, NULL, 0, 0 },
+		{ RADIX_TRACE_EXPIRE, NULL, 200, 5 },
+		{ RADIX_TRACE_DEL, "foo", 0, 0 },
+		{ RADIX_TRACE_FREE, NULL, 0, 0 },
+	};
+
+	run_traced(traced_calls);
+
+	size_t size, pos = 8;
+	uint8_t *data = read_file(TRACE_FILE, &size);
+	assert_true(size >= 8);
+	assert_memory_equal(data, RADIX_TRACE_MAGIC, 8);
+
+	for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i)
+	{
+		assert_true(pos < size);
+		assert_int_equal(data[pos++], expected[i].op);
+		assert_int_equal(read_varint(data, size, &pos), 1); /* tree id */
+		read_varint(data, size, &pos); /* gap */
+		read_varint(data, size, &pos); /* duration */
+
+		if (expected[i].key)
+		{
+			size_t len = strlen(expected[i].key);
+			assert_int_equal(read_varint(data, size, &pos), len);
+			assert_true(len <= size - pos);
+			assert_memory_equal(data + pos, expected[i].key, len);
+			pos += len;
+			if (expected[i].op == RADIX_TRACE_INSERT_TTL)
+				assert_int_equal(read_varint(data, size, &pos), expected[i].a);
+		}
+		else if (expected[i].op != RADIX_TRACE_FREE)
+		{
+			assert_int_equal(read_varint(data, size, &pos), expected[i].a);
+			assert_int_equal(read_varint(data, size, &pos), expected[i].b);
+		}
+	}
+	assert_int_equal(pos, size);
+
+	free(data);
+	unlink(TRACE_FILE);
+}
+
+/* the keys of t in the format of rradix-replay -k */
+static void
+dump_keys(FILE *f, uint32_t id, radix_tree *t)
+{
+	radix_iter it;
+	size_t n = 0;
+
+	radix_iter_init(&it, t);
+	while (radix_iter_next(&it))
+		++n;
+	radix_iter_free(&it);
+
+	fprintf(f, "tree %u: %zu keys\n", id, n);
+	radix_iter_init(&it, t);
+	while (radix_iter_next(&it))
+	{
+		for (size_t i = 0; i < it.key_len; ++i)
+			fprintf(f, "%02x", it.key[i]);
+		fputc('\n', f);
+	}
+	radix_iter_free(&it);
+}
+
+/* keys of 0 to 7 bytes out of 4 letters, for shared prefixes and the empty key */
+static size_t
+random_key(uint32_t *seed, uint8_t *key)
+{
+	*seed = *seed * 1103515245 + 12345;
+	size_t len = (*seed >> 16) % 8;
+	for (size_t i = 0; i < len; ++i)
+	{
+		*seed = *seed * 1103515245 + 12345;
+		key[i] = 'a' + (*seed >> 16) % 4;
+	}
+
+	return len;
+}
+
+static void
+traced_workload(void)
+{
+	FILE *f = fopen(KEYS_FILE, "w");
+	uint32_t seed = 1;
+	uint8_t key[8];
+	size_t len;
+
+	/* expiry times, deletes and deletes of expired keys */
+	radix_tree *ttl = radix_new_flags(RADIX_TTL);
+	for (int i = 0; i < 2000; ++i)
+	{
+		len = random_key(&seed, key);
+		if (i % 5 == 0)
+			radix_del(ttl, key, len, NULL);
+		else if (i % 3 == 0)
+			radix_insert(ttl, key, len, (void *)1, NULL);
+		else
+			radix_insert_ttl(ttl, key, len, (void *)1, 1 + i % 500, NULL);
+
+		if (i % 100 == 0)
+			radix_expire(ttl, i / 4, 10);
+	}
+
+	/* inline values, and keys given as segments */
+	radix_tree *inl = radix_new_inline(0, 16);
+	uint8_t value[16] = { 0 };
+	for (int i = 0; i < 1000; ++i)
+	{
+		len = random_key(&seed, key);
+		radix_iovec iov[2] = { { key, len / 2 }, { key + len / 2, len - len / 2 } };
+		if (i % 4 == 0)
+			radix_del_inline(inl, key, len, NULL);
+		else if (i % 4 == 1)
+			radix_insertv(inl, iov, 2, value, NULL);
+		else if (i % 4 == 2)
+			radix_delv(inl, iov, 2, NULL);
+		else
+			radix_insert_inline(inl, key, len, value, NULL);
+	}
+	dump_keys(f, inl->trace_id, inl);
+	radix_free(inl);
+
+	/* evictions past a budget, in the order of the lookups and after the memory of NULL
+	 * values. Vertices come from the arena, whose usage does not depend on the malloc()
+	 * the replay is built with */
+	radix_tree *cache = radix_new_flags(RADIX_CACHE | RADIX_COMPACT_REFS);
+	uint8_t *keys[64];
+	size_t lens[64];
+	uint8_t batch[64][8];
+	void *values[64];
+	for (int i = 0; i < 3000; ++i)
+	{
+		len = random_key(&seed, key);
+		if (i == 1000)
+			radix_set_memory_budget(cache, cache->memory * 3 / 4, NULL, NULL);
+		if (i % 2)
+			radix_find(cache, key, len);
+		else
+			radix_insert(cache, key, len, (void *)1, NULL);
+
+		if (i % 500 == 499)
+		{
+			for (int k = 0; k < 64; ++k)
+			{
+				lens[k] = random_key(&seed, batch[k]);
+				keys[k] = batch[k];
+				values[k] = k % 2 ? (void *)1 : NULL;
+			}
+
+			if (i % 1000 == 999)
+				radix_insert_batch(cache, keys, lens, values, 64);
+			else
+				radix_del_batch(cache, keys, lens, 64);
+		}
+	}
+
+	dump_keys(f, ttl->trace_id, ttl);
+	radix_free(ttl);
+	dump_keys(f, cache->trace_id, cache);
+	radix_free(cache);
+
+	fclose(f);
+}
+
+static void
+radix_replay_should_rebuild_the_traced_keys(void **state)
+{
+	(void)state;
+
+	unlink(KEYS_FILE);
+	run_traced(traced_workload);
+
+	size_t size;
+	uint8_t *expected = read_file(KEYS_FILE, &size);
+
+	FILE *p = popen("./rradix-replay -k " TRACE_FILE, "r");
+	assert_non_null(p);
+
+	uint8_t *replayed = malloc(size + 1);
+	assert_non_null(replayed);
+	size_t n = fread(replayed, 1, size + 1, p);
+	assert_int_equal(pclose(p), 0);
+
+	assert_int_equal(n, size);
+	assert_memory_equal(replayed, expected, size);
+
+	free(replayed);
+	free(expected);
+	unlink(KEYS_FILE);
+	unlink(TRACE_FILE);
+}
+
+int
+main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(radix_trace_should_record_each_call),
+		cmocka_unit_test(radix_replay_should_rebuild_the_traced_keys),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
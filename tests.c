@@ -1,3 +1,6 @@
+/* fork() and waitpid() are not part of -std=c2x */
+#define _DEFAULT_SOURCE
+
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
@@ -7,6 +10,11 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 static void
 radix_new_should_init(void **state)
@@ -123,6 +131,1275 @@ radix_del_vertex_with_children_should_compress(void **state)
 	radix_free(t);
 }
 
+static void
+radix_long_shared_prefixes_should_split_and_find(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	uint8_t key[64];
+
+	/* keys share a 40+ byte prefix and diverge on either side of word / SIMD boundaries */
+	memset(key, 'k', sizeof(key));
+	radix_insert(t, key, sizeof(key), (void *)(long)100, NULL);
+
+	size_t splits[] = { 0, 7, 8, 15, 16, 17, 31, 32, 33, 40, 47, 63 };
+	size_t num_splits = sizeof(splits) / sizeof(splits[0]);
+	for (size_t n = 0; n < num_splits; ++n)
+	{
+		memset(key, 'k', sizeof(key));
+		key[splits[n]] = 'x';
+		assert_int_equal(radix_insert(t, key, sizeof(key), (void *)(long)(n + 1), NULL), 1);
+	}
+
+	assert_int_equal(t->num_elements, num_splits + 1);
+
+	for (size_t n = 0; n < num_splits; ++n)
+	{
+		memset(key, 'k', sizeof(key));
+		key[splits[n]] = 'x';
+		assert_true(radix_find(t, key, sizeof(key)) == (void *)(long)(n + 1));
+
+		/* a proper prefix of a stored key is not a key */
+		if (splits[n] + 1 < sizeof(key))
+			assert_null(radix_find(t, key, splits[n] + 1));
+	}
+
+	memset(key, 'k', sizeof(key));
+	assert_true(radix_find(t, key, sizeof(key)) == (void *)(long)100);
+	assert_null(radix_find(t, key, 48));
+
+	for (size_t n = 0; n < num_splits; ++n)
+	{
+		memset(key, 'k', sizeof(key));
+		key[splits[n]] = 'x';
+		assert_int_equal(radix_del(t, key, sizeof(key), NULL), 1);
+		assert_int_equal(radix_del(t, key, sizeof(key), NULL), 0);
+	}
+
+	memset(key, 'k', sizeof(key));
+	assert_true(radix_find(t, key, sizeof(key)) == (void *)(long)100);
+	assert_int_equal(t->num_elements, 1);
+	assert_int_equal(t->num_vertices, 2);
+
+	radix_free(t);
+}
+
+static void
+radix_find_with_finger_should_match_find(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	radix_finger f;
+	char key[64];
+
+	radix_finger_init(&f);
+
+	for (int n = 0; n < 500; n += 2)
+	{
+		int len = snprintf(key, sizeof(key), "tenant:42:events:%08d", n);
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+	}
+
+	/* sequential lookups, hits and misses, share most of their path */
+	for (int n = 0; n < 500; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "tenant:42:events:%08d", n);
+		void *val = radix_find_with_finger(t, &f, (uint8_t *)key, len);
+		assert_true(val == radix_find(t, (uint8_t *)key, len));
+		assert_true(val == ((n % 2) ? NULL : (void *)(long)(n + 1)));
+
+		/* prefixes of the previous key */
+		assert_null(radix_find_with_finger(t, &f, (uint8_t *)key, len - 1));
+	}
+
+	/* modifications invalidate the remembered path */
+	int len = snprintf(key, sizeof(key), "tenant:42:events:%08d", 100);
+	assert_true(radix_find_with_finger(t, &f, (uint8_t *)key, len) == (void *)(long)101);
+	radix_del(t, (uint8_t *)key, len, NULL);
+	assert_null(radix_find_with_finger(t, &f, (uint8_t *)key, len));
+	radix_insert(t, (uint8_t *)key, len, (void *)(long)7, NULL);
+	assert_true(radix_find_with_finger(t, &f, (uint8_t *)key, len) == (void *)(long)7);
+
+	/* jumping to an unrelated key and back */
+	assert_null(radix_find_with_finger(t, &f, (uint8_t *)"other", 5));
+	assert_null(radix_find_with_finger(t, &f, (uint8_t *)"", 0));
+	assert_true(radix_find_with_finger(t, &f, (uint8_t *)key, len) == (void *)(long)7);
+
+	radix_finger_free(&f);
+	radix_free(t);
+}
+
+static void
+radix_lazy_del_should_defer_compression_to_compact(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new_flags(RADIX_LAZY_COMPRESS);
+	radix_insert(t, (uint8_t *)"foobar", 6, (void *)(long)2, NULL);
+	radix_insert(t, (uint8_t *)"footer", 6, (void *)(long)3, NULL);
+
+	assert_int_equal(t->num_vertices, 6);
+
+	radix_del(t, (uint8_t *)"footer", 6, NULL);
+
+	/* the chain left behind is still walkable */
+	assert_int_equal(t->num_elements, 1);
+	assert_int_equal(t->num_vertices, 4);
+	assert_true(radix_find(t, (uint8_t *)"foobar", 6) == (void *)(long)2);
+	assert_null(radix_find(t, (uint8_t *)"footer", 6));
+
+	assert_int_equal(radix_compact(t, 0), 0);
+	assert_int_equal(t->num_vertices, 2);
+	assert_true(radix_find(t, (uint8_t *)"foobar", 6) == (void *)(long)2);
+
+	radix_del(t, (uint8_t *)"foobar", 6, NULL);
+	assert_int_equal(radix_compact(t, 0), 0);
+	assert_int_equal(t->num_vertices, 1);
+
+	/* mass deletion compacted incrementally ends up like the eager tree */
+	radix_tree *eager = radix_new();
+	char key[32];
+	for (int n = 0; n < 200; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "session:%05d:data", n * 7);
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+		radix_insert(eager, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+	}
+	for (int n = 0; n < 200; n += 3)
+	{
+		int len = snprintf(key, sizeof(key), "session:%05d:data", n * 7);
+		assert_int_equal(radix_del(t, (uint8_t *)key, len, NULL), 1);
+		assert_int_equal(radix_del(eager, (uint8_t *)key, len, NULL), 1);
+	}
+
+	size_t remaining = t->pending_count;
+	assert_int_equal(remaining, 67);
+	while (remaining)
+	{
+		size_t left = radix_compact(t, 10);
+		assert_int_equal(left, remaining > 10 ? remaining - 10 : 0);
+		remaining = left;
+	}
+
+	assert_int_equal(t->num_elements, eager->num_elements);
+	assert_int_equal(t->num_vertices, eager->num_vertices);
+	for (int n = 0; n < 200; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "session:%05d:data", n * 7);
+		assert_true(radix_find(t, (uint8_t *)key, len) == radix_find(eager, (uint8_t *)key, len));
+	}
+
+	radix_free(eager);
+	radix_free(t);
+}
+
+static void
+radix_relayout_should_keep_tree_usable(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	char key[32];
+
+	for (int n = 0; n < 3000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "user:%d:profile", n * 13);
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+	}
+	for (int n = 0; n < 3000; n += 2)
+	{
+		int len = snprintf(key, sizeof(key), "user:%d:profile", n * 13);
+		radix_del(t, (uint8_t *)key, len, NULL);
+	}
+
+	uint64_t vertices = t->num_vertices;
+	assert_int_equal(radix_relayout(t), 1);
+	assert_int_equal(t->num_vertices, vertices);
+	assert_true(t->num_blocks > 0);
+
+	/* depth-first: the head starts the first block filled */
+	bool head_starts_block = false;
+	for (size_t b = 0; b < t->num_blocks; ++b)
+		head_starts_block |= (uint8_t *)t->head == t->blocks[b].base;
+	assert_true(head_starts_block);
+
+	for (int n = 0; n < 3000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "user:%d:profile", n * 13);
+		void *val = radix_find(t, (uint8_t *)key, len);
+		assert_true(val == ((n % 2) ? (void *)(long)(n + 1) : NULL));
+	}
+
+	/* vertices leave their block as they change, blocks go once empty */
+	for (int n = 0; n < 3000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "user:%d:profile", n * 13);
+		if (n % 2)
+			assert_int_equal(radix_del(t, (uint8_t *)key, len, NULL), 1);
+		else
+			assert_int_equal(radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL), 1);
+	}
+
+	assert_int_equal(radix_relayout_prefix(t, (uint8_t *)"user:1", 6), 1);
+	assert_int_equal(radix_relayout_prefix(t, (uint8_t *)"group:1", 7), 1);
+
+	for (int n = 0; n < 3000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "user:%d:profile", n * 13);
+		void *val = radix_find(t, (uint8_t *)key, len);
+		assert_true(val == ((n % 2) ? NULL : (void *)(long)(n + 1)));
+	}
+
+	radix_free(t);
+}
+
+static void
+radix_build_parallel_should_match_sequential_inserts(void **state)
+{
+	(void)state;
+
+	enum { N = 5000 };
+	static char storage[N][32];
+	uint8_t *keys[N];
+	size_t lens[N];
+	void *values[N];
+
+	/* shuffled keys sharing a prefix, with duplicates and the prefix itself as a key */
+	for (int n = 0; n < N; ++n)
+	{
+		int id = (n * 7919) % (N - 100);
+		lens[n] = snprintf(storage[n], sizeof(storage[n]), "snapshot:%d", id);
+		keys[n] = (uint8_t *)storage[n];
+		values[n] = (void *)(long)(n + 1);
+	}
+	lens[17] = 9;
+
+	for (int nthreads = 1; nthreads <= 8; nthreads *= 2)
+	{
+		radix_tree *t = radix_build_parallel(keys, lens, values, N, nthreads);
+		radix_tree *seq = radix_new();
+		for (int n = 0; n < N; ++n)
+			radix_insert(seq, keys[n], lens[n], values[n], NULL);
+
+		assert_non_null(t);
+		assert_int_equal(t->num_elements, seq->num_elements);
+		for (int n = 0; n < N; ++n)
+			assert_true(radix_find(t, keys[n], lens[n]) == radix_find(seq, keys[n], lens[n]));
+
+		/* the stitched tree is an ordinary tree */
+		for (int n = 0; n < N; n += 2)
+			radix_del(t, keys[n], lens[n], NULL);
+		assert_int_equal(radix_insert(t, (uint8_t *)"other", 5, (void *)(long)1, NULL), 1);
+		assert_true(radix_find(t, (uint8_t *)"other", 5) == (void *)(long)1);
+
+		radix_free(seq);
+		radix_free(t);
+	}
+
+	/* no common prefix, empty key */
+	uint8_t *few[] = { (uint8_t *)"b", (uint8_t *)"a", (uint8_t *)"", (uint8_t *)"abc" };
+	size_t few_lens[] = { 1, 1, 0, 3 };
+	void *few_values[] = { (void *)(long)1, (void *)(long)2, (void *)(long)3, (void *)(long)4 };
+	radix_tree *t = radix_build_parallel(few, few_lens, few_values, 4, 4);
+	assert_int_equal(t->num_elements, 4);
+	for (int n = 0; n < 4; ++n)
+		assert_true(radix_find(t, few[n], few_lens[n]) == few_values[n]);
+	radix_free(t);
+}
+
+static void
+radix_compact_refs_tree_should_behave_like_default(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	radix_tree *c = radix_new_flags(RADIX_COMPACT_REFS);
+	char key[32];
+
+	assert_non_null(c->arena);
+
+	for (int n = 0; n < 3000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "session:%d:%d", n % 17, n * 7);
+		void *val = (n % 5) ? (void *)(long)(n + 1) : NULL;
+		assert_int_equal(radix_insert(t, (uint8_t *)key, len, val, NULL), 1);
+		assert_int_equal(radix_insert(c, (uint8_t *)key, len, val, NULL), 1);
+	}
+	for (int n = 0; n < 3000; n += 3)
+	{
+		int len = snprintf(key, sizeof(key), "session:%d:%d", n % 17, n * 7);
+		assert_int_equal(radix_del(t, (uint8_t *)key, len, NULL), 1);
+		assert_int_equal(radix_del(c, (uint8_t *)key, len, NULL), 1);
+	}
+
+	assert_int_equal(c->num_elements, t->num_elements);
+	assert_int_equal(c->num_vertices, t->num_vertices);
+
+	assert_int_equal(radix_relayout(c), 1);
+	assert_int_equal(radix_relayout_prefix(c, (uint8_t *)"session:1", 9), 1);
+
+	for (int n = 0; n < 3000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "session:%d:%d", n % 17, n * 7);
+		assert_true(radix_find(c, (uint8_t *)key, len) == radix_find(t, (uint8_t *)key, len));
+	}
+
+	for (int n = 0; n < 3000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "session:%d:%d", n % 17, n * 7);
+		radix_del(c, (uint8_t *)key, len, NULL);
+	}
+	assert_int_equal(c->num_elements, 0);
+	assert_int_equal(c->num_vertices, 1);
+
+	radix_free(t);
+	radix_free(c);
+}
+
+typedef struct test_record {
+	uint64_t id;
+	uint32_t hits;
+	uint32_t flags;
+	uint64_t expires;
+} test_record;
+
+static void
+radix_inline_values_should_store_records_in_the_tree(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new_inline(0, sizeof(test_record));
+	char key[32];
+
+	assert_non_null(t);
+
+	for (int n = 0; n < 2000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "rec:%d", n * 31);
+		test_record r = { n, n * 2, n % 7, n * 1000 };
+		assert_int_equal(radix_insert_inline(t, (uint8_t *)key, len, &r, NULL), 1);
+	}
+
+	/* "rec:0" is a prefix of "rec:0..." keys: splits must carry the record along */
+	for (int n = 0; n < 2000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "rec:%d", n * 31);
+		test_record *r = radix_find_inline(t, (uint8_t *)key, len);
+		assert_non_null(r);
+		assert_int_equal(r->id, n);
+		assert_int_equal(r->hits, n * 2);
+		assert_int_equal(r->flags, n % 7);
+		assert_int_equal(r->expires, n * 1000);
+
+		/* the record is updated in place */
+		++r->hits;
+	}
+
+	test_record old, r = { 42, 0, 0, 0 };
+	assert_int_equal(radix_insert_inline(t, (uint8_t *)"rec:31", 6, &r, &old), 0);
+	assert_int_equal(old.id, 1);
+	assert_int_equal(old.hits, 3);
+	assert_int_equal(((test_record *)radix_find_inline(t, (uint8_t *)"rec:31", 6))->id, 42);
+
+	assert_int_equal(radix_del_inline(t, (uint8_t *)"rec:62", 6, &old), 1);
+	assert_int_equal(old.id, 2);
+	assert_null(radix_find_inline(t, (uint8_t *)"rec:62", 6));
+
+	/* a NULL value is still a key without value */
+	assert_int_equal(radix_insert_inline(t, (uint8_t *)"rec", 3, NULL, NULL), 1);
+	assert_null(radix_find_inline(t, (uint8_t *)"rec", 3));
+	assert_int_equal(t->num_elements, 2000);
+
+	/* the pointer calls take no old, a void * is too small for a record */
+	assert_int_equal(radix_del(t, (uint8_t *)"rec:93", 6, NULL), 1);
+	assert_null(radix_find_inline(t, (uint8_t *)"rec:93", 6));
+#ifndef NDEBUG
+	pid_t pid = fork();
+	assert_true(pid >= 0);
+	if (pid == 0)
+	{
+		void *p;
+		freopen("/dev/null", "w", stderr);
+		radix_del(t, (uint8_t *)"rec:124", 7, &p);
+		_exit(0);
+	}
+	int status;
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+#endif
+	assert_non_null(radix_find_inline(t, (uint8_t *)"rec:124", 7));
+
+	radix_free(t);
+}
+
+static void
+radix_freeze_minimized_should_share_equal_suffixes(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	const char *dirs[] = { "src", "lib", "test" };
+	const char *files[] = { "main.c", "util.c", "io.c", "net.c" };
+	char key[64];
+
+	for (int u = 0; u < 200; ++u)
+	{
+		for (int d = 0; d < 3; ++d)
+		{
+			for (int f = 0; f < 4; ++f)
+			{
+				int len = snprintf(key, sizeof(key), "/home/u%d/%s/%s", u, dirs[d], files[f]);
+				radix_insert(t, (uint8_t *)key, len, (void *)(long)(f + 1), NULL);
+			}
+		}
+	}
+
+	uint64_t vertices = t->num_vertices;
+	uint64_t elements = t->num_elements;
+	assert_int_equal(radix_freeze_minimized(t), 1);
+
+	/* every user directory is the same subtree */
+	assert_true(t->num_vertices * 10 < vertices);
+	assert_int_equal(t->num_elements, elements);
+
+	for (int u = 0; u < 200; ++u)
+	{
+		for (int d = 0; d < 3; ++d)
+		{
+			for (int f = 0; f < 4; ++f)
+			{
+				int len = snprintf(key, sizeof(key), "/home/u%d/%s/%s", u, dirs[d], files[f]);
+				assert_true(radix_find(t, (uint8_t *)key, len) == (void *)(long)(f + 1));
+			}
+		}
+	}
+	assert_null(radix_find(t, (uint8_t *)"/home/u1/src", 12));
+
+	/* frozen trees are read-only */
+	assert_int_equal(radix_insert(t, (uint8_t *)"/tmp", 4, NULL, NULL), 0);
+	assert_int_equal(radix_del(t, (uint8_t *)key, strlen(key), NULL), 0);
+	assert_int_equal(radix_relayout(t), 0);
+	assert_int_equal(t->num_elements, elements);
+
+	radix_free(t);
+
+	/* the temporary tree goes with its expiry index and filter */
+	t = radix_new_flags(RADIX_TTL | RADIX_FILTER);
+	assert_int_equal(radix_insert_ttl(t, (uint8_t *)"a/x", 3, (void *)(long)1, 10, NULL), 1);
+	assert_int_equal(radix_insert_ttl(t, (uint8_t *)"b/x", 3, (void *)(long)2, 10, NULL), 1);
+	assert_int_equal(radix_freeze_minimized(t), 1);
+	assert_true(radix_find(t, (uint8_t *)"b/x", 3) == (void *)(long)2);
+	assert_null(radix_find(t, (uint8_t *)"c/x", 3));
+	radix_free(t);
+}
+
+typedef struct test_diff {
+	int ops[16];
+	char keys[16][16];
+	void *values[16];
+	int n;
+} test_diff;
+
+static void
+test_diff_cb(void *ctx, int op, uint8_t *s, size_t len, void *old_data, void *new_data)
+{
+	test_diff *d = ctx;
+
+	assert_true(d->n < 16);
+	d->ops[d->n] = op;
+	snprintf(d->keys[d->n], sizeof(d->keys[d->n]), "%.*s", (int)len, (char *)s);
+	d->values[d->n] = op == RADIX_DIFF_DELETE ? old_data : new_data;
+	++d->n;
+}
+
+static void
+radix_diff_should_report_changes_in_key_order(void **state)
+{
+	(void)state;
+
+	radix_tree *a = radix_new();
+	radix_tree *b = radix_new();
+	test_diff d = { .n = 0 };
+
+	/* same keys, different compression: "romane" is compressed in a, split in b */
+	const char *keys[] = { "romane", "romanus", "romulus", "rubens", "ruber" };
+	for (int n = 0; n < 5; ++n)
+	{
+		radix_insert(a, (uint8_t *)keys[n], strlen(keys[n]), (void *)(long)(n + 1), NULL);
+		radix_insert(b, (uint8_t *)keys[n], strlen(keys[n]), (void *)(long)(n + 1), NULL);
+	}
+	radix_insert(b, (uint8_t *)"roman", 5, (void *)10, NULL);
+	radix_insert(b, (uint8_t *)"romulus", 7, (void *)20, NULL);
+	radix_del(b, (uint8_t *)"rubens", 6, NULL);
+	radix_insert(b, (uint8_t *)"rubicon", 7, (void *)30, NULL);
+
+	assert_int_equal(radix_diff(a, b, test_diff_cb, &d), 1);
+	assert_int_equal(d.n, 4);
+
+	assert_int_equal(d.ops[0], RADIX_DIFF_INSERT);
+	assert_string_equal(d.keys[0], "roman");
+	assert_true(d.values[0] == (void *)10);
+	assert_int_equal(d.ops[1], RADIX_DIFF_UPDATE);
+	assert_string_equal(d.keys[1], "romulus");
+	assert_true(d.values[1] == (void *)20);
+	assert_int_equal(d.ops[2], RADIX_DIFF_DELETE);
+	assert_string_equal(d.keys[2], "rubens");
+	assert_true(d.values[2] == (void *)4);
+	assert_int_equal(d.ops[3], RADIX_DIFF_INSERT);
+	assert_string_equal(d.keys[3], "rubicon");
+
+	/* a tree against itself stops at the head */
+	d.n = 0;
+	assert_int_equal(radix_diff(b, b, test_diff_cb, &d), 1);
+	assert_int_equal(d.n, 0);
+
+	radix_free(a);
+	radix_free(b);
+}
+
+static void
+test_count_cb(void *ctx, uint8_t *s, size_t len, void *data)
+{
+	(void)s;
+	(void)len;
+	(void)data;
+	++*(int *)ctx;
+}
+
+static void
+radix_match_glob_should_find_matching_keys(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	char key[32];
+
+	for (int n = 0; n < 1000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "user:%d:%s", n, (n % 4) ? "profile" : "session");
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+		len = snprintf(key, sizeof(key), "order:%d:session", n);
+		radix_insert(t, (uint8_t *)key, len, NULL, NULL);
+	}
+
+	int count = 0;
+	assert_int_equal(radix_match_glob(t, "user:*:session", test_count_cb, &count), 1);
+	assert_int_equal(count, 250);
+
+	count = 0;
+	assert_int_equal(radix_match_glob(t, "user:1?:*", test_count_cb, &count), 1);
+	assert_int_equal(count, 10);
+
+	count = 0;
+	assert_int_equal(radix_match_glob(t, "*:[0-4]:[!s]*", test_count_cb, &count), 1);
+	assert_int_equal(count, 3);
+
+	count = 0;
+	assert_int_equal(radix_match_glob(t, "order:99\\*", test_count_cb, &count), 1);
+	assert_int_equal(count, 0);
+
+	/* a '*' followed by k '?' needs 2^k DFA states, the walk itself does not */
+	count = 0;
+	assert_int_equal(radix_match_glob(t, "*r??????????????", test_count_cb, &count), 1);
+	assert_int_equal(count, 90);
+
+	radix_dfa dfa;
+	assert_int_equal(radix_dfa_glob(&dfa, "*r????????????"), 0);
+	assert_int_equal(radix_dfa_glob(&dfa, "user:*:session"), 1);
+	count = 0;
+	assert_int_equal(radix_match_dfa(t, &dfa, test_count_cb, &count), 1);
+	assert_int_equal(count, 250);
+	radix_dfa_free(&dfa);
+
+	/* unterminated class */
+	assert_int_equal(radix_match_glob(t, "user:[0-9", test_count_cb, &count), 0);
+
+	radix_free(t);
+}
+
+static void
+test_fuzzy_cb(void *ctx, uint8_t *key, size_t key_len, void *data, size_t dist)
+{
+	(void)key;
+	(void)key_len;
+	size_t *dists = ctx;
+	dists[(long)data] = dist;
+}
+
+static void
+radix_fuzzy_find_should_find_keys_within_distance(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	const char *names[] = { "jonathan", "jonathon", "johnathan", "jon", "nathan", "jonas" };
+	size_t dists[6];
+
+	for (int n = 0; n < 6; ++n)
+		radix_insert(t, (uint8_t *)names[n], strlen(names[n]), (void *)(long)n, NULL);
+
+	for (int n = 0; n < 6; ++n) dists[n] = SIZE_MAX;
+	assert_int_equal(radix_fuzzy_find(t, (uint8_t *)"jonathan", 8, 1, test_fuzzy_cb, dists), 1);
+	assert_int_equal(dists[0], 0);
+	assert_int_equal(dists[1], 1);
+	assert_int_equal(dists[2], 1);
+	assert_true(dists[3] == SIZE_MAX && dists[4] == SIZE_MAX && dists[5] == SIZE_MAX);
+
+	for (int n = 0; n < 6; ++n) dists[n] = SIZE_MAX;
+	assert_int_equal(radix_fuzzy_find(t, (uint8_t *)"jonah", 5, 2, test_fuzzy_cb, dists), 1);
+	assert_int_equal(dists[3], 2);
+	assert_int_equal(dists[5], 1);
+	assert_true(dists[0] == SIZE_MAX && dists[4] == SIZE_MAX);
+
+	/* any distance reaches every key */
+	assert_int_equal(radix_fuzzy_find(t, (uint8_t *)"jonah", 5, SIZE_MAX, test_fuzzy_cb, dists), 1);
+	size_t all[] = { 3, 3, 4, 2, 5, 1 };
+	assert_memory_equal(dists, all, sizeof(all));
+
+	radix_free(t);
+}
+
+static void
+radix_topk_prefix_should_return_best_scored_keys(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new_flags(RADIX_SCORES);
+	radix_scored out[5];
+	char key[32];
+
+	for (int n = 0; n < 1000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "a%d", n);
+		radix_insert_scored(t, (uint8_t *)key, len, (void *)(long)(n + 1), (n * 7919) % 1000, NULL);
+	}
+	radix_insert_scored(t, (uint8_t *)"b", 1, NULL, 5000, NULL);
+
+	/* 999 is the best score, reached by n * 7919 = 999 mod 1000 */
+	int found = radix_topk_prefix(t, (uint8_t *)"a", 1, 5, out);
+	assert_int_equal(found, 5);
+	for (int i = 0; i < found; ++i)
+	{
+		assert_int_equal(out[i].score, 999 - i);
+		assert_true(out[i].key[0] == 'a');
+	}
+	radix_topk_free(out, found);
+
+	/* scores change, and deleting the best key lowers the max on its path */
+	assert_int_equal(radix_set_score(t, (uint8_t *)"a42", 3, 10000), 1);
+	found = radix_topk_prefix(t, (uint8_t *)"a4", 2, 1, out);
+	assert_int_equal(found, 1);
+	assert_int_equal(out[0].len, 3);
+	assert_memory_equal(out[0].key, "a42", 3);
+	assert_true(out[0].data == (void *)43);
+	radix_topk_free(out, found);
+
+	radix_del(t, (uint8_t *)"a42", 3, NULL);
+	found = radix_topk_prefix(t, (uint8_t *)"", 0, 2, out);
+	assert_int_equal(found, 2);
+	assert_int_equal(out[0].score, 5000);
+	assert_int_equal(out[1].score, 999);
+	radix_topk_free(out, found);
+
+	assert_int_equal(radix_topk_prefix(t, (uint8_t *)"c", 1, 5, out), 0);
+
+	radix_free(t);
+
+	/* frozen, "a/key" and "b/key" share their leaf: a refused insert must not score it */
+	t = radix_new_flags(RADIX_SCORES);
+	radix_insert_scored(t, (uint8_t *)"a/key", 5, NULL, 7, NULL);
+	radix_insert_scored(t, (uint8_t *)"b/key", 5, NULL, 7, NULL);
+	assert_int_equal(radix_freeze_minimized(t), 1);
+	assert_int_equal(radix_insert_scored(t, (uint8_t *)"a/key", 5, NULL, 99, NULL), 0);
+	found = radix_topk_prefix(t, (uint8_t *)"b", 1, 1, out);
+	assert_int_equal(found, 1);
+	assert_int_equal(out[0].score, 7);
+	radix_topk_free(out, found);
+
+	radix_free(t);
+}
+
+static void
+radix_cache_should_evict_cold_keys_past_budget(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new_flags(RADIX_CACHE);
+	char key[32];
+	int evicted = 0;
+
+	for (int n = 0; n < 1000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "key:%d", n);
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+	}
+	assert_int_equal(t->num_elements, 1000);
+
+	size_t budget = t->memory / 2;
+	radix_set_memory_budget(t, budget, test_count_cb, &evicted);
+	assert_true(t->memory <= budget);
+	assert_int_equal(t->num_elements + evicted, 1000);
+
+	/* a key looked up before every insert stays in */
+	radix_insert(t, (uint8_t *)"hot", 3, (void *)1, NULL);
+	for (int n = 1000; n < 3000; ++n)
+	{
+		assert_true(radix_find(t, (uint8_t *)"hot", 3) == (void *)1);
+		int len = snprintf(key, sizeof(key), "key:%d", n);
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+		assert_true(t->memory <= budget);
+	}
+	assert_true(radix_find(t, (uint8_t *)"hot", 3) == (void *)1);
+	assert_int_equal(t->num_elements + evicted, 3001);
+
+	/* the newest keys survive far more often than the oldest */
+	int old = 0, recent = 0;
+	for (int n = 0; n < 500; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "key:%d", n);
+		old += radix_find(t, (uint8_t *)key, len) != NULL;
+		len = snprintf(key, sizeof(key), "key:%d", 2500 + n);
+		recent += radix_find(t, (uint8_t *)key, len) != NULL;
+	}
+	assert_true(recent > 2 * old);
+
+	radix_free(t);
+
+	/* a frozen tree cannot go below its budget, nor evict anything */
+	t = radix_new_flags(RADIX_CACHE);
+	for (int n = 0; n < 200; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "key:%d", n);
+		radix_insert(t, (uint8_t *)key, len, NULL, NULL);
+	}
+	assert_int_equal(radix_freeze_minimized(t), 1);
+	evicted = 0;
+	radix_set_memory_budget(t, 64, test_count_cb, &evicted);
+	assert_int_equal(evicted, 0);
+	assert_int_equal(t->num_elements, 200);
+	radix_free(t);
+
+	/* evictions of a lazy tree merge their own path, not the deletes still queued */
+	t = radix_new_flags(RADIX_CACHE | RADIX_LAZY_COMPRESS);
+	for (int n = 0; n < 1000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "key:%d", n);
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+	}
+	for (int n = 0; n < 100; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "key:%d", n);
+		radix_del(t, (uint8_t *)key, len, NULL);
+	}
+	evicted = 0;
+	radix_set_memory_budget(t, t->memory - 1000, test_count_cb, &evicted);
+	assert_true(evicted > 0);
+	assert_int_equal(t->num_elements + evicted, 900);
+	assert_true(t->pending_count >= 100);
+	assert_int_equal(radix_compact(t, 0), 0);
+	radix_free(t);
+}
+
+static void
+radix_expire_should_delete_expired_keys_earliest_first(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new_flags(RADIX_TTL);
+	char key[32];
+	int expired = 0;
+
+	radix_set_memory_budget(t, 0, test_count_cb, &expired);
+
+	/* session:n expires at n % 100 + 1, every tenth one never does */
+	for (int n = 0; n < 1000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "session:%d", n);
+		radix_insert_ttl(t, (uint8_t *)key, len, (void *)(long)(n + 1), (n % 10) ? n % 100 + 1 : 0, NULL);
+	}
+	radix_insert(t, (uint8_t *)"config", 6, (void *)1, NULL);
+
+	/* 10 keys expire at time 2, the sweep stops at the budget */
+	assert_int_equal(radix_expire(t, 5, 3), 3);
+	assert_int_equal(t->num_elements, 998);
+
+	/* unswept keys are already gone for lookups */
+	assert_null(radix_find(t, (uint8_t *)"session:1", 9));
+	assert_null(radix_find(t, (uint8_t *)"session:104", 11));
+	assert_true(radix_find(t, (uint8_t *)"session:105", 11) == (void *)106);
+	assert_true(radix_find(t, (uint8_t *)"session:100", 11) == (void *)101);
+
+	/* a new expiry time replaces the old one, radix_insert() makes the key persistent.
+	 * The expired session:2 is handed to evict before it comes back */
+	radix_insert_ttl(t, (uint8_t *)"session:105", 11, (void *)106, 500, NULL);
+	radix_insert(t, (uint8_t *)"session:106", 11, (void *)107, NULL);
+	assert_int_equal(radix_insert_ttl(t, (uint8_t *)"session:2", 9, (void *)3, 500, NULL), 1);
+
+	assert_int_equal(radix_expire(t, 5, 0), 36);
+	assert_int_equal(radix_expire(t, 100, 0), 858);
+	assert_int_equal(expired, 898);
+	assert_int_equal(t->num_elements, 104);
+	assert_true(radix_find(t, (uint8_t *)"session:106", 11) == (void *)107);
+	assert_true(radix_find(t, (uint8_t *)"session:2", 9) == (void *)3);
+
+	assert_int_equal(radix_del(t, (uint8_t *)"session:105", 11, NULL), 1);
+	assert_int_equal(radix_expire(t, 1000, 0), 1);
+	assert_int_equal(t->num_elements, 102);
+	assert_int_equal(t->expiry->num_elements, 0);
+
+	/* an expired key deleted before the sweep still goes through evict */
+	expired = 0;
+	radix_insert_ttl(t, (uint8_t *)"session:1", 9, (void *)2, 1500, NULL);
+	radix_insert_ttl(t, (uint8_t *)"session:3", 9, (void *)4, 1500, NULL);
+	assert_int_equal(radix_expire(t, 2000, 1), 1);
+	assert_int_equal(radix_del(t, (uint8_t *)"session:3", 9, NULL), 0);
+	assert_int_equal(expired, 2);
+	assert_int_equal(t->expiry->num_elements, 0);
+
+	radix_free(t);
+
+	/* frozen, "a/key" and "b/key" share their leaf: a refused insert must not expire it */
+	t = radix_new_flags(RADIX_TTL);
+	radix_insert(t, (uint8_t *)"a/key", 5, NULL, NULL);
+	radix_insert(t, (uint8_t *)"b/key", 5, NULL, NULL);
+	assert_int_equal(radix_freeze_minimized(t), 1);
+	assert_int_equal(radix_insert_ttl(t, (uint8_t *)"a/key", 5, NULL, 10, NULL), 0);
+	assert_int_equal(radix_expire(t, 20, 0), 0);
+	assert_int_equal(radix_lookup(t, (uint8_t *)"b/key", 5, NULL), 1);
+	assert_int_equal(t->expiry->num_elements, 0);
+
+	radix_free(t);
+
+	/* "a" deleted but kept as a branch: where its expiry time goes, its value was */
+	t = radix_new_flags(RADIX_TTL);
+	radix_insert(t, (uint8_t *)"a", 1, (void *)7, NULL);
+	radix_insert(t, (uint8_t *)"ab", 2, NULL, NULL);
+	radix_insert(t, (uint8_t *)"ac", 2, NULL, NULL);
+	assert_int_equal(radix_del(t, (uint8_t *)"a", 1, NULL), 1);
+	assert_int_equal(radix_insert_ttl(t, (uint8_t *)"a", 1, NULL, 7, NULL), 1);
+	assert_int_equal(t->expiry->num_elements, 1);
+	assert_int_equal(radix_expire(t, 7, 0), 1);
+	assert_int_equal(radix_lookup(t, (uint8_t *)"a", 1, NULL), 0);
+	assert_int_equal(t->num_elements, 2);
+
+	radix_free(t);
+}
+
+static void
+radix_findv_should_match_keys_across_segments(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	char tenant[16], table[16], id[16], key[48];
+
+	for (int n = 0; n < 300; ++n)
+	{
+		int tl = snprintf(tenant, sizeof(tenant), "tenant%d|", n % 3);
+		int bl = snprintf(table, sizeof(table), "table%d|", n % 7);
+		int il = snprintf(id, sizeof(id), "%d", n);
+		radix_iovec iov[3] = { { tenant, tl }, { table, bl }, { id, il } };
+		assert_int_equal(radix_insertv(t, iov, 3, (void *)(long)(n + 1), NULL), 1);
+	}
+	assert_int_equal(t->num_elements, 300);
+
+	/* the same key split anywhere, including inside compressed vertices */
+	int len = snprintf(key, sizeof(key), "tenant1|table3|220");
+	assert_true(radix_find(t, (uint8_t *)key, len) == (void *)221);
+	for (int cut = 0; cut <= len; ++cut)
+	{
+		radix_iovec iov[4] = { { key, cut }, { NULL, 0 }, { key + cut, len - cut }, { NULL, 0 } };
+		assert_true(radix_findv(t, iov, 4) == (void *)221);
+		if (cut != len)
+			assert_null(radix_findv(t, iov, 2));
+	}
+
+	radix_iovec prefix[2] = { { "tenant1|", 8 }, { "table3|22", 9 } };
+	assert_null(radix_findv(t, prefix, 2));
+
+	radix_iovec missing[2] = { { "tenant1|", 8 }, { "table3|2200", 11 } };
+	assert_int_equal(radix_delv(t, missing, 2, NULL), 0);
+
+	void *old = NULL;
+	radix_iovec iov[2] = { { "tenant1|table3", 14 }, { "|220", 4 } };
+	assert_int_equal(radix_delv(t, iov, 2, &old), 1);
+	assert_true(old == (void *)221);
+	assert_null(radix_find(t, (uint8_t *)key, len));
+	assert_int_equal(t->num_elements, 299);
+
+	radix_free(t);
+}
+
+static void
+radix_filter_should_track_inserts_and_deletes(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new_flags(RADIX_FILTER);
+	char key[64];
+
+	for (int n = 0; n < 5000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "org/example/service/instance/%d", n * 2);
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+	}
+	assert_true(t->filter->capacity >= 5000);
+
+	for (int n = 0; n < 5000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "org/example/service/instance/%d", n * 2);
+		assert_true(radix_find(t, (uint8_t *)key, len) == (void *)(long)(n + 1));
+		len = snprintf(key, sizeof(key), "org/example/service/instance/%d", n * 2 + 1);
+		assert_null(radix_find(t, (uint8_t *)key, len));
+	}
+
+	radix_iovec iov[2] = { { "org/example/service/", 20 }, { "instance/42", 11 } };
+	assert_true(radix_findv(t, iov, 2) == (void *)22);
+
+	/* deleted keys are counted out again */
+	for (int n = 0; n < 5000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "org/example/service/instance/%d", n * 2);
+		assert_int_equal(radix_del(t, (uint8_t *)key, len, NULL), 1);
+	}
+	for (size_t i = 0; i < t->filter->num_blocks * 8; ++i)
+		assert_int_equal(t->filter->counters[i], 0);
+
+	radix_free(t);
+}
+
+static void
+radix_hot_keys_should_report_sampled_heavy_hitters(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	radix_hot out[4];
+	char key[32];
+
+	/* every access sampled, in a sketch too small for all the keys but not the tenants */
+	assert_int_equal(radix_set_sampling(t, 1, 16), 1);
+	assert_int_equal(radix_sample_prefixes(t, 7), 1);
+
+	for (int n = 0; n < 1000; ++n)
+	{
+		int len = snprintf(key, sizeof(key), "tenant%d/row%d", (n % 10) < 7 ? 1 : n % 4, n);
+		radix_insert(t, (uint8_t *)key, len, (void *)1, NULL);
+		if (n % 2)
+			radix_find(t, (uint8_t *)"tenant3/row7", 12);
+		if (n % 5 == 0)
+			radix_find(t, (uint8_t *)"tenant0/missing", 15);
+	}
+
+	int found = radix_hot_keys(t, 2, out);
+	assert_int_equal(found, 2);
+	assert_int_equal(out[0].len, 12);
+	assert_memory_equal(out[0].key, "tenant3/row7", 12);
+	assert_true(out[0].count - out[0].error >= 500);
+	assert_int_equal(out[1].len, 15);
+	assert_memory_equal(out[1].key, "tenant0/missing", 15);
+	radix_hot_free(out, found);
+
+	/* tenant1 gets 800 calls over 800 different keys, tenant3 the lookups of row7: their
+	 * own sketch counts them exactly, summing the keys of the sketch would not */
+	found = radix_hot_prefixes(t, 7, 4, out);
+	assert_int_equal(found, 4);
+	assert_memory_equal(out[0].key, "tenant1", 7);
+	assert_int_equal(out[0].count, 800);
+	assert_memory_equal(out[1].key, "tenant3", 7);
+	assert_int_equal(out[1].count, 600);
+	assert_int_equal(out[2].count, 250);
+	assert_int_equal(out[3].count, 50);
+	assert_int_equal(out[0].error + out[1].error + out[2].error + out[3].error, 0);
+	radix_hot_free(out, found);
+
+	/* other depths are summed from the keys */
+	found = radix_hot_prefixes(t, 6, 1, out);
+	assert_int_equal(found, 1);
+	assert_memory_equal(out[0].key, "tenant", 6);
+	radix_hot_free(out, found);
+
+	/* sampled 1 in 10 on average */
+	assert_int_equal(radix_set_sampling(t, 10, 0), 1);
+	for (int n = 0; n < 10000; ++n)
+		radix_find(t, (uint8_t *)"tenant2/row2", 12);
+
+	found = radix_hot_keys(t, 1, out);
+	assert_int_equal(found, 1);
+	assert_true(out[0].count > 800 && out[0].count < 1200);
+	radix_hot_free(out, found);
+
+	/* the prefix depth is still counted, from scratch */
+	found = radix_hot_prefixes(t, 7, 2, out);
+	assert_int_equal(found, 1);
+	assert_memory_equal(out[0].key, "tenant2", 7);
+	radix_hot_free(out, found);
+
+	assert_int_equal(radix_set_sampling(t, 0, 0), 1);
+	assert_int_equal(radix_hot_keys(t, 1, out), 0);
+
+	radix_free(t);
+}
+
+static void
+radix_batch_should_match_single_inserts_and_deletes(void **state)
+{
+	(void)state;
+
+	radix_tree *single = radix_new();
+	radix_tree *batch = radix_new();
+	char buf[2000][32];
+	uint8_t *keys[2000];
+	size_t lens[2000];
+	void *values[2000];
+
+	/* sorted, with long shared prefixes */
+	for (int n = 0; n < 2000; ++n)
+	{
+		lens[n] = snprintf(buf[n], sizeof(buf[n]), "tenant%d/table%d/%06d", n / 1000, n / 100 % 10, n);
+		keys[n] = (uint8_t *)buf[n];
+		values[n] = (void *)(long)(n + 1);
+		radix_insert(single, keys[n], lens[n], values[n], NULL);
+	}
+
+	assert_int_equal(radix_insert_batch(batch, keys, lens, values, 2000), 2000);
+	assert_int_equal(radix_insert_batch(batch, keys, lens, values, 10), 0);
+	assert_int_equal(batch->num_elements, single->num_elements);
+	assert_int_equal(batch->num_vertices, single->num_vertices);
+
+	/* every other table goes, the batch recompresses like radix_del() does */
+	uint8_t *del_keys[1000];
+	size_t del_lens[1000];
+	size_t m = 0;
+	for (int n = 0; n < 2000; ++n)
+	{
+		if (n / 100 % 2)
+			continue;
+		del_keys[m] = keys[n];
+		del_lens[m++] = lens[n];
+		radix_del(single, keys[n], lens[n], NULL);
+	}
+
+	assert_int_equal(radix_del_batch(batch, del_keys, del_lens, m), 1000);
+	assert_int_equal(radix_del_batch(batch, del_keys, del_lens, m), 0);
+	assert_int_equal(batch->num_elements, 1000);
+	assert_int_equal(batch->num_vertices, single->num_vertices);
+
+	for (int n = 0; n < 2000; ++n)
+		assert_true(radix_find(batch, keys[n], lens[n]) == radix_find(single, keys[n], lens[n]));
+
+	radix_free(single);
+	radix_free(batch);
+}
+
+static void
+radix_iter_should_visit_keys_in_order(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	const char *keys[] = { "romane", "romanus", "romulus", "rubens", "ruber", "rubicon", "rubicundus", "r", "", "rom" };
+	const char *sorted[] = { "", "r", "rom", "romane", "romanus", "romulus", "rubens", "ruber", "rubicon", "rubicundus" };
+	radix_iter it;
+
+	for (int i = 0; i < 10; ++i)
+		radix_insert(t, (uint8_t *)keys[i], strlen(keys[i]), i == 9 ? NULL : (void *)keys[i], NULL);
+
+	radix_iter_init(&it, t);
+	for (int i = 0; i < 10; ++i)
+	{
+		assert_int_equal(radix_iter_next(&it), 1);
+		assert_int_equal(it.key_len, strlen(sorted[i]));
+		assert_non_null(it.key); /* even for the empty key */
+		assert_memory_equal(it.key, sorted[i], it.key_len);
+		assert_true(it.data == (strcmp(sorted[i], "rom") ? (void *)radix_find(t, it.key, it.key_len) : NULL));
+	}
+	assert_int_equal(radix_iter_next(&it), 0);
+
+	/* first key >= s, whether s is a key, a prefix or falls between keys */
+	assert_int_equal(radix_iter_seek(&it, (uint8_t *)"romanus", 7), 1);
+	assert_int_equal(radix_iter_next(&it), 1);
+	assert_memory_equal(it.key, "romanus", 7);
+	radix_iter_seek(&it, (uint8_t *)"roma", 4);
+	radix_iter_next(&it);
+	assert_memory_equal(it.key, "romane", 6);
+	radix_iter_seek(&it, (uint8_t *)"rubf", 4);
+	radix_iter_next(&it);
+	assert_memory_equal(it.key, "rubicon", 7);
+	radix_iter_seek(&it, (uint8_t *)"s", 1);
+	assert_int_equal(radix_iter_next(&it), 0);
+	radix_iter_free(&it);
+
+	/* "rom" has no value, yet is a key */
+	void *data = (void *)1;
+	assert_null(radix_find(t, (uint8_t *)"rom", 3));
+	assert_int_equal(radix_lookup(t, (uint8_t *)"rom", 3, &data), 1);
+	assert_null(data);
+	assert_int_equal(radix_lookup(t, (uint8_t *)"ro", 2, &data), 0);
+
+	radix_free(t);
+}
+
+static void
+radix_jump_table_should_match_plain_tree(void **state)
+{
+	(void)state;
+
+	radix_tree *plain = radix_new();
+	radix_tree *one = radix_new_flags(RADIX_JUMP_TABLE);
+	radix_tree *two = radix_new_flags(RADIX_JUMP_TABLE2);
+	radix_tree *trees[] = { plain, one, two };
+	uint8_t key[8];
+
+	/* near uniform first bytes, then deletes that empty and recompress whole rows */
+	for (int n = 0; n < 20000; ++n)
+	{
+		key[0] = n * 7 % 61;
+		key[1] = n % 17 * 3;
+		memcpy(key + 2, &n, sizeof(n));
+		for (int k = 0; k < 3; ++k)
+			radix_insert(trees[k], key, 2 + (n % 5 ? 4 : n % 3), (void *)(long)(n + 1), NULL);
+	}
+	for (int n = 0; n < 20000; n += 2)
+	{
+		key[0] = n * 7 % 61;
+		key[1] = n % 17 * 3;
+		memcpy(key + 2, &n, sizeof(n));
+		for (int k = 0; k < 3; ++k)
+			radix_del(trees[k], key, 2 + (n % 5 ? 4 : n % 3), NULL);
+	}
+
+	radix_relayout(two);
+	assert_int_equal(radix_freeze_minimized(one), 1);
+
+	for (int n = 0; n < 20000; ++n)
+	{
+		key[0] = n * 7 % 61;
+		key[1] = n % 17 * 3;
+		memcpy(key + 2, &n, sizeof(n));
+		for (size_t len = 0; len <= 6; ++len)
+		{
+			void *data = radix_find(plain, key, len);
+			assert_true(radix_find(one, key, len) == data);
+			assert_true(radix_find(two, key, len) == data);
+		}
+	}
+
+	radix_free(plain);
+	radix_free(one);
+	radix_free(two);
+}
+
+/* accumulator of radix_parallel_reduce(): the keys seen, their values summed, and
+ * whether they came in key order */
+typedef struct reduce_acc {
+	size_t count;
+	long sum;
+	char first[32];
+	char last[32];
+	bool sorted;
+} reduce_acc;
+
+static void
+reduce_init(void *ctx, void *acc)
+{
+	(void)ctx;
+	memset(acc, 0, sizeof(reduce_acc));
+	((reduce_acc *)acc)->sorted = true;
+}
+
+static void
+reduce_map(void *ctx, void *acc, uint8_t *s, size_t len, void *data)
+{
+	reduce_acc *a = acc;
+	char key[32];
+
+	(void)ctx;
+	snprintf(key, sizeof(key), "%.*s", (int)len, s);
+	if (a->count == 0)
+		strcpy(a->first, key);
+	else if (strcmp(a->last, key) >= 0)
+		a->sorted = false;
+	strcpy(a->last, key);
+	a->sum += (long)data;
+	++a->count;
+}
+
+static void
+reduce_combine(void *ctx, void *result, void *acc)
+{
+	reduce_acc *r = result, *a = acc;
+
+	(void)ctx;
+	if (a->count == 0)
+		return;
+	if (r->count == 0)
+		strcpy(r->first, a->first);
+	else if (strcmp(r->last, a->first) >= 0)
+		r->sorted = false;
+	strcpy(r->last, a->last);
+	r->sorted = r->sorted && a->sorted;
+	r->sum += a->sum;
+	r->count += a->count;
+}
+
+static void
+count_each(void *ctx, uint8_t *s, size_t len, void *data)
+{
+	(void)s;
+	(void)len;
+	(void)data;
+	atomic_fetch_add((atomic_size_t *)ctx, 1);
+}
+
+static void
+radix_parallel_reduce_should_match_sequential_walk(void **state)
+{
+	(void)state;
+
+	radix_tree *t = radix_new();
+	char key[32];
+	size_t count = 0;
+	long sum = 0;
+
+	for (int n = 0; n < 20000; ++n)
+	{
+		size_t len = snprintf(key, sizeof(key), n % 4 ? "user/%d/%d" : "item/%d", n % 997, n);
+		radix_insert(t, (uint8_t *)key, len, (void *)(long)(n + 1), NULL);
+		if (n % 4)
+		{
+			++count;
+			sum += n + 1;
+		}
+	}
+	radix_insert(t, (uint8_t *)"user/", 5, (void *)1L, NULL);
+
+	/* the prefix ends inside the compressed "user/" */
+	for (int nthreads = 1; nthreads <= 8; nthreads *= 2)
+	{
+		reduce_acc r;
+		assert_int_equal(radix_parallel_reduce(t, (uint8_t *)"use", 3, nthreads, sizeof(reduce_acc), reduce_init, reduce_map, reduce_combine, NULL, &r), 1);
+		assert_int_equal(r.count, count + 1);
+		assert_int_equal(r.sum, sum + 1);
+		assert_string_equal(r.first, "user/");
+		assert_string_equal(r.last, "user/996/9969");
+		assert_true(r.sorted);
+
+		atomic_size_t seen = 0;
+		assert_int_equal(radix_parallel_for_each(t, NULL, 0, nthreads, count_each, &seen), 1);
+		assert_int_equal(seen, t->num_elements);
+	}
+
+	/* no key with that prefix: result stays as init left it */
+	reduce_acc r;
+	assert_int_equal(radix_parallel_reduce(t, (uint8_t *)"users", 5, 4, sizeof(reduce_acc), reduce_init, reduce_map, reduce_combine, NULL, &r), 1);
+	assert_int_equal(r.count, 0);
+
+	radix_free(t);
+}
+
 int
 main(void)
 {
@@ -132,6 +1409,27 @@ main(void)
 		cmocka_unit_test(radix_insert_should_compress),
 		cmocka_unit_test(radix_del_vertex_with_no_children_should_cleanup),
 		cmocka_unit_test(radix_del_vertex_with_children_should_compress),
+		cmocka_unit_test(radix_long_shared_prefixes_should_split_and_find),
+		cmocka_unit_test(radix_find_with_finger_should_match_find),
+		cmocka_unit_test(radix_lazy_del_should_defer_compression_to_compact),
+		cmocka_unit_test(radix_relayout_should_keep_tree_usable),
+		cmocka_unit_test(radix_build_parallel_should_match_sequential_inserts),
+		cmocka_unit_test(radix_compact_refs_tree_should_behave_like_default),
+		cmocka_unit_test(radix_inline_values_should_store_records_in_the_tree),
+		cmocka_unit_test(radix_freeze_minimized_should_share_equal_suffixes),
+		cmocka_unit_test(radix_diff_should_report_changes_in_key_order),
+		cmocka_unit_test(radix_match_glob_should_find_matching_keys),
+		cmocka_unit_test(radix_fuzzy_find_should_find_keys_within_distance),
+		cmocka_unit_test(radix_topk_prefix_should_return_best_scored_keys),
+		cmocka_unit_test(radix_cache_should_evict_cold_keys_past_budget),
+		cmocka_unit_test(radix_expire_should_delete_expired_keys_earliest_first),
+		cmocka_unit_test(radix_findv_should_match_keys_across_segments),
+		cmocka_unit_test(radix_filter_should_track_inserts_and_deletes),
+		cmocka_unit_test(radix_hot_keys_should_report_sampled_heavy_hitters),
+		cmocka_unit_test(radix_batch_should_match_single_inserts_and_deletes),
+		cmocka_unit_test(radix_iter_should_visit_keys_in_order),
+		cmocka_unit_test(radix_jump_table_should_match_plain_tree),
+		cmocka_unit_test(radix_parallel_reduce_should_match_sequential_walk),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
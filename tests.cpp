@@ -0,0 +1,284 @@
+#include <cstdarg>
+#include <cstddef>
+#include <csetjmp>
+#include <cmocka.h>
+
+#include <rradix.hpp>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+struct record
+{
+	long a, b, c;
+};
+
+/* boxed, counts the values alive */
+struct counted
+{
+	static inline long live = 0;
+
+	std::string s;
+
+	explicit counted(std::string v)
+		: s(std::move(v))
+	{
+		++live;
+	}
+
+	counted(const counted &o)
+		: s(o.s)
+	{
+		++live;
+	}
+
+	~counted()
+	{
+		--live;
+	}
+};
+
+static void
+tree_slot_should_store_values_in_place(void **state)
+{
+	(void)state;
+
+	rradix::tree<int> t;
+	static_assert(rradix::tree<int>::kind == rradix::storage::slot);
+
+	assert_true(t.insert_or_assign("abc", 0));
+	assert_false(t.insert_or_assign("abc", 5));
+	assert_true(t.insert_or_assign("ab", 0));
+	assert_int_equal(t.size(), 2);
+	assert_int_equal(*t.get("abc"), 5);
+	assert_int_equal(*t.get("ab"), 0);
+	assert_false(t.get("a").has_value());
+	assert_true(t.contains("ab"));
+	assert_false(t.contains("a"));
+
+	std::vector<uint8_t> k{ 'x', 0, 'y' };
+	assert_true(t.insert_or_assign(std::span<const uint8_t>(k), -7));
+	assert_int_equal(*t.get(std::span<const uint8_t>(k)), -7);
+
+	assert_true(t.erase("ab"));
+	assert_false(t.erase("ab"));
+	assert_int_equal(t.size(), 2);
+}
+
+static void
+tree_inline_should_copy_values_into_the_tree(void **state)
+{
+	(void)state;
+
+	rradix::tree<record> t;
+	static_assert(rradix::tree<record>::kind == rradix::storage::inline_value);
+	assert_true(t.handle()->flags & RADIX_INLINE_VALUES);
+
+	for (long i = 0; i < 1000; ++i)
+		assert_true(t.insert_or_assign(std::to_string(i), record{ i, -i, i * 3 }));
+	assert_false(t.insert_or_assign("5", record{ 1, 2, 3 }));
+
+	assert_int_equal(t.size(), 1000);
+	assert_int_equal(t.get("5")->c, 3);
+	assert_int_equal(t.get("999")->b, -999);
+
+	long n = 0;
+	for (auto [key, v] : t)
+		n += key == "5" ? v.a == 1 : v.a == std::stol(std::string(key));
+	assert_int_equal(n, 1000);
+
+	assert_true(t.erase("5"));
+	assert_false(t.contains("5"));
+}
+
+static void
+tree_inline_update_evicting_its_key_should_not_throw(void **state)
+{
+	(void)state;
+
+	/* a key without a value grows when it gets one, past a budget it fits exactly:
+	 * the update evicts the key it updated */
+	rradix::tree<record> t(RADIX_CACHE);
+	assert_true(radix_insert_inline(t.handle(), (uint8_t *)"a", 1, nullptr, nullptr));
+	t.set_memory_budget(t.handle()->memory);
+	assert_int_equal(t.size(), 1);
+
+	assert_false(t.insert_or_assign("a", record{ 1, 2, 3 }));
+	assert_int_equal(t.size(), 0);
+	assert_false(t.contains("a"));
+}
+
+static void
+tree_boxed_should_destroy_replaced_and_deleted_values(void **state)
+{
+	(void)state;
+
+	std::map<std::string, std::string> ref;
+	{
+		rradix::tree<counted> t;
+		static_assert(rradix::tree<counted>::kind == rradix::storage::boxed);
+
+		for (int i = 0; i < 500; ++i)
+		{
+			std::string k = "k" + std::to_string(i % 300), v = "v" + std::to_string(i);
+			assert_int_equal(t.insert_or_assign(k, counted(v)), i < 300);
+			ref[k] = v;
+		}
+		assert_int_equal(counted::live, 300);
+
+		assert_string_equal(t.find("k7")->s.c_str(), ref["k7"].c_str());
+		assert_null(t.find("zz"));
+		assert_string_equal(t.get("k299")->s.c_str(), ref["k299"].c_str());
+
+		assert_true(t.erase("k7"));
+		ref.erase("k7");
+		assert_int_equal(counted::live, 299);
+
+		auto r = ref.begin();
+		for (auto [key, v] : t)
+		{
+			assert_true(key == r->first);
+			assert_true(v.s == r->second);
+			++r;
+		}
+		assert_true(r == ref.end());
+	}
+	assert_int_equal(counted::live, 0);
+}
+
+static void
+tree_move_and_clear_should_keep_ownership(void **state)
+{
+	(void)state;
+
+	{
+		rradix::tree<counted> t(RADIX_CACHE);
+		for (int i = 0; i < 100; ++i)
+			t.insert_or_assign("k" + std::to_string(i), counted("v"));
+
+		/* the eviction callback follows the tree to its new owner */
+		rradix::tree<counted> m(std::move(t));
+		assert_null(t.handle());
+		assert_int_equal(m.size(), 100);
+		m.set_memory_budget(m.handle()->memory / 2);
+		assert_int_equal(counted::live, m.size());
+
+		t = std::move(m);
+		assert_int_equal(counted::live, t.size());
+		for (int i = 0; i < 100; ++i)
+			t.insert_or_assign("n" + std::to_string(i), counted("v"));
+		assert_int_equal(counted::live, t.size());
+
+		size_t budget = t.handle()->memory_budget;
+		t.clear();
+		assert_true(t.empty());
+		assert_true(t.begin() == t.end());
+		assert_int_equal(counted::live, 0);
+		assert_int_equal(t.handle()->memory_budget, budget);
+		assert_true(t.handle()->flags & RADIX_CACHE);
+
+		t.insert_or_assign("a", counted("x"));
+		assert_int_equal(counted::live, 1);
+	}
+	assert_int_equal(counted::live, 0);
+}
+
+static void
+tree_iterator_should_walk_keys_in_order_from_lower_bound(void **state)
+{
+	(void)state;
+
+	rradix::tree<int> t;
+	const char *keys[] = { "ab", "abc", "abd", "b", "ba" };
+	for (int i = 0; i < 5; ++i)
+		t.insert_or_assign(keys[i], i);
+	t.insert_or_assign(std::string("x\0y", 3), 7);
+
+	std::vector<std::string> seen;
+	for (auto [key, v] : t)
+		seen.push_back(std::string(key));
+	assert_int_equal(seen.size(), 6);
+	for (int i = 0; i < 5; ++i)
+		assert_string_equal(seen[i].c_str(), keys[i]);
+	assert_true(seen[5] == std::string("x\0y", 3));
+	assert_int_equal(std::distance(t.begin(), t.end()), 6);
+
+	auto it = t.lower_bound("abca");
+	assert_true(it.key() == "abd");
+	assert_int_equal(it->second, 2);
+
+	it = t.lower_bound("b");
+	assert_true(it->first == "b");
+	auto c = it++;
+	assert_true((*c).first == "b");
+	assert_true(it->first == "ba");
+	assert_true(c != it);
+
+	it = t.lower_bound("c");
+	assert_true(it->first == std::string_view("x\0y", 3));
+	assert_int_equal(it->second, 7);
+	assert_true(++it == t.end());
+	assert_true(t.lower_bound("y") == t.end());
+	assert_true(t.lower_bound("") == t.begin());
+}
+
+static void
+tree_boxed_should_destroy_evicted_and_expired_values(void **state)
+{
+	(void)state;
+
+	{
+		rradix::tree<counted> t(RADIX_CACHE);
+		t.insert_or_assign("warm", counted("w"));
+		t.set_memory_budget(t.handle()->memory * 50);
+
+		for (int i = 0; i < 2000; ++i)
+		{
+			t.insert_or_assign("k" + std::to_string(i), counted(std::to_string(i)));
+			assert_int_equal(counted::live, t.size());
+		}
+		assert_true(t.size() < 2000);
+		assert_true(t.handle()->memory <= t.handle()->memory_budget);
+	}
+	assert_int_equal(counted::live, 0);
+
+	{
+		/* TTL keys set from C hold boxes too: expired ones are destroyed when they
+		 * are swept, deleted or left in the tree */
+		rradix::tree<counted> t(RADIX_TTL);
+		std::allocator<counted> alloc;
+		for (uint64_t i = 1; i <= 3; ++i)
+		{
+			counted *box = alloc.allocate(1);
+			std::construct_at(box, "v");
+			uint8_t key[] = { 'k', (uint8_t)('0' + i) };
+			assert_true(radix_insert_ttl(t.handle(), key, 2, box, i, nullptr));
+		}
+		assert_int_equal(counted::live, 3);
+
+		radix_expire(t.handle(), 2, 1);
+		assert_int_equal(counted::live, 2);
+		assert_false(t.contains("k2"));
+		assert_false(t.erase("k2"));
+		assert_int_equal(counted::live, 1);
+		assert_true(t.contains("k3"));
+	}
+	assert_int_equal(counted::live, 0);
+}
+
+int
+main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(tree_slot_should_store_values_in_place),
+		cmocka_unit_test(tree_inline_should_copy_values_into_the_tree),
+		cmocka_unit_test(tree_inline_update_evicting_its_key_should_not_throw),
+		cmocka_unit_test(tree_boxed_should_destroy_replaced_and_deleted_values),
+		cmocka_unit_test(tree_move_and_clear_should_keep_ownership),
+		cmocka_unit_test(tree_iterator_should_walk_keys_in_order_from_lower_bound),
+		cmocka_unit_test(tree_boxed_should_destroy_evicted_and_expired_values),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}